@@ -0,0 +1,135 @@
+
+#ifndef _DESTINATION_CACHE_H_INCLUDE
+#define _DESTINATION_CACHE_H_INCLUDE
+
+#include "sockets-config.h"
+#include "socket_include.h"
+#include "Socket.h"
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/** Default lifetime (seconds) of a resolved destination address. */
+#define DESTINATION_CACHE_TTL 60
+/** Default maximum number of cached destinations per sockethandler. */
+#define DESTINATION_CACHE_MAX 1024
+/** Maximum lifetime (seconds) of a failed lookup. */
+#define DESTINATION_CACHE_RETRY 5
+/** Maximum number of datagrams kept per destination while it is resolved. */
+#define DESTINATION_CACHE_QUEUE 16
+
+namespace dai {
+
+class UdpSocket;
+
+/**
+ * Resolved destination addresses of a sockethandler, keyed by host and port.
+ * A host name is resolved once, and the prepared address is used until its
+ * lifetime has passed. With the asynchronous resolver enabled a new host
+ * has no address until the answer arrives, and an expired address is still
+ * used while it is refreshed; without it the lookup blocks. Datagrams sent
+ * to a host without an address yet are queued, up to DESTINATION_CACHE_QUEUE
+ * per destination, and sent when the answer arrives. Failed lookups
+ * are retried after at most DESTINATION_CACHE_RETRY seconds. Numeric hosts
+ * are parsed once and never expire.
+ * Used by ISocketHandler::GetDestination, owned by the sockethandler.
+ * Not thread safe, use it in the sockethandler thread.
+ * \ingroup basic
+ */
+class DestinationCache : public Socket
+{
+public:
+    DestinationCache(ISocketHandler& h);
+    ~DestinationCache();
+
+    /**
+     * Prepared address of host:port.
+     * \param ipv6 Ipv6 address wanted
+     * \param sa Socket address, valid if true is returned
+     * \param sa_len Socket address length
+     * \return false if the host can not be resolved, or is being resolved
+     */
+    bool Get(const std::string& host, port_t port, bool ipv6, struct sockaddr_storage& sa, socklen_t& sa_len);
+
+    /**
+     * Keep a datagram of p until host:port is resolved.
+     * \return false if host:port is not being resolved, or its queue is full
+     */
+    bool Queue(UdpSocket *p, const std::string& host, port_t port, bool ipv6, const char *data, int len, int flags);
+
+    /** Drop the queued datagrams of a deleted socket. */
+    void Remove(Socket *p);
+
+    /** Lifetime of resolved addresses. */
+    void SetTtl(long sec);
+
+    /** Maximum number of cached destinations. */
+    void SetMaxEntries(size_t n);
+
+    /** Number of cached destinations. */
+    size_t Size() const;
+
+#ifdef ENABLE_RESOLVER
+    void OnResolved(int id, ipaddr_t a, port_t port);
+#ifdef ENABLE_IPV6
+    void OnResolved(int id, in6_addr& a, port_t port);
+#endif
+    void OnResolveFailed(int id);
+#endif
+
+    void OnOptions(int, int, int, SOCKET) {}
+
+private:
+    DestinationCache(const DestinationCache& s) = delete;
+    DestinationCache& operator=(const DestinationCache& ) = delete;
+
+    /** Datagram waiting for the address of its destination. */
+    struct Datagram
+    {
+        UdpSocket   *socket;
+        std::string  data;
+        int          flags;
+    };
+
+    struct Entry
+    {
+        std::string             host;
+        port_t                  port;
+        bool                    ipv6;
+        struct sockaddr_storage sa;
+        socklen_t               sa_len;   ///< 0 if the lookup failed
+        time_t                  expires;  ///< 0 for numeric hosts
+        bool                    refreshing;
+        std::vector<Datagram>   queue;    ///< Sent when resolved
+    };
+
+    /** Lookup key of host:port in m_key. */
+    const std::string& Key(const std::string& host, port_t port, bool ipv6);
+    /** Resolve e synchronously. */
+    bool Lookup(Entry& e);
+    /** Refresh an expired e, asynchronously if the resolver is enabled. */
+    void Refresh(const std::string& key, Entry& e, time_t now);
+    /** Lifetime of a failed lookup. */
+    long RetryTtl() const;
+#ifdef ENABLE_RESOLVER
+    /** Entry of a finished asynchronous lookup. */
+    Entry *Resolved(int id);
+    /** Send the queued datagrams of resolved e. */
+    void Flush(Entry& e);
+#endif
+
+    std::unordered_map<std::string, Entry> m_entries;
+    std::map<int, std::string> m_resolving; ///< Resolve id -> key
+    std::string m_key;   ///< Reused to build the lookup key
+    long        m_ttl;
+    size_t      m_max_entries;
+    size_t      m_queued;  ///< Datagrams in all queues
+};
+
+
+}//namespace dai
+
+#endif//_DESTINATION_CACHE_H_INCLUDE
@@ -0,0 +1,141 @@
+
+#ifndef _DNS_CLIENT_H_INCLUDE
+#define _DNS_CLIENT_H_INCLUDE
+
+#include "sockets-config.h"
+
+#ifdef ENABLE_RESOLVER
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Socket.h"
+#include "ResolverPool.h"
+
+/** Default time (usec) to wait for an answer before the next server is tried. */
+#define DNS_TIMEOUT  5000000
+/** Default number of times each server is tried. */
+#define DNS_ATTEMPTS 2
+/** Dns server port. */
+#define DNS_PORT     53
+
+namespace dai {
+
+/**
+ * Asynchronous dns client of a sockethandler. Queries for A, AAAA, PTR
+ * and SRV records are sent over udp to the name servers of resolv.conf,
+ * truncated answers are asked again over tcp. Retries and timeouts run on
+ * the sockethandler timers; no threads are used.
+ * Each query is sent from its own udp socket connected to the name server,
+ * on a source port picked by the system, and query id's are taken from
+ * Utility::RandomBytes, so that answers are hard to spoof.
+ * Names found in the hosts file are answered without a query.
+ * Enabled with ISocketHandler::EnableDnsClient, owned by the sockethandler.
+ * \ingroup async
+ */
+class DnsClient : public Socket
+{
+public:
+    /** Socket of one query - internal use. */
+    class Transport
+    {
+    public:
+        Transport(DnsClient& client, uint16_t id) : m_client(&client), m_id(id) {}
+        virtual ~Transport();
+
+        /** The query is done, close without reporting back. */
+        void Detach();
+
+    protected:
+        /** Answer received on this socket. */
+        void Answer(const char *buf, size_t len, bool tcp);
+
+    private:
+        /** Close the socket. */
+        virtual void Drop() = 0;
+
+        DnsClient *m_client;
+        uint16_t   m_id;
+    };
+
+    DnsClient(ISocketHandler& h);
+    ~DnsClient();
+
+    /**
+     * Use the name servers and timeout / attempts options of a
+     * resolv.conf file. Ipv6 name servers are not used.
+     * \return false if the file can not be read
+     */
+    bool LoadResolvConf(const std::string& path = "/etc/resolv.conf");
+
+    /**
+     * Answer names of a hosts file without a query.
+     * \return false if the file can not be read
+     */
+    bool LoadHosts(const std::string& path = "/etc/hosts");
+
+    /** Add a name server, ipv4 address. */
+    void AddServer(const std::string& ip, port_t port = DNS_PORT);
+    /** Remove all name servers. */
+    void ClearServers();
+    size_t Servers() const;
+
+    /** Time to wait for an answer before the next server is tried. */
+    void SetTimeout(long usec);
+    /** Number of times each server is tried. */
+    void SetAttempts(int n);
+
+    /** Start a lookup - internal use. The job is returned on its completion queue. */
+    void Query(ResolverPool::Job *job);
+
+    /** Query timeouts - internal use. */
+    void OnInternalTimer(int id);
+
+    void OnOptions(int, int, int, SOCKET) {}
+
+private:
+    DnsClient(const DnsClient& s) = delete;
+    DnsClient& operator=(const DnsClient& ) = delete;
+
+    /** Query waiting for an answer. */
+    struct Pending
+    {
+        ResolverPool::Job *job;
+        std::string        packet;   ///< Query message
+        size_t             server;   ///< Server of the last send
+        int                sends;
+        Transport         *udp;      ///< Socket of the last send
+        Transport         *tcp;      ///< Socket asking a truncated answer again
+    };
+
+    /** Timer id of a query id. */
+    static int TimerId(uint16_t id) { return -1 - (int)id; }
+
+    bool Hosts(ResolverPool::Job *job);
+    void Send(uint16_t id, Pending& q);
+    void Answer(uint16_t id, const char *buf, size_t len, bool tcp);
+    /** Transport of query id is deleted. */
+    void Gone(uint16_t id, Transport *t);
+    /** Close the sockets of q. */
+    void CloseSockets(Pending& q);
+    bool Records(Pending& q, const unsigned char *msg, size_t len, size_t pos, int count);
+    void Done(uint16_t id, bool ok);
+    void Retry(uint16_t id, Pending& q);
+
+    std::vector<struct sockaddr_in>     m_servers;
+    std::map<uint16_t, Pending>         m_pending;
+    std::map<std::string, ipaddr_t>     m_hosts;    ///< Hosts file, name -> ipv4
+#ifdef ENABLE_IPV6
+    std::map<std::string, in6_addr>     m_hosts6;   ///< Hosts file, name -> ipv6
+#endif
+    std::map<std::string, std::string>  m_names;    ///< Hosts file, address -> name
+    long                                m_timeout;
+    int                                 m_attempts;
+};
+
+}//namespace dai
+
+#endif // ENABLE_RESOLVER
+
+#endif//_DNS_CLIENT_H_INCLUDE
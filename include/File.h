@@ -37,6 +37,7 @@ public:
     void reset_read() const;
     void reset_write();
     const std::string& Path() const;
+    int fd() const;
 
 private:
     // copy constructor
@@ -35,6 +35,12 @@ public:
     virtual void reset_write() = 0;
 
     virtual const std::string& Path() const = 0;
+
+    /** Underlying file descriptor of an open file, or -1 if there is none. */
+    virtual int fd() const
+    {
+        return -1;
+    }
 };
 
 
@@ -6,15 +6,21 @@
 #include "socket_include.h"
 #include "Socket.h"
 #include "StdLog.h"
+#include "TcpInfo.h"
 
 #include <list>
 #include <map>
+#include <memory>
 
 
 namespace dai {
 
 class SocketAddress;
 class IMutex;
+class PacketPool;
+class DnsClient;
+class Wakeup;
+class UdpSocket;
 
 
 /**
@@ -35,10 +41,21 @@ public:
     {
     public:
         PoolSocket(ISocketHandler& h, Socket *src) : Socket(h)
+#ifdef HAVE_OPENSSL
+            , m_ssl(NULL)
+            , m_ssl_ctx(NULL)
+#endif
         {
             CopyConnection( src );
             SetIsClient();
         }
+        ~PoolSocket()
+        {
+#ifdef HAVE_OPENSSL
+            if (m_ssl)
+                SSL_free(m_ssl);
+#endif
+        }
 
         void OnRead()
         {
@@ -46,7 +63,43 @@ public:
             SetCloseAndDelete();
         }
 
+        /** Idle timeout. */
+        void OnTimer(int)
+        {
+            SetCloseAndDelete();
+        }
+
         void OnOptions(int, int, int, SOCKET) {}
+
+#ifdef HAVE_OPENSSL
+        int Close()
+        {
+            if (m_ssl)
+                SSL_shutdown(m_ssl);
+            return Socket::Close();
+        }
+
+        /** Negotiated tls connection, owned while pooled. */
+        void SetSsl(SSL *ssl, SSL_CTX *ctx)
+        {
+            m_ssl = ssl;
+            m_ssl_ctx = ctx;
+        }
+        SSL_CTX *GetSslContext()
+        {
+            return m_ssl_ctx;
+        }
+        SSL *GetSsl()
+        {
+            return m_ssl;
+        }
+#endif
+
+#ifdef HAVE_OPENSSL
+    private:
+        SSL     *m_ssl;
+        SSL_CTX *m_ssl_ctx;
+#endif
     };
 #endif
 
@@ -92,6 +145,16 @@ public:
      */
     virtual bool IsThreaded() = 0;
 
+    /**
+     * Number of sockethandler threads, 0 if not threaded
+     */
+    virtual size_t NumberOfThreads() = 0;
+
+    /**
+     * Sockethandler of thread i, 0 <= i < NumberOfThreads()
+     */
+    virtual ISocketHandler& GetThreadHandler(size_t i) = 0;
+
     /**
      * Enable select release
      */
@@ -102,6 +165,11 @@ public:
      */
     virtual void Release() = 0;
 
+    /**
+     * Wakes this sockethandler from other threads, enables select release.
+     */
+    virtual std::shared_ptr<Wakeup> GetWakeup() = 0;
+
     /**
      * Get mutex reference for threadsafe operations.
      */
@@ -206,6 +274,90 @@ public:
     virtual void SetRetry(bool = true) = 0;
     virtual void SetClose(bool = true) = 0;
 
+    /**
+     * Flush the output buffer of a socket once, after the current event
+     * dispatch. Used by TcpSocket in send coalescing mode, and by
+     * UdpSocket for queued datagrams.
+     */
+    virtual void AddFlush(Socket *) = 0;
+
+    // -------------------------------------------------------------------------
+    // Timers
+    // -------------------------------------------------------------------------
+    /**
+     * Schedule a Socket::OnTimer callback. A timer with the same id on the
+     * same socket is replaced. Timer id's < 0 are reserved for library use
+     * and are delivered to Socket::OnInternalTimer.
+     * \param usec Microseconds until the callback
+     * \param id Timer id
+     */
+    virtual void AddTimer(Socket *, long usec, int id = 0) = 0;
+
+    /**
+     * Cancel a timer scheduled with AddTimer.
+     */
+    virtual void RemoveTimer(Socket *, int id = 0) = 0;
+
+    // -------------------------------------------------------------------------
+    // Rate limits
+    // -------------------------------------------------------------------------
+    /**
+     * Limit total number of bytes read per second by all sockets in this handler.
+     * \param bytes_per_sec Rate, 0 disables the limit
+     * \param burst Maximum burst, 0 means one second worth of data
+     */
+    virtual void SetInputRateLimit(uint64_t bytes_per_sec, uint64_t burst = 0) = 0;
+
+    /**
+     * Limit total number of bytes written per second by all sockets in this handler.
+     * \param bytes_per_sec Rate, 0 disables the limit
+     * \param burst Maximum burst, 0 means one second worth of data
+     */
+    virtual void SetOutputRateLimit(uint64_t bytes_per_sec, uint64_t burst = 0) = 0;
+
+    /** Handler input rate limit token bucket. */
+    virtual TokenBucket& InputRateLimit() = 0;
+
+    /** Handler output rate limit token bucket. */
+    virtual TokenBucket& OutputRateLimit() = 0;
+
+    // -------------------------------------------------------------------------
+    // TCP_INFO sampling
+    // -------------------------------------------------------------------------
+    /**
+     * Sample TCP_INFO of a TcpSocket every usec microseconds.
+     * Used by TcpSocket::SetTcpInfoInterval.
+     */
+    virtual void AddTcpInfo(Socket *, long usec) = 0;
+
+    /**
+     * Stop sampling TCP_INFO of a socket.
+     */
+    virtual void RemoveTcpInfo(Socket *) = 0;
+
+    /**
+     * Maximum number of samples taken per Select call, at least one.
+     * Samples that are due but over budget are taken in the next call.
+     */
+    virtual void SetTcpInfoBudget(size_t) = 0;
+
+    /**
+     * TCP_INFO samples of all sockets in this handler.
+     */
+    virtual TcpInfoStats& GetTcpInfoStats() = 0;
+
+#ifdef HAVE_OPENSSL
+    // -------------------------------------------------------------------------
+    // TLS handshake offload
+    // -------------------------------------------------------------------------
+    /**
+     * Run the next handshake step of a socket on the SSLHandshakePool.
+     * The socket is not monitored until the step is done.
+     * Used by TcpSocket::SSLNegotiate when SetSslOffload is set.
+     */
+    virtual void AddSSLHandshake(Socket *, SSL *, bool server) = 0;
+#endif
+
 
     // -------------------------------------------------------------------------
     // Connection pool
@@ -213,8 +365,15 @@ public:
 #ifdef ENABLE_POOL
     /**
      * Find available open connection (used by connection pool).
+     * \param identity TLS identity of the connection (session key), empty for plain tcp
+     */
+    virtual ISocketHandler::PoolSocket *FindConnection(int type, const std::string& protocol, SocketAddress&, const std::string& identity) = 0;
+
+    /**
+     * Keep a closing client connection in the pool (used by CheckClose).
+     * \return false if not pooled
      */
-    virtual ISocketHandler::PoolSocket *FindConnection(int type, const std::string& protocol, SocketAddress&) = 0;
+    virtual bool AddConnection(Socket *) = 0;
 
     /**
      * Enable connection pool (by default disabled).
@@ -225,6 +384,30 @@ public:
      * \return true if connection pool is enabled
      */
     virtual bool PoolEnabled() = 0;
+
+    /**
+     * Maximum idle connections kept per destination.
+     */
+    virtual void SetPoolMaxIdle(size_t) = 0;
+
+    /**
+     * Maximum idle connections kept in total.
+     */
+    virtual void SetPoolMaxTotal(size_t) = 0;
+
+    /**
+     * Idle connections are closed after usec microseconds.
+     */
+    virtual void SetPoolIdleTimeout(long usec) = 0;
+
+    /** Number of idle connections in the pool. */
+    virtual size_t PoolSize() = 0;
+    /** Connections reused from the pool. */
+    virtual uint64_t PoolHits() = 0;
+    /** Connections opened while the pool was enabled, and no idle connection was available. */
+    virtual uint64_t PoolMisses() = 0;
+    /** Idle connections closed; timeout, limits, or closed by peer. */
+    virtual uint64_t PoolEvictions() = 0;
 #endif // ENABLE_POOL
 
     // -------------------------------------------------------------------------
@@ -283,8 +466,8 @@ public:
     // DNS resolve server
     // -------------------------------------------------------------------------
 #ifdef ENABLE_RESOLVER
-    /** Enable asynchronous DNS.
-     * \param port Listen port of asynchronous dns server
+    /** Enable asynchronous DNS, lookups run in the ResolverPool.
+     * \param port Not used, kept for compatibility
      */
     virtual void EnableResolver(port_t = 16667) = 0;
 
@@ -313,12 +496,12 @@ public:
 #endif
 
     /**
-     * Get listen port of asynchronous dns server.
+     * Port given to EnableResolver.
      */
     virtual port_t GetResolverPort() = 0;
 
     /**
-     * Resolver thread ready for queries
+     * Resolver ready for queries
      */
     virtual bool ResolverReady() = 0;
 
@@ -326,8 +509,57 @@ public:
      * Returns true if socket waiting for a resolve event.
      */
     virtual bool Resolving(Socket *) = 0;
+
+    /**
+     * Queue a dns SRV request, always answered by the DnsClient.
+     * \param name Service name, e.g. "_sip._udp.example.com"
+     */
+    virtual int ResolveSrv(Socket *, const std::string& name) = 0;
+
+    /**
+     * Resolve with the DnsClient of the sockethandler instead of the
+     * ResolverPool threads.
+     */
+    virtual void EnableDnsClient(bool = true) = 0;
+
+    /** Check DnsClient status. */
+    virtual bool DnsClientEnabled() = 0;
+
+    /** The DnsClient of the sockethandler, created when first used and deleted with the sockethandler. */
+    virtual DnsClient& GetDnsClient() = 0;
 #endif//ENABLE_RESOLVER
 
+    // -------------------------------------------------------------------------
+    // Destination cache
+    // -------------------------------------------------------------------------
+    /**
+     * Prepared socket address of host:port, resolved once and kept for the
+     * destination ttl, resolved by the asynchronous resolver if enabled.
+     * Call in the sockethandler thread.
+     * \param ipv6 Ipv6 address wanted
+     * \return false if the host can not be resolved, or is being resolved
+     */
+    virtual bool GetDestination(const std::string& host, port_t port, bool ipv6, struct sockaddr_storage& sa, socklen_t& sa_len) = 0;
+
+    /**
+     * Keep a datagram of p while host:port is being resolved, p sends it
+     * when the address arrives. Call in the sockethandler thread.
+     * eturn false if host:port is not being resolved, or its queue is full
+     */
+    virtual bool QueueDestination(UdpSocket *p, const std::string& host, port_t port, bool ipv6, const char *data, int len, int flags) = 0;
+
+    /** Lifetime of cached destination addresses, seconds. */
+    virtual void SetDestinationTtl(long sec) = 0;
+
+    // -------------------------------------------------------------------------
+    // Packet receive buffers
+    // -------------------------------------------------------------------------
+    /**
+     * Pool of receive buffers of bufsz bytes, used by UdpSocket's in
+     * packet receive mode.
+     */
+    virtual PacketPool& GetPacketPool(size_t bufsz) = 0;
+
 #ifdef ENABLE_DETACH
     /**
      * Indicates that the handler runs under SocketThread.
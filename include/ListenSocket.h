@@ -7,6 +7,7 @@
 #   include <stdlib.h>
 #else
 #   include <errno.h>
+#   include <netinet/tcp.h>
 #endif
 
 
@@ -42,6 +43,7 @@ public:
     ListenSocket(ISocketHandler& h, bool use_creator = true) :
         Socket(h),
         m_depth(0),
+        m_fastopen_qlen(0),
         m_creator(NULL),
         m_bHasCreate(false)
     {
@@ -309,6 +311,13 @@ public:
 #endif
             return -1;
         }
+#ifdef TCP_FASTOPEN
+        if (m_fastopen_qlen > 0 &&
+            setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN, (char *)&m_fastopen_qlen, sizeof(m_fastopen_qlen)) == -1)
+        {
+            Handler().LogError(this, "setsockopt(IPPROTO_TCP, TCP_FASTOPEN)", Errno, StrError(Errno), LOG_LEVEL_WARNING);
+        }
+#endif
         if (listen(s, depth) == -1)
         {
             Handler().LogError(this, "listen", Errno, StrError(Errno), LOG_LEVEL_FATAL);
@@ -339,6 +348,27 @@ public:
         return m_depth;
     }
 
+    /**
+     * Accept TCP Fast Open data in the SYN, call before Bind.
+     * \param qlen Max number of pending fast open requests, 0 disables
+     */
+    void SetTcpFastOpen(int qlen = 256)
+    {
+#ifdef TCP_FASTOPEN
+        m_fastopen_qlen = qlen;
+#else
+        Handler().LogError(this, "socket option not available", 0, "TCP_FASTOPEN", LOG_LEVEL_INFO);
+#endif
+    }
+
+    /**
+     * Return fast open queue length.
+     */
+    int GetTcpFastOpen()
+    {
+        return m_fastopen_qlen;
+    }
+
     /**
      * OnRead on a ListenSocket receives an incoming connection.
      */
@@ -536,6 +566,7 @@ private:
     }
 
     int  m_depth{};
+    int  m_fastopen_qlen{};
     X   *m_creator;
     bool m_bHasCreate{};
 };
@@ -0,0 +1,138 @@
+
+#ifndef _PACKET_POOL_H_INCLUDE
+#define _PACKET_POOL_H_INCLUDE
+
+#include "sockets-config.h"
+#include "socket_include.h"
+#include "Mutex.h"
+
+#include <vector>
+
+/** Default maximum number of free buffers kept by a PacketPool. */
+#define PACKET_POOL_MAX_FREE 1024
+
+namespace dai {
+
+class Packet;
+
+/**
+ * Receive buffers of one size, drawn by UdpSocket's in packet receive mode
+ * and owned by the application through Packet handles. Buffers are
+ * returned when the handle is released, from any thread.
+ * Owned by the sockethandler, see ISocketHandler::GetPacketPool; the pool
+ * is deleted when the sockethandler is gone and all buffers are returned.
+ * \ingroup basic
+ */
+class PacketPool
+{
+public:
+    /** Buffer with datagram information, the data follows the header. */
+    struct Block
+    {
+        PacketPool             *pool;
+        size_t                  len;
+        struct sockaddr_storage sa;
+        socklen_t               sa_len;
+        struct timeval          ts;
+        size_t                  segment;  ///< Coalesced datagram size, 0 if not coalesced
+
+        char *Data() { return reinterpret_cast<char *>(this + 1); }
+    };
+
+    /**
+     * \param bufsz Size of each buffer
+     */
+    PacketPool(size_t bufsz);
+
+    /** Size of each buffer. */
+    size_t BufferSize() const;
+
+    /** Maximum number of free buffers kept, others are deleted. */
+    void SetMaxFree(size_t n);
+
+    /** Buffers owned by sockets and packets. */
+    size_t Outstanding() const;
+    /** Free buffers. */
+    size_t Free() const;
+
+    /** Append n buffers to blocks - internal use. */
+    void Get(std::vector<Block *>& blocks, size_t n);
+    /** Return a buffer - internal use. */
+    void Put(Block *);
+
+    /** Sockethandler is gone, delete the pool when all buffers are returned. */
+    void Close();
+
+private:
+    ~PacketPool();
+    PacketPool(const PacketPool& ) = delete;
+    PacketPool& operator=(const PacketPool& ) = delete;
+
+    Mutex                m_mutex;
+    size_t               m_bufsz;
+    size_t               m_max_free;
+    size_t               m_outstanding;
+    std::vector<Block *> m_free;
+    bool                 m_b_closed;
+};
+
+
+/**
+ * A received datagram owned by the application; data, sender address and
+ * receive time. Movable, not copyable. The buffer goes back to its
+ * PacketPool when the packet is released or destroyed, in any thread.
+ * \ingroup basic
+ */
+class Packet
+{
+public:
+    Packet() : m_block(NULL) {}
+    explicit Packet(PacketPool::Block *b) : m_block(b) {}
+    Packet(Packet&& p) : m_block(p.m_block) { p.m_block = NULL; }
+    ~Packet() { Release(); }
+
+    Packet& operator=(Packet&& p)
+    {
+        if (this != &p)
+        {
+            Release();
+            m_block = p.m_block;
+            p.m_block = NULL;
+        }
+        return *this;
+    }
+
+    /** Return the buffer to its pool. */
+    void Release()
+    {
+        if (m_block)
+        {
+            m_block -> pool -> Put(m_block);
+            m_block = NULL;
+        }
+    }
+
+    bool IsValid() const { return m_block != NULL; }
+
+    char *Data() { return m_block -> Data(); }
+    const char *Data() const { return m_block -> Data(); }
+    size_t Size() const { return m_block -> len; }
+    /** Sender address. */
+    struct sockaddr *SockAddr() { return reinterpret_cast<struct sockaddr *>(&m_block -> sa); }
+    socklen_t SockAddrLen() const { return m_block -> sa_len; }
+    /** Receive time, from SO_TIMESTAMP if enabled. */
+    const struct timeval& Timestamp() const { return m_block -> ts; }
+    /** Size of the datagrams in a coalesced (UDP_GRO) packet, 0 if one datagram. */
+    size_t Segment() const { return m_block -> segment; }
+
+private:
+    Packet(const Packet& ) = delete;
+    Packet& operator=(const Packet& ) = delete;
+
+    PacketPool::Block *m_block;
+};
+
+
+}//namespace dai
+
+#endif//_PACKET_POOL_H_INCLUDE
@@ -0,0 +1,151 @@
+
+#ifndef _RESOLVER_POOL_H_INCLUDE
+#define _RESOLVER_POOL_H_INCLUDE
+
+#include "sockets-config.h"
+
+#ifdef ENABLE_RESOLVER
+
+#include <atomic>
+#include <ctime>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "socket_include.h"
+#include "Socket.h"
+#include "Mutex.h"
+#include "WorkerPool.h"
+
+/** Default number of resolver worker threads. */
+#define RESOLVER_THREADS 4
+/** Results are reused for this many seconds. */
+#define RESOLVER_CACHE_TTL 3600
+/** Failed lookups are reused for this many seconds. */
+#define RESOLVER_CACHE_RETRY 5
+/** Maximum number of cached results. */
+#define RESOLVER_CACHE_MAX 10000
+
+namespace dai {
+
+class Wakeup;
+
+/**
+ * Process wide pool of threads running blocking name lookups for the
+ * asynchronous resolver of the sockethandlers. Finished lookups are pushed
+ * on a lock free completion queue of the requesting sockethandler, and the
+ * sockethandler is woken to call Socket::OnResolved / OnReverseResolved /
+ * OnResolveFailed in its own thread.
+ * \ingroup async
+ */
+class ResolverPool : public WorkerPool
+{
+public:
+    enum Query
+    {
+        QUERY_A,    ///< Host name to ipv4 address
+        QUERY_AAAA, ///< Host name to ipv6 address
+        QUERY_PTR,  ///< Ipv4 address to host name
+        QUERY_PTR6, ///< Ipv6 address to host name
+        QUERY_SRV   ///< Service name to SRV records, DnsClient only
+    };
+
+    class Queue;
+
+    /** One lookup. */
+    struct Job
+    {
+        Job                   *next;   ///< Completion queue link
+        std::shared_ptr<Queue> queue;  ///< Completion queue, until pushed
+        Socket                *socket;
+        socketuid_t            uid;
+        int                    id;
+        Query                  query;
+        std::string            host;
+        port_t                 port;
+        ipaddr_t               a;
+#ifdef ENABLE_IPV6
+        in6_addr               a6;
+#endif
+        bool                   ok;
+        std::string            name;   ///< Reverse lookup result
+        std::vector<Socket::SrvRecord> srv;
+    };
+
+    /**
+     * Completed lookups of one sockethandler. Pushed by the workers and
+     * taken by the sockethandler without a lock.
+     */
+    class Queue
+    {
+    public:
+        /**
+         * \param wakeup Wakes the sockethandler when a worker has pushed a job
+         */
+        Queue(const std::shared_ptr<Wakeup>& wakeup) : m_head(NULL), m_wakeup(wakeup) {}
+        ~Queue();
+
+        void Push(Job *job);
+        /** Wake the sockethandler to take the pushed jobs. */
+        void Wake();
+        /** All completed lookups, oldest first. */
+        Job *Take();
+
+        bool Empty() const { return m_head.load(std::memory_order_relaxed) == NULL; }
+
+    private:
+        Queue(const Queue& ) = delete;
+        Queue& operator=(const Queue& ) = delete;
+
+        std::atomic<Job *> m_head;
+        std::shared_ptr<Wakeup> m_wakeup;
+    };
+
+    /** The process wide pool. */
+    static ResolverPool& Instance();
+
+    /** Queue a lookup, job is returned on job -> queue. */
+    void Post(Job *job);
+
+    /** Return a finished job on its completion queue. */
+    static void Complete(Job *job);
+
+    /** Lookups run, not counting cached results. */
+    uint64_t Lookups() const;
+
+private:
+    ResolverPool();
+    ~ResolverPool();
+    ResolverPool(const ResolverPool& ) = delete;
+    ResolverPool& operator=(const ResolverPool& ) = delete;
+
+    /** Cached result of a query. */
+    struct Result
+    {
+        bool        ok;
+        ipaddr_t    a;
+#ifdef ENABLE_IPV6
+        in6_addr    a6;
+#endif
+        std::string name;
+        time_t      time;
+    };
+
+    void Work();
+    /** Run the lookup of job, blocking. */
+    void Lookup(Job *job);
+    std::string CacheKey(const Job *job);
+
+    std::list<Job *>               m_queue;
+    Mutex                          m_cache_mutex;
+    std::map<std::string, Result>  m_cache;
+    std::atomic<uint64_t>          m_lookups;
+};
+
+}//namespace dai
+
+#endif // ENABLE_RESOLVER
+
+#endif//_RESOLVER_POOL_H_INCLUDE
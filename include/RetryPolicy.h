@@ -0,0 +1,64 @@
+
+#ifndef _RETRY_POLICY_H_INCLUDE
+#define _RETRY_POLICY_H_INCLUDE
+
+#include "sockets-config.h"
+
+namespace dai {
+
+/**
+ * Connect retry policy, exponential backoff with full jitter.
+ * The delay before retry n (0-based) is a random value between 0 and
+ * min(cap, base * multiplier^n), or exactly that value without jitter.
+ * \ingroup basic
+ */
+class RetryPolicy
+{
+public:
+    /**
+     * Disabled policy, connect retries are paced by the connect timeout.
+     */
+    RetryPolicy();
+
+    /**
+     * \param base_usec Delay before first retry
+     * \param multiplier Delay growth per retry
+     * \param cap_usec Maximum delay
+     * \param max_attempts Maximum number of retries, -1 unlimited
+     * \param jitter Full jitter
+     */
+    RetryPolicy(long base_usec, double multiplier, long cap_usec, int max_attempts = -1, bool jitter = true);
+
+    long BaseDelay() const;
+    double Multiplier() const;
+    long MaxDelay() const;
+    int MaxAttempts() const;
+    bool Jitter() const;
+
+    /**
+     * \return true if a policy has been set
+     */
+    bool Enabled() const;
+
+    /**
+     * \return true if retry n (0-based) may be made
+     */
+    bool Retry(int n) const;
+
+    /**
+     * Microseconds to wait before retry n (0-based).
+     */
+    long Delay(int n) const;
+
+private:
+    bool   m_b_enabled;
+    long   m_base;
+    double m_multiplier;
+    long   m_cap;
+    int    m_max_attempts;
+    bool   m_b_jitter;
+};
+
+}//namespace dai
+
+#endif//_RETRY_POLICY_H_INCLUDE
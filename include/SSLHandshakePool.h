@@ -0,0 +1,103 @@
+
+#ifndef _SSL_HANDSHAKE_POOL_H_INCLUDE
+#define _SSL_HANDSHAKE_POOL_H_INCLUDE
+
+#include "sockets-config.h"
+
+#ifdef HAVE_OPENSSL
+
+#ifdef _WIN32
+#   include <winsock2.h>
+#endif
+#include <openssl/ssl.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "socket_include.h"
+#include "WorkerPool.h"
+
+/** Default number of handshake worker threads. */
+#define SSL_HANDSHAKE_THREADS 2
+
+namespace dai {
+
+class ISocketHandler;
+class Socket;
+class Wakeup;
+
+/**
+ * Process wide pool of threads running TLS handshake steps
+ * (SSL_accept / SSL_connect) for TcpSocket's with SetSslOffload.
+ * The socket is not monitored by its sockethandler while a step runs,
+ * and continues in the sockethandler thread when the step is done;
+ * the private key operations do not stall the other connections of
+ * the handler. A finished step wakes the sockethandler through its
+ * Wakeup, the sockethandler does not poll.
+ * \ingroup basic
+ */
+class SSLHandshakePool : public WorkerPool
+{
+public:
+    /** One handshake step. */
+    struct Job
+    {
+        ISocketHandler *handler;
+        Socket         *socket;
+        socketuid_t     uid;
+        SSL            *ssl;
+        bool            server;
+        int             result; ///< Return value of SSL_accept / SSL_connect
+        int             error;  ///< SSL_get_error, in the worker thread
+    };
+
+    /** The process wide pool. */
+    static SSLHandshakePool& Instance();
+
+    /** Queue a handshake step - internal use. \sa ISocketHandler::AddSSLHandshake */
+    void Post(ISocketHandler& h, Socket *p, SSL *ssl, bool server);
+
+    /**
+     * Move finished steps of a sockethandler to jobs.
+     * \return true if steps of the sockethandler are still running
+     */
+    bool Collect(ISocketHandler& h, std::vector<Job>& jobs);
+
+    /**
+     * Drop the step of an ssl connection, waits if it is running.
+     */
+    void Cancel(SSL *ssl);
+
+    /** Handshake steps run. */
+    uint64_t Handshakes() const;
+
+private:
+    SSLHandshakePool();
+    ~SSLHandshakePool();
+    SSLHandshakePool(const SSLHandshakePool& ) = delete;
+    SSLHandshakePool& operator=(const SSLHandshakePool& ) = delete;
+
+    /** Steps of one sockethandler. */
+    struct Queue
+    {
+        Queue() : pending(0) {}
+        size_t          pending; ///< Queued, running, or done and not collected
+        std::list<Job>  done;
+        std::shared_ptr<Wakeup> wakeup;
+    };
+
+    void Work();
+
+    std::list<Job>                 m_queue;
+    std::vector<SSL *>             m_running;
+    std::map<ISocketHandler *, Queue> m_handlers;
+    std::atomic<uint64_t>          m_handshakes;
+};
+
+}//namespace dai
+
+#endif // HAVE_OPENSSL
+
+#endif//_SSL_HANDSHAKE_POOL_H_INCLUDE
@@ -0,0 +1,144 @@
+
+#ifndef _SSL_SESSION_CACHE_H_INCLUDE
+#define _SSL_SESSION_CACHE_H_INCLUDE
+
+#include "sockets-config.h"
+
+#ifdef HAVE_OPENSSL
+
+#ifdef _WIN32
+#   include <winsock2.h>
+#endif
+#include <openssl/ssl.h>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "Mutex.h"
+
+namespace dai {
+
+/**
+ * Process wide TLS session cache, shared by the TcpSocket's of all
+ * sockethandlers and sockethandler threads.
+ * Server side, sessions are resumed from session tickets encrypted with
+ * rotating keys, and session id's are kept in a sharded cache replacing
+ * the OpenSSL internal cache, so workers do not serialize on one lock.
+ * Client side, the last session of each client context and session key
+ * (host:port) is offered on the next connection. TLS 1.3 tickets are used
+ * once, they are taken out of the cache by the connection offering them.
+ * \ingroup basic
+ */
+class SSLSessionCache
+{
+public:
+    enum { SHARDS = 16 };
+
+    /** The process wide cache. */
+    static SSLSessionCache& Instance();
+
+    /**
+     * Maximum number of cached sessions, server and client each.
+     */
+    void SetCapacity(size_t n);
+    size_t Capacity() const;
+
+    /**
+     * Session ticket keys are replaced after sec seconds. Tickets made
+     * with the previous key are still accepted, and renewed.
+     */
+    void SetTicketKeyLifetime(long sec);
+    long TicketKeyLifetime() const;
+
+    /** Install session callbacks on a new server context. */
+    void InitServerContext(SSL_CTX *ctx);
+    /**
+     * Install session callbacks on a new client context. Sessions are
+     * only resumed by connections of the same context name, name must
+     * outlive ctx.
+     */
+    void InitClientContext(SSL_CTX *ctx, const std::string *name);
+
+    /**
+     * Client; offer the cached session for key, and store new sessions
+     * of this connection under key. key must outlive ssl.
+     */
+    void Attach(SSL *ssl, const std::string *key);
+
+    /**
+     * Client; new sessions of an attached, connected ssl are stored under
+     * key from now on. NULL while the connection is pooled.
+     */
+    void SetKey(SSL *ssl, const std::string *key);
+
+    /** Count a completed handshake. */
+    void Handshake(SSL *ssl, bool server);
+
+    uint64_t ServerHandshakes() const;
+    uint64_t ServerResumed() const;
+    uint64_t ClientHandshakes() const;
+    uint64_t ClientResumed() const;
+
+private:
+    SSLSessionCache();
+    ~SSLSessionCache();
+    SSLSessionCache(const SSLSessionCache& ) = delete;
+    SSLSessionCache& operator=(const SSLSessionCache& ) = delete;
+
+    struct Shard
+    {
+        Mutex mutex;
+        std::map<std::string, SSL_SESSION *> sessions;
+    };
+
+    /** Current and previous session ticket key. */
+    struct TicketKeys
+    {
+        struct Key
+        {
+            unsigned char name[16];
+            unsigned char aes[32];
+            unsigned char hmac[32];
+        };
+        Key    current;
+        Key    previous;
+        bool   has_previous;
+        time_t created;
+    };
+
+    /** Client cache id, context name and session key. */
+    std::string ClientId(SSL *ssl, const std::string& key);
+    Shard& GetShard(Shard *shards, const std::string& id);
+    void Store(Shard *shards, const std::string& id, SSL_SESSION *sess);
+    void Erase(Shard *shards, const std::string& id);
+    std::shared_ptr<const TicketKeys> GetTicketKeys();
+
+    static int NewServerSession(SSL *ssl, SSL_SESSION *sess);
+    static SSL_SESSION *GetServerSession(SSL *ssl, const unsigned char *id, int len, int *copy);
+    static void RemoveServerSession(SSL_CTX *ctx, SSL_SESSION *sess);
+    static int NewClientSession(SSL *ssl, SSL_SESSION *sess);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int TicketKey(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc);
+#endif
+
+    Shard                 m_server[SHARDS];
+    Shard                 m_client[SHARDS];
+    std::atomic<size_t>   m_capacity;
+    std::atomic<long>     m_ticket_lifetime;
+    std::shared_ptr<const TicketKeys> m_ticket_keys; ///< Accessed with std::atomic_load/store
+    int                   m_ex_index; ///< SSL ex_data slot for the client session key
+    int                   m_ctx_index; ///< SSL_CTX ex_data slot for the client context name
+    std::atomic<uint64_t> m_server_handshakes;
+    std::atomic<uint64_t> m_server_resumed;
+    std::atomic<uint64_t> m_client_handshakes;
+    std::atomic<uint64_t> m_client_resumed;
+};
+
+}//namespace dai
+
+#endif // HAVE_OPENSSL
+
+#endif//_SSL_SESSION_CACHE_H_INCLUDE
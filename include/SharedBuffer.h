@@ -0,0 +1,69 @@
+
+#ifndef _SHARED_BUFFER_H_INCLUDE
+#define _SHARED_BUFFER_H_INCLUDE
+
+#include "sockets-config.h"
+
+#include <memory>
+#include <string>
+
+namespace dai {
+
+/**
+ * Immutable, reference counted block of bytes.
+ * One SharedBuffer can be queued on any number of TcpSocket's with
+ * TcpSocket::SendShared; each socket only keeps a reference, and the
+ * block is released when the last socket has flushed it.
+ * Copying a SharedBuffer is cheap and thread safe.
+ * \ingroup basic
+ */
+class SharedBuffer
+{
+public:
+    /**
+     * Empty buffer.
+     */
+    SharedBuffer();
+
+    /**
+     * Copy len bytes from buf into a new shared block.
+     */
+    SharedBuffer(const char *buf, size_t len);
+
+    /**
+     * Copy a string into a new shared block.
+     */
+    explicit SharedBuffer(const std::string& str);
+
+    /**
+     * Take over a string without copying the data.
+     */
+    explicit SharedBuffer(std::string&& str);
+
+    /**
+     * Pointer to first byte of the block.
+     */
+    const char *Data() const;
+
+    /**
+     * Number of bytes in the block.
+     */
+    size_t Len() const;
+
+    /**
+     * \return true if no block is held, or the block is empty
+     */
+    bool Empty() const;
+
+    /**
+     * Number of SharedBuffer instances (queued or not) referencing the block.
+     */
+    long UseCount() const;
+
+private:
+    std::shared_ptr<const std::string> m_data;
+};
+
+}//namespace dai
+
+#endif//_SHARED_BUFFER_H_INCLUDE
@@ -6,6 +6,8 @@
 
 #include "SocketAddress.h"
 #include "Thread.h"
+#include "TokenBucket.h"
+#include "TrafficCapture.h"
 
 #ifdef HAVE_OPENSSL
 #include <openssl/ssl.h>
@@ -159,7 +161,7 @@ public:
 
     /**
      * Used by ListenSocket to set parent pointer of newly created
-     * socket instance.
+     * socket instance. Rate limits set on the parent are inherited.
      */
     void SetParent(Socket *);
 
@@ -291,6 +293,13 @@ public:
 
     /** Connection timeout. */
     virtual void OnConnectTimeout();
+
+    /** Timer callback. \sa ISocketHandler::AddTimer
+        \param id Timer id */
+    virtual void OnTimer(int id);
+
+    /** Library timer callback, for timer id's < 0 - internal use. */
+    virtual void OnInternalTimer(int id);
     //@}
 
     /** \name Socket mode flags, set/reset */
@@ -461,6 +470,7 @@ public:
     int SoSndbuf();
     int SoType();
     bool SetSoReuseaddr(bool x = true);
+    bool SetSoReuseport(bool x = true);
     bool SetSoKeepalive(bool x = true);
 
 #ifdef SO_BSDCOMPAT
@@ -521,6 +531,18 @@ public:
         \return true when another attempt should be made */
     bool RetryClientConnect();
 
+    /** \name Rate limits */
+    //@{
+    /** Limit number of bytes read per second (TcpSocket).
+        \param bytes_per_sec Rate, 0 disables the limit
+        \param burst Maximum burst, 0 means one second worth of data */
+    void SetInputRateLimit(uint64_t bytes_per_sec, uint64_t burst = 0);
+    /** Limit number of bytes written per second (TcpSocket).
+        \param bytes_per_sec Rate, 0 disables the limit
+        \param burst Maximum burst, 0 means one second worth of data */
+    void SetOutputRateLimit(uint64_t bytes_per_sec, uint64_t burst = 0);
+    //@}
+
 #ifdef HAVE_OPENSSL
     /** @name SSL Support */
     //@{
@@ -637,6 +659,14 @@ public:
 #ifdef ENABLE_RESOLVER
     /** \name Asynchronous Resolver */
     //@{
+    /** Service location, see OnResolvedSrv. */
+    struct SrvRecord
+    {
+        uint16_t    priority;
+        uint16_t    weight;
+        port_t      port;
+        std::string target;
+    };
     /** Request an asynchronous dns resolution.
         \param host hostname to be resolved
         \param port port number passed along for the ride
@@ -666,6 +696,14 @@ public:
     /** Callback indicating failed dns lookup.
         \param id Resolve ID */
     virtual void OnResolveFailed(int id);
+    /** Request SRV records of name, e.g. "_sip._udp.example.com",
+        from the sockethandler DnsClient.
+        \return Resolve ID */
+    int ResolveSrv(const std::string& name);
+    /** Callback returning SRV records.
+        \param id Resolve ID
+        \param records Records in answer order */
+    virtual void OnResolvedSrv(int id, const std::vector<SrvRecord>& records);
     //@}
 #endif  // ENABLE_RESOLVER
 
@@ -700,12 +738,19 @@ public:
     //@}
 #endif // ENABLE_DETACH
 
-    /** Write traffic to an IFile. Socket will not delete this object. */
+    /** Write traffic to an IFile. Socket will not delete this object.
+        The IFile is written synchronously, see SetTrafficCapture for
+        capturing under load. */
     void SetTrafficMonitor(IFile *p)
     {
         m_traffic_monitor = p;
     }
 
+    /** Capture traffic asynchronously in pcapng format, if this connection
+        is sampled by the TrafficCapture. Incoming connections inherit the
+        capture of their ListenSocket. Socket will not delete this object. */
+    void SetTrafficCapture(TrafficCapture *p);
+
 protected:
     /** default constructor not available */
     Socket() : m_handler(m_handler) {}
@@ -725,6 +770,31 @@ protected:
         return m_traffic_monitor;
     }
 
+    /** Queue traffic for the TrafficCapture, if this connection is sampled.
+        \param out true for data sent
+        \param buf Data
+        \param caplen Number of bytes available in buf
+        \param len Number of bytes transferred */
+    void CaptureTraffic(bool out, const char *buf, size_t caplen, size_t len);
+
+    /** \return true if traffic of this connection is captured */
+    bool TrafficCaptured() const
+    {
+        return m_capture_flow != nullptr;
+    }
+
+    /** Input rate limit token bucket. */
+    TokenBucket& InputRateLimit()
+    {
+        return m_input_limit;
+    }
+
+    /** Output rate limit token bucket. */
+    TokenBucket& OutputRateLimit()
+    {
+        return m_output_limit;
+    }
+
     //  unsigned long m_flags; ///< boolean flags, replacing old 'bool' members
 
 private:
@@ -741,6 +811,8 @@ private:
     std::unique_ptr<SocketAddress> m_client_remote_address; ///< Address of last connect()
     std::unique_ptr<SocketAddress> m_remote_address;        ///< Remote end address
     IFile                       *m_traffic_monitor;
+    TrafficCapture              *m_traffic_capture; ///< Async capture, if set
+    std::unique_ptr<TrafficCapture::Flow> m_capture_flow; ///< Set if this connection is sampled
     time_t                       m_timeout_start; ///< Set by SetTimeout
     time_t                       m_timeout_limit; ///< Defined by SetTimeout
     bool                         m_bLost; ///< connection lost
@@ -748,6 +820,8 @@ private:
     socketuid_t                  m_uid;
     bool                         m_call_on_connect; ///< OnConnect will be called next ISocketHandler cycle if true
     bool                         m_b_retry_connect; ///< Try another connection attempt next ISocketHandler cycle
+    TokenBucket                  m_input_limit;  ///< Input rate limit
+    TokenBucket                  m_output_limit; ///< Output rate limit
 
 #ifdef _WIN32
     static  WSAInitializer m_winsock_init; ///< Winsock initialization singleton class
@@ -4,20 +4,30 @@
 
 #include <map>
 #include <list>
+#include <unordered_map>
+#include <vector>
 
 #include "sockets-config.h"
 #include "socket_include.h"
 #include "ISocketHandler.h"
+#include "EventTime.h"
+#include "ResolverPool.h"
+
+#ifdef ENABLE_POOL
+#define POOL_MAX_IDLE     8        ///< Default idle connections per destination
+#define POOL_MAX_TOTAL    256      ///< Default idle connections in total
+#define POOL_IDLE_TIMEOUT 60000000 ///< Default usec before an idle connection is closed
+#endif
 
 namespace dai {
 
 class Socket;
-#ifdef ENABLE_RESOLVER
-class ResolvServer;
-#endif
+class DestinationCache;
+class PacketPool;
 class IMutex;
 class SocketHandlerThread;
 class UdpSocket;
+class Wakeup;
 
 /**
  * Socket container class, event generator.
@@ -64,10 +74,16 @@ public:
 
     virtual bool IsThreaded();
 
+    virtual size_t NumberOfThreads();
+
+    virtual ISocketHandler& GetThreadHandler(size_t i);
+
     virtual void EnableRelease();
 
     virtual void Release();
 
+    std::shared_ptr<Wakeup> GetWakeup();
+
     /**
      * Get mutex reference for threadsafe operations.
      */
@@ -160,6 +176,32 @@ public:
 
     void SetClose(bool = true);
 
+    void AddFlush(Socket *);
+
+    void AddTimer(Socket *, long usec, int id = 0);
+
+    void RemoveTimer(Socket *, int id = 0);
+
+    void SetInputRateLimit(uint64_t bytes_per_sec, uint64_t burst = 0);
+
+    void SetOutputRateLimit(uint64_t bytes_per_sec, uint64_t burst = 0);
+
+    TokenBucket& InputRateLimit();
+
+    TokenBucket& OutputRateLimit();
+
+    void AddTcpInfo(Socket *, long usec);
+
+    void RemoveTcpInfo(Socket *);
+
+    void SetTcpInfoBudget(size_t);
+
+    TcpInfoStats& GetTcpInfoStats();
+
+#ifdef HAVE_OPENSSL
+    void AddSSLHandshake(Socket *, SSL *, bool server);
+#endif
+
 private:
     static FILE          *m_event_file;
     static unsigned long  m_event_counter;
@@ -171,7 +213,9 @@ public:
     /**
      * Find available open connection (used by connection pool).
      */
-    ISocketHandler::PoolSocket *FindConnection(int type, const std::string& protocol, SocketAddress&);
+    ISocketHandler::PoolSocket *FindConnection(int type, const std::string& protocol, SocketAddress&, const std::string& identity);
+
+    bool AddConnection(Socket *);
 
     /**
      * Enable connection pool (by default disabled).
@@ -183,6 +227,20 @@ public:
      * \return true if connection pool is enabled
      */
     bool PoolEnabled();
+
+    void SetPoolMaxIdle(size_t);
+
+    void SetPoolMaxTotal(size_t);
+
+    void SetPoolIdleTimeout(long usec);
+
+    size_t PoolSize();
+
+    uint64_t PoolHits();
+
+    uint64_t PoolMisses();
+
+    uint64_t PoolEvictions();
 #endif // ENABLE_POOL
 
     // Socks4
@@ -242,8 +300,8 @@ public:
 #ifdef ENABLE_RESOLVER
 
     /**
-     * Enable asynchronous DNS.
-     * \param port Listen port of asynchronous dns server
+     * Enable asynchronous DNS, lookups run in the ResolverPool.
+     * \param port Not used, kept for compatibility
      */
     void EnableResolver(port_t port = 16667);
 
@@ -274,12 +332,12 @@ public:
 #endif
 
     /**
-     * Get listen port of asynchronous dns server.
+     * Port given to EnableResolver.
      */
     port_t GetResolverPort();
 
     /**
-     * Resolver thread ready for queries.
+     * Resolver ready for queries, same as ResolverEnabled.
      */
     bool ResolverReady();
 
@@ -288,8 +346,20 @@ public:
      */
     bool Resolving(Socket *);
 
+    int ResolveSrv(Socket *, const std::string& name);
+    void EnableDnsClient(bool = true);
+    bool DnsClientEnabled();
+    DnsClient& GetDnsClient();
+
 #endif // ENABLE_RESOLVER
 
+    // Destination cache
+    bool GetDestination(const std::string& host, port_t port, bool ipv6, struct sockaddr_storage& sa, socklen_t& sa_len);
+    bool QueueDestination(UdpSocket *p, const std::string& host, port_t port, bool ipv6, const char *data, int len, int flags);
+    void SetDestinationTtl(long sec);
+
+    PacketPool& GetPacketPool(size_t bufsz);
+
 #ifdef ENABLE_DETACH
     /**
      * Indicates that the handler runs under SocketThread.
@@ -329,6 +399,21 @@ protected:
     void CheckTimeout(time_t);
     void CheckRetry();
     void CheckClose();
+    void CheckFlush();
+    void CheckTimers();
+    void CheckTcpInfo();
+#ifdef HAVE_OPENSSL
+    void CheckSSLHandshake();
+#endif
+#ifdef ENABLE_RESOLVER
+    void CheckResolve();
+    /** Queue a lookup of the ResolverPool. */
+    int Resolve(Socket *, ResolverPool::Job *job);
+#endif
+#ifdef ENABLE_POOL
+    static std::string PoolKey(int type, const std::string& protocol, SocketAddress&, const std::string& identity);
+    bool PoolErase(Socket *);
+#endif
 
     //
     StdLog         *m_stdlog;      ///< Registered log class, or NULL
@@ -345,6 +430,7 @@ private:
     //
     std::list<SocketHandlerThread *> m_threads;
     UdpSocket                       *m_release;
+    std::shared_ptr<Wakeup>          m_wakeup; ///< Shared with worker pools, created by GetWakeup
 
     //
     SOCKET m_maxsock; ///< Highest file descriptor + 1 in active sockets list
@@ -355,12 +441,28 @@ private:
 
     // state lists
     std::list<socketuid_t> m_fds_erase; ///< File descriptors that are to be erased from m_sockets
+    std::vector<Socket *>  m_flush;     ///< Sockets with coalesced output waiting to be flushed
+
+    typedef std::pair<Socket *, int> timer_id_t;
+    std::multimap<mytime_t, timer_id_t> m_timers;     ///< Scheduled OnTimer callbacks, by time
+    std::map<timer_id_t, mytime_t>      m_timer_index; ///< Scheduled OnTimer callbacks, by socket/id
+
+    TokenBucket m_input_limit;  ///< Handler input rate limit
+    TokenBucket m_output_limit; ///< Handler output rate limit
 
     bool m_b_check_callonconnect;
     bool m_b_check_detach;
     bool m_b_check_timeout;
     bool m_b_check_retry;
     bool m_b_check_close;
+    bool m_b_check_ssl_handshake; ///< Handshake steps running in the SSLHandshakePool
+
+    std::multimap<mytime_t, Socket *> m_tcpinfo;        ///< Sockets sampling TCP_INFO, by next sample time
+    std::map<Socket *, mytime_t>      m_tcpinfo_index;  ///< Next TCP_INFO sample time, by socket
+    size_t                            m_tcpinfo_budget; ///< Maximum TCP_INFO samples per Select
+    DestinationCache                 *m_destinations; ///< Created by the first GetDestination
+    std::map<size_t, PacketPool *>    m_packet_pools; ///< Buffer size -> pool
+    TcpInfoStats                      m_tcpinfo_stats;  ///< Aggregated TCP_INFO samples
 
 #ifdef ENABLE_SOCKS4
     ipaddr_t    m_socks4_host;   ///< Socks4 server host ip
@@ -371,13 +473,24 @@ private:
 
 #ifdef ENABLE_RESOLVER
     int                         m_resolv_id;     ///< Resolver id counter
-    ResolvServer               *m_resolver;      ///< Resolver thread pointer
-    port_t                      m_resolver_port; ///< Resolver listen port
+    std::shared_ptr<ResolverPool::Queue> m_resolver; ///< Completed lookups, set by EnableResolver
+    size_t                      m_resolve_pending; ///< Lookups not yet completed
+    DnsClient                  *m_dns;           ///< Created by GetDnsClient
+    bool                        m_b_dns;         ///< Resolve with m_dns
+    port_t                      m_resolver_port; ///< Given to EnableResolver
     std::map<socketuid_t, bool> m_resolve_q;     ///< resolve queue
 #endif
 
 #ifdef ENABLE_POOL
     bool m_b_enable_pool; ///< Connection pool enabled if true
+    std::unordered_map<std::string, std::list<PoolSocket *> > m_pool; ///< Idle connections by pool key, most recent last
+    std::unordered_map<Socket *, std::string> m_pool_index; ///< Pool key, by idle connection
+    size_t   m_pool_max_idle;     ///< Idle connections per pool key
+    size_t   m_pool_max_total;    ///< Idle connections in total
+    long     m_pool_idle_timeout; ///< usec
+    uint64_t m_pool_hits;
+    uint64_t m_pool_misses;
+    uint64_t m_pool_evictions;
 #endif
 #ifdef ENABLE_DETACH
     bool m_slave; ///< Indicates that this is a ISocketHandler run in SocketThread
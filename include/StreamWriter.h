@@ -8,22 +8,47 @@
 namespace dai {
 
 class IStream;
+class TcpSocket;
 
+/**
+ * Formatted output to an IStream, or directly into the output buffer of
+ * a TcpSocket. Numbers are formatted with std::to_chars, no temporary
+ * strings are created.
+ */
 class StreamWriter
 {
 public:
     StreamWriter(IStream& stream);
-    virtual ~StreamWriter() {}
+
+    /**
+     * Write into the output buffer of a socket. The output is sent by
+     * Flush, or when the StreamWriter is destroyed.
+     */
+    StreamWriter(TcpSocket& sock);
+    virtual ~StreamWriter();
 
     StreamWriter& operator<<(const char *);
     StreamWriter& operator<<(const std::string&);
+    StreamWriter& operator<<(char);
     StreamWriter& operator<<(short);
     StreamWriter& operator<<(int);
     StreamWriter& operator<<(long);
+    StreamWriter& operator<<(unsigned int);
+    StreamWriter& operator<<(unsigned long);
     StreamWriter& operator<<(double);
 
+    StreamWriter& Write(const char *buf, size_t len);
+
+    /**
+     * Start sending socket output written so far.
+     */
+    void Flush();
+
 private:
-    IStream& m_stream;
+    template <class T> StreamWriter& Number(T);
+
+    IStream   *m_stream;
+    TcpSocket *m_socket;
 
 };
 
@@ -0,0 +1,128 @@
+
+#ifndef _TCP_INFO_H_INCLUDE
+#define _TCP_INFO_H_INCLUDE
+
+#include "sockets-config.h"
+#include "socket_include.h"
+#include "EventTime.h"
+
+/** Default maximum number of TCP_INFO samples taken per SocketHandler::Select. */
+#define TCP_INFO_BUDGET 64
+
+namespace dai {
+
+/**
+ * One TCP_INFO sample of a connection.
+ * \ingroup basic
+ */
+struct TcpInfoSample
+{
+    mytime_t time;          ///< EventTime::Tick() when sampled
+    uint32_t rtt;           ///< Smoothed round trip time, usec
+    uint32_t rttvar;        ///< Round trip time variance, usec
+    uint32_t cwnd;          ///< Congestion window, segments
+    uint32_t retransmits;   ///< Total retransmitted segments
+    uint32_t unacked;       ///< Segments in flight
+    uint64_t delivery_rate; ///< Bytes per second, 0 if the kernel does not report it
+
+    /**
+     * Read TCP_INFO of a connected socket (LINUX).
+     * \return false if not available
+     */
+    bool Read(SOCKET s);
+};
+
+
+/**
+ * Most recent TCP_INFO samples of one connection, fixed size.
+ * \ingroup basic
+ */
+class TcpInfoHistory
+{
+public:
+    enum { SIZE = 8 };
+
+    TcpInfoHistory();
+
+    void Add(const TcpInfoSample& sample);
+
+    /** Number of samples held, at most SIZE. */
+    size_t Size() const;
+
+    /** Sample i, 0 is the most recent. */
+    const TcpInfoSample& Get(size_t i) const;
+
+private:
+    TcpInfoSample m_samples[SIZE];
+    size_t        m_next;
+    size_t        m_count;
+};
+
+
+/**
+ * Histogram with power of two buckets.
+ * Bucket 0 counts zero values, bucket i counts values in [2^(i-1), 2^i).
+ * \ingroup basic
+ */
+class TcpInfoHistogram
+{
+public:
+    enum { BUCKETS = 48 };
+
+    TcpInfoHistogram();
+
+    void Add(uint64_t value);
+    void Reset();
+
+    uint64_t Count() const;
+    uint64_t Bucket(size_t i) const;
+
+    /**
+     * Upper bound of the bucket holding the given percentile (0-100).
+     */
+    uint64_t Percentile(double p) const;
+
+private:
+    uint64_t m_buckets[BUCKETS];
+    uint64_t m_count;
+};
+
+
+/**
+ * TCP_INFO samples aggregated over all connections of a handler.
+ * \ingroup basic
+ */
+class TcpInfoStats
+{
+public:
+    TcpInfoStats();
+
+    /**
+     * Add a sample.
+     * \param prev Previous sample of the same connection, or NULL
+     */
+    void Add(const TcpInfoSample& sample, const TcpInfoSample *prev);
+    void Reset();
+
+    uint64_t Samples() const;
+    const TcpInfoHistogram& Rtt() const;
+    const TcpInfoHistogram& RttVar() const;
+    const TcpInfoHistogram& Cwnd() const;
+    /** Retransmitted segments between consecutive samples. */
+    const TcpInfoHistogram& Retransmits() const;
+    const TcpInfoHistogram& Unacked() const;
+    const TcpInfoHistogram& DeliveryRate() const;
+
+private:
+    uint64_t         m_samples;
+    TcpInfoHistogram m_rtt;
+    TcpInfoHistogram m_rttvar;
+    TcpInfoHistogram m_cwnd;
+    TcpInfoHistogram m_retransmits;
+    TcpInfoHistogram m_unacked;
+    TcpInfoHistogram m_delivery_rate;
+};
+
+}//namespace dai
+
+#endif//_TCP_INFO_H_INCLUDE
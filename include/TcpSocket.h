@@ -3,12 +3,20 @@
 #define _TCP_SOCKET_H_INCLUDE
 
 #include <map>
+#include <list>
+#include <memory>
 #ifdef HAVE_OPENSSL
 #   include <openssl/ssl.h>
 #endif
+#ifndef _WIN32
+#   include <sys/uio.h>
+#endif
 
 #include "sockets-config.h"
 #include "StreamSocket.h"
+#include "SharedBuffer.h"
+#include "RetryPolicy.h"
+#include "TcpInfo.h"
 
 #ifdef HAVE_OPENSSL
 #   include "SSLInitializer.h"
@@ -17,6 +25,22 @@
 
 #define TCP_BUFSIZE_READ    16400
 #define TCP_OUTPUT_CAPACITY 1024000
+#define TCP_OUTPUT_IOV_MAX  64
+#define TCP_ZEROCOPY_THRESHOLD 262144
+#define TCP_RELAY_PIPE_SIZE 1048576
+#define TCP_HE_ATTEMPT_DELAY    250000 ///< Happy Eyeballs, usec between connection attempts
+#define TCP_HE_RESOLUTION_DELAY 50000  ///< Happy Eyeballs, usec to wait for ipv6 address after ipv4
+#define TCP_SSL_RECORD_SMALL 1369    ///< TLS record payload fitting one segment, after connect or idle
+#define TCP_SSL_RECORD_MAX   16384   ///< Maximum TLS record payload
+#define TCP_SSL_RECORD_BOOST 40      ///< Number of small TLS records before full size records
+#define TCP_SSL_RECORD_IDLE  1000000 ///< usec without output before TLS records start small again
+
+// internal timer id's, see Socket::OnInternalTimer
+#define TCP_TIMER_INPUT_LIMIT  -1
+#define TCP_TIMER_OUTPUT_LIMIT -2
+#define TCP_TIMER_HE_ATTEMPT    -3
+#define TCP_TIMER_HE_RESOLUTION -4
+#define TCP_TIMER_RETRY         -5
 
 // flags used in OnDisconnect callback
 #define TCP_DISCONNECT_WRITE 1
@@ -111,12 +135,20 @@ protected:
     };
 
     /** Output buffer struct.
+     * Either owns a TCP_OUTPUT_CAPACITY data block, references
+     * a SharedBuffer queued with SendShared, or a file region queued
+     * with SendFile. For a file region _b is the current file offset.
      * \ingroup internal
      */
     struct OUTPUT
     {
         OUTPUT();
         OUTPUT(const char *buf, size_t len);
+        OUTPUT(const SharedBuffer& shared, size_t offset);
+        OUTPUT(int fd, off_t offset, size_t len);
+        ~OUTPUT();
+        OUTPUT(const OUTPUT& ) = delete;
+        OUTPUT& operator=(const OUTPUT& ) = delete;
         size_t Space();
         void Add(const char *buf, size_t len);
         size_t Remove(size_t len);
@@ -126,7 +158,11 @@ protected:
         size_t _b;
         size_t _t;
         size_t _q;
-        char _buf[TCP_OUTPUT_CAPACITY];
+        char        *_buf;    ///< owned data block, NULL for shared segment and file region
+        SharedBuffer _shared; ///< referenced data for shared segment
+        int          _fd;     ///< owned file descriptor for file region, or -1
+        bool         _zc;     ///< sent with MSG_ZEROCOPY
+        uint32_t     _zc_seq; ///< last MSG_ZEROCOPY send referencing this block
     };
     typedef std::list<OUTPUT *> output_l;
 
@@ -181,14 +217,68 @@ public:
      */
     bool Open(const std::string& host, port_t port);
 
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    /**
+     * Happy Eyeballs (RFC 8305) for Open(host, port). Both address families
+     * are resolved, and connection attempts are started TCP_HE_ATTEMPT_DELAY
+     * apart, ipv6 first, until one succeeds. The first connection to succeed
+     * is kept and the other attempts are closed. OnConnectFailed is only
+     * called when every attempt has failed.
+     */
+    void SetHappyEyeballs(bool = true);
+    bool HappyEyeballs();
+#endif
+
     /**
      * Connect timeout callback.
      */
     void OnConnectTimeout();
 
-#ifdef _WIN32
     /**
-     * Connection failed reported as exception on win32
+     * Pace connect retries, and reconnects with SetReconnect, with a backoff
+     * policy. After a failed connect or a lost connection the next attempt
+     * is started from a sockethandler timer when the policy delay has passed.
+     * OnConnectRetry is called as the attempt starts, OnConnectFailed when
+     * the policy allows no more attempts. Replaces SetConnectionRetry.
+     */
+    void SetRetryPolicy(const RetryPolicy& );
+    const RetryPolicy& GetRetryPolicy();
+
+    /**
+     * Schedule the next connect attempt according to the retry policy - internal use.
+     * \return false if the policy allows no more attempts
+     */
+    bool ScheduleRetry();
+
+    /**
+     * Waiting for the retry timer, not monitored by the sockethandler - internal use.
+     */
+    bool RetryPending();
+
+    /**
+     * Sample TCP_INFO (rtt, cwnd, retransmits, delivery rate) every usec
+     * microseconds, 0 stops sampling. The sockethandler takes the samples,
+     * keeps the most recent ones in GetTcpInfoHistory and aggregates them
+     * in ISocketHandler::GetTcpInfoStats. Linux only.
+     */
+    void SetTcpInfoInterval(long usec);
+    long TcpInfoInterval();
+
+    /**
+     * Most recent TCP_INFO samples, or NULL if sampling was never enabled.
+     */
+    const TcpInfoHistory *GetTcpInfoHistory();
+
+    /**
+     * Take a TCP_INFO sample and add it to the history - internal use.
+     * \return false if no sample could be taken
+     */
+    bool SampleTcpInfo(TcpInfoSample& );
+
+#if defined(_WIN32) || defined(LINUX)
+    /**
+     * Connection failed reported as exception on win32.
+     * On linux, MSG_ZEROCOPY completions are read from the socket error queue.
      */
     void OnException();
 #endif
@@ -208,6 +298,7 @@ public:
 
     /**
      * Send string using printf formatting.
+     * The string is formatted directly into the output buffer.
      */
     void Sendf(const char *format, ...);
 
@@ -219,6 +310,90 @@ public:
      */
     void SendBuf(const char *buf, size_t len, int f = 0);
 
+    /**
+     * Reserve space at the end of the output buffer to format data in
+     * place, used by Sendf and StreamWriter. Nothing is queued until
+     * CommitOutput.
+     * \param len Contiguous bytes wanted, at most TCP_OUTPUT_CAPACITY
+     * \param space Bytes available at the returned pointer, at least len
+     */
+    char *ReserveOutput(size_t len, size_t& space);
+
+    /**
+     * Queue n bytes written to the space returned by ReserveOutput.
+     * Call with 0 if nothing was written, to release the reservation.
+     */
+    void CommitOutput(size_t n);
+
+    /**
+     * Start sending output queued with CommitOutput.
+     */
+    void SendOutput();
+
+    /**
+     * Send a shared buffer without copying it.
+     * Only a reference to the data is queued in the output buffer, so the
+     * same buffer can be sent to any number of sockets. The data must not
+     * be modified until every socket has sent it.
+     * \param buf Shared buffer
+     */
+    void SendShared(const SharedBuffer& buf);
+
+#ifndef _WIN32
+    /**
+     * Send a region of a file without copying it to user space.
+     * The region is queued in the output buffer in order with data sent
+     * before and after it, and transmitted with sendfile() when the socket
+     * is writable. The file descriptor is duplicated, so the caller may
+     * close it when this call returns; the file must not shrink until
+     * the region has been sent.
+     * Without LINUX defined, or on SSL connections, the file is read
+     * one block at a time instead.
+     * \param fd Open file descriptor
+     * \param offset Start of region
+     * \param length Number of bytes to send
+     * \return false if the region could not be queued
+     */
+    bool SendFile(int fd, off_t offset, size_t length);
+#endif
+
+    /**
+     * Send coalescing mode. Data sent from callbacks is only appended to
+     * the output buffer, and the sockethandler writes everything queued
+     * during the event dispatch with one gather write.
+     */
+    void SetSendCoalescing(bool = true);
+
+    /**
+     * Check send coalescing mode.
+     */
+    bool SendCoalescing();
+
+    /**
+     * Write coalesced output now. Called by the sockethandler after event dispatch.
+     */
+    void Flush();
+
+    /**
+     * Zero-copy mode (linux only). Writes from the output buffer of at least
+     * threshold bytes are sent with MSG_ZEROCOPY, smaller writes are copied
+     * by the kernel as usual. Sent blocks are kept until the kernel reports
+     * completion on the socket error queue.
+     * \param x Enable/disable
+     * \param threshold Minimum size of a zero-copy write
+     */
+    void SetZeroCopy(bool x = true, size_t threshold = TCP_ZEROCOPY_THRESHOLD);
+
+    /**
+     * Check zero-copy mode.
+     */
+    bool ZeroCopy();
+
+    /**
+     * Number of sent output blocks held until zero-copy completion.
+     */
+    size_t GetZeroCopyPending();
+
     /**
      * This callback is executed after a successful read from the socket.
      * \param buf Pointer to the data
@@ -265,6 +440,23 @@ public:
      */
     uint64_t GetBytesSent(bool clear = false);
 
+    /**
+     * Get number of microseconds reading has been paused by input rate limits.
+     * \sa Socket::SetInputRateLimit, ISocketHandler::SetInputRateLimit
+     */
+    uint64_t GetInputThrottleTime(bool clear = false);
+
+    /**
+     * Get number of microseconds writing has been paused by output rate limits.
+     * \sa Socket::SetOutputRateLimit, ISocketHandler::SetOutputRateLimit
+     */
+    uint64_t GetOutputThrottleTime(bool clear = false);
+
+    /**
+     * Rate limit, Happy Eyeballs and retry timers - internal use.
+     */
+    void OnInternalTimer(int id);
+
     /**
      * Socks4 specific callback.
      */
@@ -289,9 +481,69 @@ public:
 #ifdef ENABLE_IPV6
     void OnResolved(int id, in6_addr& a, port_t port);
 #endif
+    void OnResolveFailed(int id);
 #endif
 
 #ifdef HAVE_OPENSSL
+    /**
+     * Request kernel TLS offload, call before the handshake starts.
+     * Needs OpenSSL built with ktls and the linux tls module. When the
+     * kernel takes over record encryption after the handshake, output
+     * is written with send/sendmsg/sendfile like a plain connection,
+     * including SendFile regions. Otherwise SSL_write is used as before.
+     */
+    void SetKtls(bool x = true);
+    bool Ktls();
+
+    /**
+     * \return true if output is encrypted by the kernel
+     */
+    bool KtlsSend();
+
+    /**
+     * TLS record sizing. Enabled (default), the first TCP_SSL_RECORD_BOOST
+     * records after connect or TCP_SSL_RECORD_IDLE usec idle carry at most
+     * TCP_SSL_RECORD_SMALL bytes, so the peer can decrypt the first bytes
+     * without waiting for more segments; after that records are full
+     * size. Disabled, all records are full size.
+     * Small queued blocks are gathered into one record in both cases.
+     */
+    void SetSslDynamicRecords(bool x = true);
+    bool SslDynamicRecords();
+
+    /**
+     * Run the handshake steps in the SSLHandshakePool instead of the
+     * sockethandler thread, call before the handshake starts.
+     */
+    void SetSslOffload(bool x = true);
+    bool SslOffload();
+
+    /**
+     * Handshake step run by the SSLHandshakePool is done - internal use.
+     */
+    void OnSSLHandshake(int result, int error);
+
+    /**
+     * Client; TLS sessions are resumed between connections with the same
+     * session key. Default is remote address:port, set before connecting
+     * to share sessions by host name instead.
+     */
+    void SetSslSessionKey(const std::string& key);
+    const std::string& GetSslSessionKey();
+
+#ifdef ENABLE_POOL
+    /**
+     * SSL; Hand the negotiated ssl connection over to the connection pool - internal use.
+     */
+    SSL *ReleaseSsl();
+
+    /**
+     * SSL; Client context name and session key, a pooled connection is
+     * only reused by a socket with the same - internal use.
+     */
+    std::string GetPoolIdentity();
+#endif
+
     /**
      * Callback for 'New' ssl support - replaces SSLSocket. Internal use.
     */
@@ -355,6 +607,23 @@ public:
     // TCP options
     bool SetTcpNodelay(bool = true);
 
+    /**
+     * Use TCP Fast Open (TCP_FASTOPEN_CONNECT) for the next Open.
+     * When the kernel holds a cookie for the server, connect is deferred,
+     * OnConnect is called at once and the first data sent travels in the SYN.
+     * Without a cookie the connect proceeds as usual.
+     * Note that with a deferred connect a refused connection is reported
+     * as a disconnect instead of OnConnectFailed.
+     */
+    void SetTcpFastOpen(bool = true);
+    bool TcpFastOpen();
+
+    /**
+     * Start a deferred fast open connect that OnConnect sent no data on.
+     * Called by the sockethandler after OnConnect - internal use.
+     */
+    void FastOpenConnect();
+
     virtual int Protocol();
 
     /**
@@ -368,6 +637,60 @@ public:
      */
     virtual void OnTransferLimit();
 
+    /**
+     * Output buffer watermarks for OnBackpressure/OnWritable.
+     * \param low Low watermark, OnWritable fires when the output buffer drains to this size
+     * \param high High watermark, OnBackpressure fires when the output buffer grows above this size
+     * Default: 0 (disabled).
+     */
+    void SetOutputWatermarks(size_t low, size_t high);
+
+    /**
+     * Output buffer is above the high watermark and has not yet drained
+     * to the low watermark.
+     */
+    bool IsBackpressure();
+
+    /**
+     * This callback fires when the output buffer grows above the high watermark.
+     * Stop producing data until OnWritable.
+     */
+    virtual void OnBackpressure();
+
+    /**
+     * This callback fires when the output buffer has drained to the low
+     * watermark after OnBackpressure.
+     */
+    virtual void OnWritable();
+
+    /**
+     * Link an upstream socket that feeds data into this socket. Reading on
+     * the upstream socket is paused while this socket is above its high
+     * watermark. One upstream socket can be linked to several sockets.
+     * \param p Upstream socket, NULL to unlink
+     */
+    void SetUpstream(TcpSocket *p);
+
+    /** Reading is paused by a downstream socket above its high watermark. */
+    bool IsReadPaused() const;
+
+    /**
+     * Relay all data between this socket and peer inside the kernel (linux),
+     * with splice() through one pipe per direction. OnRawData is not called
+     * on either socket while relaying. A direction ends when its source
+     * reaches end of stream, after which the destination write side is shut
+     * down; when both directions have ended both sockets are closed.
+     * Relayed bytes are counted by GetBytesReceived/GetBytesSent.
+     * \param peer Connected socket, not using SSL
+     * \return false if the relay could not be set up
+     */
+    bool Relay(TcpSocket& peer);
+
+    /**
+     * Relay peer, or NULL.
+     */
+    TcpSocket *GetRelay();
+
 protected:
     TcpSocket(const TcpSocket& );
 
@@ -431,6 +754,33 @@ protected:
      */
     bool SSLNegotiate();
 
+    /**
+     * ssl; result of a handshake step.
+     * \param r Return value of SSL_accept / SSL_connect
+     * \param err SSL_get_error of r
+     */
+    bool SSLNegotiate(int r, int err);
+
+    /**
+     * ssl; payload size of the next record.
+     */
+    size_t SslRecordSize();
+
+    /**
+     * ssl; write the front of the output buffer, one record.
+     */
+    int TrySslWriteOutput(size_t& len, size_t max);
+
+    /**
+     * ssl; check if the kernel took over output encryption after the handshake.
+     */
+    void CheckKtls();
+
+    /**
+     * ssl; output goes through SSL_write.
+     */
+    bool SslWrite();
+
     /**
      * SSL; Get ssl password.
      */
@@ -452,11 +802,128 @@ private:
      */
     int TryWrite(const char *buf, size_t len);
 
+#ifndef _WIN32
+    /**
+     * the actual sendmsg(), gather write
+     */
+    int TryWritev(const struct iovec *iov, int cnt, int flags = 0);
+
+#ifdef LINUX
+    /**
+     * the actual sendfile()
+     */
+    int TrySendfile(int fd, off_t offset, size_t len);
+#endif
+
+    /**
+     * replace the first TCP_OUTPUT_CAPACITY bytes of a file region at the
+     * output buffer beginning with an owned block read from the file
+     */
+    bool ReadFileOutput();
+#endif
+
+    /**
+     * send as much of the output buffer as possible in one call
+     * \param len total number of bytes attempted
+     * \param max maximum number of bytes to send
+     */
+    int TryWriteOutput(size_t& len, size_t max);
+
+    /**
+     * remove len sent bytes from output buffer beginning
+     */
+    void RemoveOutput(size_t len);
+
     /**
      * add data to output buffer top
      */
     void Buffer(const char *buf, size_t len);
 
+    /**
+     * add shared buffer reference to output buffer, skipping offset bytes
+     */
+    void BufferShared(const SharedBuffer& buf, size_t offset);
+
+#ifndef _WIN32
+    /**
+     * add file region to output buffer top, takes ownership of fd
+     */
+    void BufferFile(int fd, off_t offset, size_t len);
+#endif
+
+    /**
+     * register with sockethandler for flush after event dispatch
+     */
+    void ScheduleFlush();
+
+    /**
+     * fire OnBackpressure/OnWritable when output length crosses a watermark
+     */
+    void CheckWatermarks();
+
+    /**
+     * upstream flow control, stop reading while any downstream socket is above high watermark.
+     * Independent of DisableRead, which is left to the application.
+     */
+    void PauseRead();
+    void ResumeRead();
+
+    /**
+     * set/reset read and write monitoring from buffer, flow control and rate limit state
+     */
+    void ModifyEvents();
+
+    /**
+     * rate limits, socket and sockethandler token buckets
+     */
+    bool OutputLimited();
+    size_t InputAllowance(size_t max);
+    size_t OutputAllowance();
+    void ConsumeInput(size_t n);
+    void ConsumeOutput(size_t n);
+    void ThrottleInput();
+    void ThrottleOutput();
+
+#ifdef LINUX
+    /**
+     * MSG_ZEROCOPY: enable on current socket, mark blocks referenced by a
+     * zero-copy send, read completions from the error queue and release
+     * blocks whose sends have all completed
+     */
+    bool PrepareZeroCopy();
+    void MarkZeroCopy(size_t len);
+    bool ReadZeroCopyCompletions();
+    void ReleaseZeroCopy();
+
+    /**
+     * splice relay: create pipe, move data from socket into pipe, move
+     * data from peer pipe into socket, end relay
+     */
+    bool RelayPipe();
+    void RelayRead();
+    void RelayWrite();
+    void RelayError(const char *msg, int flags);
+#endif
+    void RelayUnlink();
+
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    /**
+     * Happy Eyeballs: connection attempt on a separate file descriptor,
+     * resolve both families, add resolved address, start next attempt,
+     * own attempt failed, attempt won/lost, end race
+     */
+    class ConnectAttempt;
+    bool OpenHappyEyeballs(const std::string& host, port_t port);
+    void HappyEyeballsResolved(SocketAddress *ad);
+    void HappyEyeballsNext();
+    bool HappyEyeballsFailed();
+    void HappyEyeballsWin(ConnectAttempt *p);
+    void HappyEyeballsLost(ConnectAttempt *p);
+    bool HappyEyeballsPending();
+    void HappyEyeballsCheck();
+    void HappyEyeballsStop();
+#endif
+
     //
     bool              m_b_input_buffer_disabled;
     uint64_t          m_bytes_sent;
@@ -474,12 +941,63 @@ private:
     size_t            m_transfer_limit;
     size_t            m_output_length;
     size_t            m_repeat_length;
+    bool              m_b_coalesce;      ///< Send coalescing mode
+    bool              m_b_flush_pending; ///< Registered for flush with sockethandler
+    size_t            m_output_low;      ///< Low watermark for OnWritable
+    size_t            m_output_high;     ///< High watermark for OnBackpressure
+    bool              m_b_backpressure;  ///< Above high watermark
+    TcpSocket        *m_upstream;        ///< Paused while above high watermark
+    std::list<TcpSocket *> m_downstream; ///< Sockets this one is upstream for
+    int               m_read_paused;     ///< Number of downstream sockets above high watermark
+    bool              m_b_input_throttled;     ///< Read paused by rate limit
+    bool              m_b_output_throttled;    ///< Write paused by rate limit
+    mytime_t          m_input_throttle_start;  ///< Time read was paused
+    mytime_t          m_output_throttle_start; ///< Time write was paused
+    uint64_t          m_input_throttle_time;   ///< Total time read paused, usec
+    uint64_t          m_output_throttle_time;  ///< Total time write paused, usec
+    bool              m_b_zerocopy;         ///< Zero-copy mode
+    size_t            m_zerocopy_threshold; ///< Minimum size of a zero-copy write
+    SOCKET            m_zerocopy_socket;    ///< Socket SO_ZEROCOPY has been set on
+    uint32_t          m_zc_next;            ///< Id of next zero-copy send
+    uint32_t          m_zc_done;            ///< All zero-copy sends before this id completed
+    std::map<uint32_t, uint32_t> m_zc_ranges; ///< Out of order completions, first => last id
+    output_l          m_zc_pending;         ///< Sent blocks waiting for completion
+    bool              m_b_fastopen;          ///< Use TCP_FASTOPEN_CONNECT
+    bool              m_b_fastopen_deferred; ///< connect deferred until first write
+    TcpSocket        *m_relay;              ///< Relay peer
+    int               m_relay_pipe[2];      ///< Data read from this socket, waiting to be written to relay peer
+    size_t            m_relay_pipe_size;
+    size_t            m_relay_pending;      ///< Number of bytes in pipe
+    bool              m_b_relay_eof;        ///< End of stream read from this socket
+    RetryPolicy       m_retry_policy;       ///< Connect retry backoff
+    bool              m_b_retry_pending;    ///< Waiting for retry timer
+    long              m_tcpinfo_interval;   ///< TCP_INFO sample interval, 0 if disabled
+    std::unique_ptr<TcpInfoHistory> m_tcpinfo; ///< Recent TCP_INFO samples
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    bool              m_b_happy_eyeballs;   ///< Race connection attempts in Open(host, port)
+    bool              m_b_he_racing;        ///< Race in progress
+    bool              m_b_he_own_failed;    ///< Attempt on own file descriptor failed
+    int               m_he_resolving;       ///< Number of resolve requests not yet answered
+    mytime_t          m_he_last_attempt;    ///< Time last attempt was started, 0 if none
+    std::list<std::unique_ptr<SocketAddress> > m_he_candidates; ///< Addresses not yet tried
+    std::list<ConnectAttempt *> m_he_attempts; ///< Attempts in progress on separate file descriptors
+#endif
 
 #ifdef HAVE_OPENSSL
     static SSLInitializer m_ssl_init;
     SSL_CTX              *m_ssl_ctx; ///< ssl context
     SSL                  *m_ssl;     ///< ssl 'socket'
     BIO                  *m_sbio;    ///< ssl bio
+    bool                  m_b_ktls;      ///< Request kernel tls
+    bool                  m_b_ktls_send; ///< Output encrypted by the kernel
+    bool                  m_b_ssl_offload;   ///< Handshake steps run in the SSLHandshakePool
+    bool                  m_b_ssl_dynamic_records; ///< Small records after connect or idle
+    size_t                m_ssl_records;     ///< Records written since connect or idle
+    mytime_t              m_ssl_last_write;  ///< Time of the last record
+    std::unique_ptr<char[]> m_ssl_record;    ///< Small output blocks gathered into one record
+    bool                  m_b_ssl_handshake; ///< Handshake step running in the SSLHandshakePool
+    std::string           m_ssl_session_key; ///< Client session cache key
+    std::string           m_ssl_context; ///< Name of the client context
     std::string           m_password; ///< ssl password
     static Mutex                            m_server_ssl_mutex;
     static std::map<std::string, SSL_CTX *> m_client_contexts;
@@ -496,6 +1014,9 @@ private:
 
 #ifdef ENABLE_RESOLVER
     int m_resolver_id; ///< Resolver id (if any) for current Open call
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    int m_resolver_id6; ///< Happy Eyeballs ipv6 resolver id
+#endif
 #endif
 
 #ifdef ENABLE_RECONNECT
@@ -0,0 +1,69 @@
+
+#ifndef _TOKEN_BUCKET_H_INCLUDE
+#define _TOKEN_BUCKET_H_INCLUDE
+
+#include "sockets-config.h"
+#include "socket_include.h"
+#include "EventTime.h"
+
+namespace dai {
+
+/**
+ * Token bucket byte rate limiter.
+ * Tokens are added continuously at the configured rate, up to the burst size.
+ * \ingroup basic
+ */
+class TokenBucket
+{
+public:
+    TokenBucket();
+
+    /**
+     * Set rate limit.
+     * \param bytes_per_sec Refill rate, 0 disables the limit
+     * \param burst Bucket size, 0 means one second worth of tokens
+     */
+    void SetRate(uint64_t bytes_per_sec, uint64_t burst = 0);
+
+    /**
+     * Refill rate in bytes per second, 0 if disabled.
+     */
+    uint64_t Rate() const;
+
+    /**
+     * Bucket size in bytes.
+     */
+    uint64_t Burst() const;
+
+    /**
+     * \return true if a rate has been set
+     */
+    bool Enabled() const;
+
+    /**
+     * Number of bytes that can be transferred now.
+     */
+    uint64_t Available();
+
+    /**
+     * Remove tokens for transferred bytes.
+     */
+    void Consume(uint64_t n);
+
+    /**
+     * Microseconds until at least n tokens are available.
+     */
+    long TimeUntilAvailable(uint64_t n = 1);
+
+private:
+    void Refill();
+
+    uint64_t m_rate;
+    uint64_t m_burst;
+    double   m_tokens;
+    mytime_t m_last;
+};
+
+}//namespace dai
+
+#endif//_TOKEN_BUCKET_H_INCLUDE
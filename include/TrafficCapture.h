@@ -0,0 +1,148 @@
+
+#ifndef _TRAFFIC_CAPTURE_H_INCLUDE
+#define _TRAFFIC_CAPTURE_H_INCLUDE
+
+#include "sockets-config.h"
+#include "socket_include.h"
+#include "Thread.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace dai {
+
+class IFile;
+
+/**
+ * Asynchronous pcapng traffic capture.
+ * Sockets copy their payload into a lock-free ring buffer; a background
+ * thread writes the records to an IFile as pcapng, framed with synthesized
+ * IPv4/IPv6 and TCP headers so the capture opens as ordinary TCP streams.
+ * Records that do not fit in the ring are dropped, the event loop never
+ * waits for the writer. The TCP sequence numbers are kept in the Flow of
+ * the socket, so a dropped record shows as a gap in its stream.
+ * One capture can be shared by sockets in any number of SocketHandler's.
+ * \ingroup basic
+ */
+class TrafficCapture : public Thread
+{
+public:
+    /**
+     * Per connection capture state, owned by the socket.
+     */
+    struct Flow
+    {
+        Flow(socketuid_t id = 0);
+
+        /**
+         * Fill in the endpoints from a connected socket.
+         * \return false if the addresses are not available (yet)
+         */
+        bool SetEndpoints(SOCKET s);
+
+        socketuid_t id;
+        bool        ready;    ///< endpoints have been filled in
+        int         family;   ///< AF_INET or AF_INET6
+        uint8_t     local[16];
+        uint8_t     remote[16];
+        port_t      local_port;
+        port_t      remote_port;
+        uint64_t    bytes;    ///< payload bytes captured
+        bool        capped;   ///< byte limit reached
+        uint32_t    seq_out;  ///< sequence number of the next byte sent
+        uint32_t    seq_in;   ///< sequence number of the next byte received
+    };
+
+    /**
+     * \param f Destination, must be open for writing. Not deleted by TrafficCapture.
+     * \param slots Ring buffer size in records, rounded up to a power of two
+     * \param snaplen Maximum payload bytes stored per record
+     */
+    TrafficCapture(IFile *f, size_t slots = 4096, size_t snaplen = 2048);
+    ~TrafficCapture();
+
+    /**
+     * Capture one out of every n connections, 0 captures none.
+     */
+    void SetSampling(unsigned n);
+    unsigned Sampling() const;
+
+    /**
+     * Stop capturing a connection after this many payload bytes, 0 unlimited.
+     */
+    void SetConnectionLimit(uint64_t bytes);
+    uint64_t ConnectionLimit() const;
+
+    /**
+     * Sampling decision for a new connection.
+     * \return new Flow if the connection should be captured
+     */
+    std::unique_ptr<Flow> Sample(socketuid_t id);
+
+    /**
+     * Queue a payload copy.
+     * \param out true for data sent, false for data received
+     * \param buf Payload, caplen bytes of it are copied (up to snaplen)
+     * \param len Payload length on the wire
+     */
+    void Capture(Flow& flow, bool out, const char *buf, size_t caplen, size_t len);
+
+    /**
+     * Queue the end of a connection.
+     */
+    void Closed(Flow& flow);
+
+    /** Number of records queued. */
+    uint64_t Captured() const;
+    /** Number of records dropped because the ring buffer was full. */
+    uint64_t Dropped() const;
+
+    void Run();
+
+private:
+    TrafficCapture(const TrafficCapture& ) = delete;
+    TrafficCapture& operator=(const TrafficCapture& ) = delete;
+
+    enum
+    {
+        RECORD_IN,
+        RECORD_OUT,
+        RECORD_FIN
+    };
+
+    struct Record
+    {
+        std::atomic<size_t> seq;
+        int         type;
+        uint64_t    ts;
+        Flow        flow;
+        size_t      caplen;
+        size_t      len;
+        char       *data;
+    };
+
+    void Queue(Flow& flow, int type, const char *buf, size_t caplen, size_t len);
+    bool Drain();
+    void WriteHeader();
+    void WritePacket(const Record& r);
+
+    IFile                  *m_file;
+    size_t                  m_mask;
+    size_t                  m_snaplen;
+    Record                 *m_ring;
+    char                   *m_data;
+    std::atomic<size_t>     m_head; ///< next slot to fill, shared by producers
+    size_t                  m_tail; ///< next slot to write, writer thread only
+    std::atomic<unsigned>   m_sampling;
+    std::atomic<unsigned>   m_sample_count;
+    std::atomic<uint64_t>   m_limit;
+    std::atomic<uint64_t>   m_captured;
+    std::atomic<uint64_t>   m_dropped;
+    std::atomic<bool>       m_quit;
+    std::string             m_block; ///< pcapng block being assembled
+};
+
+}//namespace dai
+
+#endif//_TRAFFIC_CAPTURE_H_INCLUDE
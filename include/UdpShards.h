@@ -0,0 +1,99 @@
+
+#ifndef _UDP_SHARDS_H_INCLUDE
+#define _UDP_SHARDS_H_INCLUDE
+
+#include <memory>
+
+#include "sockets-config.h"
+#include "ISocketHandler.h"
+#include "SocketAddress.h"
+#include "UdpSocket.h"
+#include "Lock.h"
+
+namespace dai {
+
+/**
+ * Binds one UdpSocket class X per sockethandler thread to the same
+ * address and port (SO_REUSEPORT). The kernel spreads incoming datagrams
+ * over the sockets by a hash of source and destination address and port,
+ * so each flow is received by the same thread.
+ * \ingroup basic
+ */
+template<class X>
+class UdpShards
+{
+public:
+    /**
+     * Constructor.
+     * \param h ISocketHandler reference, threaded with SetNumberOfThreads
+     */
+    UdpShards(ISocketHandler& h) : m_handler(h), m_size(0), m_b_steering(false) {}
+
+    /**
+     * Steer flows with a hash of the source address and port (see
+     * UdpSocket::SetReuseportSteering) instead of the kernel default.
+     * Bind attaches the program on the first socket, it applies to the
+     * whole group. The mapping still changes when a socket of the group
+     * is closed. Set before Bind.
+     */
+    void SetSteering(bool x = true)
+    {
+        m_b_steering = x;
+    }
+
+    /**
+     * Bind one X in each sockethandler thread, or one X in the sockethandler
+     * when not threaded. The sockets are deleted by their sockethandler.
+     * \param ad Socket address
+     * \return number of sockets bound
+     */
+    size_t Bind(SocketAddress& ad)
+    {
+        size_t n = m_handler.IsThreaded() ? m_handler.NumberOfThreads() : 1;
+        for (size_t i = 0; i < n; i++)
+        {
+            ISocketHandler& h = m_handler.IsThreaded() ? m_handler.GetThreadHandler(i) : m_handler;
+            std::unique_ptr<X> p(new X(h));
+            p -> SetReuseport();
+            p -> SetDeleteByHandler();
+            if (p -> Bind(ad, 0) == -1)
+            {
+                break;
+            }
+            if (m_b_steering && !m_size)
+            {
+                // the program applies to the whole group
+                p -> SetReuseportSteering(n);
+            }
+            {
+                Lock lock(h.GetMutex());
+                h.Add(p.release());
+            }
+            if (m_handler.IsThreaded())
+            {
+                h.Release();
+            }
+            m_size++;
+        }
+        return m_size;
+    }
+
+    /** Number of sockets bound. */
+    size_t Size() const
+    {
+        return m_size;
+    }
+
+private:
+    UdpShards(const UdpShards& ) = delete;
+    UdpShards& operator=(const UdpShards& ) = delete;
+
+    ISocketHandler& m_handler;
+    size_t          m_size;
+    bool            m_b_steering;
+};
+
+
+}//namespace dai
+
+#endif//_UDP_SHARDS_H_INCLUDE
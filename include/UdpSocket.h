@@ -2,8 +2,17 @@
 #ifndef _UDP_SOCKET_H_INCLUDE
 #define _UDP_SOCKET_H_INCLUDE
 
+#include <vector>
+
 #include "sockets-config.h"
 #include "Socket.h"
+#include "PacketPool.h"
+
+#define UDP_BATCH_SIZE       32    ///< Datagrams per recvmmsg / sendmmsg call
+#define UDP_GSO_MAX_SEGMENTS 64    ///< Datagrams per segmentation offload send
+#define UDP_GSO_MAX_SIZE     65000 ///< Bytes per segmentation offload send
+#define UDP_GRO_BUFSZ        65535 ///< Minimum input buffer size with UDP_GRO
+#define UDP_QUEUE_MAX        8192  ///< Default limit of datagrams waiting for Flush
 
 namespace dai {
 
@@ -13,6 +22,8 @@ namespace dai {
  */
 class UdpSocket : public Socket
 {
+    friend class DestinationCache;
+
 public:
     /**
      * Constructor.
@@ -42,6 +53,32 @@ public:
      */
     virtual void OnRawData(const char *buf, size_t len, struct sockaddr *sa, socklen_t sa_len, struct timeval *ts);
 
+    /** Received datagram, batch receive. */
+    struct Datagram
+    {
+        const char      *buf;
+        size_t           len;
+        struct sockaddr *sa;
+        socklen_t        sa_len;
+    };
+
+    /**
+     * Called with the datagrams received by one system call when batch
+     * receive is enabled. Default implementation calls OnRawData for
+     * each datagram.
+     * \param datagrams Received datagrams, valid during the call
+     * \param n Number of datagrams
+     */
+    virtual void OnRawDataBatch(const Datagram *datagrams, size_t n);
+
+    /**
+     * Called for each datagram received when packet receive is enabled.
+     * Move p to keep the datagram, it is released when the call returns
+     * otherwise. Default implementation calls OnRawData.
+     * \param p Received datagram, in a buffer owned by p
+     */
+    virtual void OnPacket(Packet& p);
+
     /**
      * To receive incoming data, call Bind to setup an incoming port.
      * \param port Incoming port number
@@ -123,7 +160,11 @@ public:
     bool Open(SocketAddress& ad);
 
     /**
-     * Send to specified host
+     * Send to specified host. The address is taken from the destination
+     * cache of the sockethandler, see ISocketHandler::GetDestination; while
+     * the host is being resolved a few datagrams are kept and sent when the
+     * address arrives, see ISocketHandler::QueueDestination. Call in the
+     * sockethandler thread.
      */
     void SendToBuf(const std::string&, port_t, const char *data, int len, int flags = 0);
 
@@ -180,6 +221,84 @@ public:
      */
     void Send(const std::string&, int flags = 0);
 
+    /**
+     * Queue a datagram to specified socket address. Queued datagrams
+     * are sent together (sendmmsg) after the current event dispatch.
+     */
+    void QueueSendTo(SocketAddress& ad, const char *data, size_t len);
+
+    /**
+     * Queue a datagram to connected address.
+     */
+    void QueueSend(const char *data, size_t len);
+
+    /**
+     * Send queued datagrams now.
+     */
+    void Flush();
+
+    /**
+     * Maximum number of queued datagrams, more are dropped
+     * until the socket is writable again.
+     */
+    void SetQueueLimit(size_t n);
+    /** Datagrams dropped because the send queue was full. */
+    uint64_t QueueDropped() const;
+
+    /**
+     * Send len bytes to specified socket address as datagrams of segment
+     * bytes, the last one may be shorter. Uses UDP segmentation offload
+     * (UDP_SEGMENT) on linux, one sendto per datagram elsewhere or when
+     * the kernel does not support it.
+     */
+    void SendToSegmented(SocketAddress& ad, const char *data, size_t len, size_t segment);
+
+    /**
+     * Send len bytes to connected address as datagrams of segment bytes.
+     */
+    void SendSegmented(const char *data, size_t len, size_t segment);
+
+    /**
+     * Bind with SO_REUSEPORT; several sockets, in different threads,
+     * share the same address and port. Set before Bind.
+     */
+    void SetReuseport(bool = true);
+
+    /**
+     * Reuseport group of n sockets; steer datagrams to socket number
+     * hash(source address, source port) % n of the kernel reuseport array,
+     * which is in Bind order. The program belongs to the group, attach it
+     * on any bound socket, also before the others are bound. Closing a
+     * socket moves the last one into its slot, so the mapping changes,
+     * and indexes past the end fall back to the kernel default.
+     * Linux only; assumes ipv4 headers without options.
+     */
+    bool SetReuseportSteering(size_t n);
+
+    /**
+     * Receive coalesced datagrams (UDP_GRO), enables batch receive.
+     * Coalesced datagrams are split again before OnRawDataBatch / OnRawData,
+     * the input buffers are enlarged to UDP_GRO_BUFSZ. Refused with read
+     * timestamps unless packet receive is enabled. Linux only.
+     */
+    void SetGro(bool = true);
+
+    /**
+     * Receive up to n datagrams per system call (recvmmsg), delivered by
+     * OnRawDataBatch. Allocates n input buffers of ibufsz bytes.
+     * Not used when read timestamp is enabled. Linux only.
+     */
+    void SetBatchReceive(size_t n = UDP_BATCH_SIZE);
+
+    /**
+     * Receive into buffers of the sockethandler PacketPool and hand each
+     * datagram to OnPacket, no copy is needed to keep or pass it to another
+     * thread. Reads up to the batch receive size per system call.
+     * With UDP_GRO, a coalesced datagram is one Packet, see Packet::Segment,
+     * the default OnPacket splits it again for OnRawData.
+     */
+    void SetPacketReceive(bool = true);
+
     /**
      * Set broadcast
      */
@@ -239,7 +358,8 @@ public:
     int GetLastSizeWritten();
 
     /**
-     * Also read timestamp information from incoming message
+     * Also read timestamp information from incoming message.
+     * Refused with UDP_GRO unless packet receive is enabled.
      */
     void SetTimestamp(bool = true);
 
@@ -247,6 +367,7 @@ protected:
     UdpSocket(const UdpSocket& s) : Socket(s) {}
 
     void OnRead();
+    void OnWrite();
 
 #if defined(LINUX) || defined(MACOSX)
     /**
@@ -266,6 +387,24 @@ private:
      */
     void CreateConnection();
 
+#ifdef LINUX
+    void ReadBatch();
+#endif
+    void ReadPackets();
+    void SendSegments(struct sockaddr *sa, socklen_t sa_len, const char *data, size_t len, size_t segment);
+    void QueueDatagram(struct sockaddr *sa, socklen_t sa_len, const char *data, size_t len);
+    /** sendto, creates the socket if needed */
+    void SendToBuf(struct sockaddr *sa, socklen_t sa_len, const char *data, int len, int flags);
+
+    /** Queued datagram, data in m_queue_buf. */
+    struct Queued
+    {
+        size_t                  offset;
+        size_t                  len;
+        struct sockaddr_storage addr;
+        socklen_t               addr_len; ///< 0 - connected address
+    };
+
     char  *m_ibuf;    ///< Input buffer
     int    m_ibufsz;  ///< Size of input buffer
     bool   m_bind_ok; ///< Bind completed successfully
@@ -273,6 +412,33 @@ private:
     int    m_last_size_written;
     int    m_retries;
     bool   m_b_read_ts;
+    size_t m_batch_size;  ///< Batch receive, 0 if disabled
+    std::vector<char>                    m_batch_buf;  ///< m_batch_size * m_ibufsz
+    std::vector<struct sockaddr_storage> m_batch_addr;
+    std::vector<Datagram>                m_batch;
+#ifdef LINUX
+    std::vector<struct mmsghdr>          m_batch_msg;
+    std::vector<struct iovec>            m_batch_iov;
+    std::vector<char>                    m_batch_control; ///< UDP_GRO segment size
+    std::vector<Datagram>                m_gro;   ///< Coalesced datagrams split, truncated ones left out
+#endif
+    PacketPool *m_packet_pool;  ///< Packet receive, NULL if disabled
+    std::vector<PacketPool::Block *>     m_packet_blocks; ///< Buffers for the next read
+    std::vector<PacketPool::Block *>     m_packet_ready;  ///< Buffers filled by the last read
+#ifdef LINUX
+    std::vector<struct mmsghdr>          m_packet_msg;
+    std::vector<struct iovec>            m_packet_iov;
+    std::vector<char>                    m_packet_control; ///< SO_TIMESTAMP, UDP_GRO
+#endif
+    bool   m_b_gro;
+    bool   m_b_gso;   ///< Segmentation offload not refused by the kernel
+    bool   m_b_reuseport;
+    std::vector<Queued> m_queue;     ///< Datagrams waiting for Flush
+    std::vector<char>   m_queue_buf;
+    bool                m_b_flush_pending;
+    size_t              m_queue_max;
+    uint64_t            m_queue_dropped;
+    bool                m_b_queue_full;  ///< Drop is logged once until datagrams are sent
 };
 
 
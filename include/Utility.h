@@ -316,6 +316,13 @@ public:
      */
     static unsigned long Rnd();
 
+    /**
+     * Fill buf with unpredictable bytes, from RAND_bytes when built with
+     * openssl, else from /dev/urandom.
+     * \return false if no random source is available
+     */
+    static bool RandomBytes(void *buf, size_t len);
+
     static const char *Logo;
     static const std::string Stack();
 
@@ -0,0 +1,51 @@
+
+#ifndef _WAKEUP_H_INCLUDE
+#define _WAKEUP_H_INCLUDE
+
+#include "sockets-config.h"
+#include "socket_include.h"
+#include "Mutex.h"
+
+#include <atomic>
+
+namespace dai {
+
+/**
+ * Wakes a sockethandler waiting in select from another thread, with a
+ * datagram to the handler's release socket. Shared by the sockethandler
+ * and the worker pools reporting to it, see ISocketHandler::GetWakeup.
+ * Wakeups before the sockethandler runs its next events are coalesced
+ * into one datagram.
+ * \ingroup threading
+ */
+class Wakeup
+{
+public:
+    /**
+     * \param port Loopback port of the release socket
+     */
+    Wakeup(port_t port);
+    ~Wakeup();
+
+    /** Wake the sockethandler, any thread. */
+    void Wake();
+
+    /** The sockethandler is about to run its events - internal use. */
+    void Reset();
+
+    /** The sockethandler is gone, Wake does nothing from now on. */
+    void Close();
+
+private:
+    Wakeup(const Wakeup& ) = delete;
+    Wakeup& operator=(const Wakeup& ) = delete;
+
+    Mutex               m_mutex;
+    SOCKET              m_socket;
+    struct sockaddr_in  m_sa;
+    std::atomic<bool>   m_b_woken;
+};
+
+}//namespace dai
+
+#endif//_WAKEUP_H_INCLUDE
@@ -0,0 +1,72 @@
+
+#ifndef _WORKER_POOL_H_INCLUDE
+#define _WORKER_POOL_H_INCLUDE
+
+#include "sockets-config.h"
+
+#include <atomic>
+#include <list>
+
+#include "Mutex.h"
+#include "Semaphore.h"
+#include "Thread.h"
+
+namespace dai {
+
+/**
+ * Threads of a process wide worker pool. The derived pool keeps its own
+ * job queue under m_mutex, and runs one job in Work each time a worker is
+ * signalled. Workers are started when the first job is queued.
+ * \ingroup threading
+ */
+class WorkerPool
+{
+public:
+    /**
+     * Number of worker threads, takes effect when the next
+     * job is queued.
+     */
+    void SetThreads(size_t n);
+    size_t Threads() const;
+
+protected:
+    WorkerPool(size_t threads);
+    virtual ~WorkerPool();
+
+    /** Start missing workers, call with m_mutex locked. */
+    void StartWorkers();
+    /** Wake one worker to call Work. */
+    void Signal();
+    /** Stop the workers, called by the destructor of the derived pool. */
+    void Stop();
+
+    /** Run the next queued job, in a worker thread. The queue may be empty. */
+    virtual void Work() = 0;
+
+    Mutex m_mutex; ///< Job queue of the derived pool
+
+private:
+    WorkerPool(const WorkerPool& ) = delete;
+    WorkerPool& operator=(const WorkerPool& ) = delete;
+
+    class Worker : public Thread
+    {
+    public:
+        Worker(WorkerPool& pool);
+        ~Worker();
+
+        void Run();
+
+    private:
+        WorkerPool& m_pool;
+    };
+
+    Semaphore            m_sem;
+    std::list<Worker *>  m_workers;
+    size_t               m_threads;
+    std::atomic<bool>    m_quit;
+};
+
+}//namespace dai
+
+#endif//_WORKER_POOL_H_INCLUDE
@@ -0,0 +1,301 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "DestinationCache.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "ISocketHandler.h"
+#include "Utility.h"
+#include "Ipv4Address.h"
+#include "Ipv6Address.h"
+#include "UdpSocket.h"
+
+namespace dai {
+
+
+DestinationCache::DestinationCache(ISocketHandler& h)
+    : Socket(h)
+    , m_ttl(DESTINATION_CACHE_TTL)
+    , m_max_entries(DESTINATION_CACHE_MAX)
+    , m_queued(0)
+{
+}
+
+
+DestinationCache::~DestinationCache()
+{
+}
+
+
+bool DestinationCache::Get(const std::string& host, port_t port, bool ipv6, struct sockaddr_storage& sa, socklen_t& sa_len)
+{
+    Key(host, port, ipv6);
+    time_t now = time(nullptr);
+    auto it = m_entries.find(m_key);
+    if (it == m_entries.end())
+    {
+        // a name is resolved once in this thread, numeric hosts are only parsed
+        while (!m_entries.empty() && m_entries.size() >= (m_max_entries ? m_max_entries : 1))
+        {
+            m_queued -= m_entries.begin() -> second.queue.size();
+            m_entries.erase(m_entries.begin());
+        }
+        Entry e;
+        e.host = host;
+        e.port = port;
+        e.ipv6 = ipv6;
+        e.sa_len = 0;
+        e.expires = now;
+        e.refreshing = false;
+        bool numeric = ipv6 ? Utility::isIpv6(host) : Utility::isIpv4(host);
+        it = m_entries.insert(std::make_pair(m_key, e)).first;
+        if (numeric)
+        {
+            Lookup(it -> second);
+            it -> second.expires = it -> second.sa_len ? 0 : now + m_ttl;
+        }
+        else
+        {
+            // with the resolver enabled, datagrams are queued until the answer arrives
+            Refresh(it -> first, it -> second, now);
+        }
+    }
+    else if (it -> second.expires && it -> second.expires <= now && !it -> second.refreshing)
+    {
+        Refresh(it -> first, it -> second, now);
+    }
+    const Entry& e = it -> second;
+    if (!e.sa_len)
+    {
+        return false;
+    }
+    memcpy(&sa, &e.sa, e.sa_len);
+    sa_len = e.sa_len;
+    return true;
+}
+
+
+bool DestinationCache::Queue(UdpSocket *p, const std::string& host, port_t port, bool ipv6, const char *data, int len, int flags)
+{
+    auto it = m_entries.find(Key(host, port, ipv6));
+    if (it == m_entries.end() || !it -> second.refreshing || it -> second.sa_len)
+    {
+        return false;
+    }
+    std::vector<Datagram>& q = it -> second.queue;
+    if (q.size() >= DESTINATION_CACHE_QUEUE)
+    {
+        return false;
+    }
+    q.push_back(Datagram());
+    Datagram& d = q.back();
+    d.socket = p;
+    d.data.assign(data, len);
+    d.flags = flags;
+    m_queued++;
+    return true;
+}
+
+
+void DestinationCache::Remove(Socket *p)
+{
+    if (!m_queued)
+    {
+        return;
+    }
+    for (auto& it : m_entries)
+    {
+        std::vector<Datagram>& q = it.second.queue;
+        for (size_t i = 0; i < q.size(); )
+        {
+            if (q[i].socket == p)
+            {
+                q.erase(q.begin() + i);
+                m_queued--;
+            }
+            else
+            {
+                i++;
+            }
+        }
+    }
+}
+
+
+void DestinationCache::SetTtl(long sec)
+{
+    m_ttl = sec;
+}
+
+
+void DestinationCache::SetMaxEntries(size_t n)
+{
+    m_max_entries = n;
+}
+
+
+size_t DestinationCache::Size() const
+{
+    return m_entries.size();
+}
+
+
+const std::string& DestinationCache::Key(const std::string& host, port_t port, bool ipv6)
+{
+    char tmp[8];
+    snprintf(tmp, sizeof(tmp), "%c%u", ipv6 ? '/' : ':', (unsigned)port);
+    m_key.assign(host);
+    m_key += tmp;
+    return m_key;
+}
+
+
+bool DestinationCache::Lookup(Entry& e)
+{
+#ifdef ENABLE_IPV6
+#ifdef IPPROTO_IPV6
+    if (e.ipv6)
+    {
+        Ipv6Address ad(e.host, e.port);
+        if (ad.IsValid())
+        {
+            e.sa_len = ad;
+            memcpy(&e.sa, (struct sockaddr *)ad, e.sa_len);
+            return true;
+        }
+        e.sa_len = 0;
+        return false;
+    }
+#endif
+#endif
+    Ipv4Address ad(e.host, e.port);
+    if (ad.IsValid())
+    {
+        e.sa_len = ad;
+        memcpy(&e.sa, (struct sockaddr *)ad, e.sa_len);
+        return true;
+    }
+    e.sa_len = 0;
+    return false;
+}
+
+
+void DestinationCache::Refresh(const std::string& key, Entry& e, time_t now)
+{
+#ifdef ENABLE_RESOLVER
+    if (Handler().ResolverEnabled())
+    {
+        // the expired address is used until the answer arrives
+        int id =
+#ifdef ENABLE_IPV6
+            e.ipv6 ? Handler().Resolve6(this, e.host, e.port) :
+#endif
+            Handler().Resolve(this, e.host, e.port);
+        m_resolving[id] = key;
+        e.refreshing = true;
+        return;
+    }
+#endif
+    // no resolver, look up once per lifetime, keep the last address on failure
+    Entry tmp = e;
+    if (Lookup(tmp))
+    {
+        memcpy(&e.sa, &tmp.sa, tmp.sa_len);
+        e.sa_len = tmp.sa_len;
+    }
+    e.expires = now + (e.sa_len ? m_ttl : RetryTtl());
+}
+
+
+long DestinationCache::RetryTtl() const
+{
+    return m_ttl < DESTINATION_CACHE_RETRY ? m_ttl : DESTINATION_CACHE_RETRY;
+}
+
+
+#ifdef ENABLE_RESOLVER
+DestinationCache::Entry *DestinationCache::Resolved(int id)
+{
+    auto it = m_resolving.find(id);
+    if (it == m_resolving.end())
+    {
+        return NULL;
+    }
+    auto it2 = m_entries.find(it -> second);
+    m_resolving.erase(it);
+    if (it2 == m_entries.end())
+    {
+        return NULL;
+    }
+    it2 -> second.refreshing = false;
+    it2 -> second.expires = time(nullptr) + m_ttl;
+    return &it2 -> second;
+}
+
+
+void DestinationCache::Flush(Entry& e)
+{
+    // queues of deleted sockets are dropped by Remove
+    std::vector<Datagram> q;
+    q.swap(e.queue);
+    m_queued -= q.size();
+    for (Datagram& d : q)
+    {
+        d.socket -> SendToBuf((struct sockaddr *)&e.sa, e.sa_len, d.data.data(), (int)d.data.size(), d.flags);
+    }
+}
+
+
+void DestinationCache::OnResolved(int id, ipaddr_t a, port_t port)
+{
+    Entry *e = Resolved(id);
+    if (e && !e -> ipv6)
+    {
+        Ipv4Address ad(a, port);
+        e -> sa_len = ad;
+        memcpy(&e -> sa, (struct sockaddr *)ad, e -> sa_len);
+        Flush(*e);
+    }
+}
+
+
+#ifdef ENABLE_IPV6
+void DestinationCache::OnResolved(int id, in6_addr& a, port_t port)
+{
+    Entry *e = Resolved(id);
+    if (e && e -> ipv6)
+    {
+        Ipv6Address ad(a, port);
+        e -> sa_len = ad;
+        memcpy(&e -> sa, (struct sockaddr *)ad, e -> sa_len);
+        Flush(*e);
+    }
+}
+#endif
+
+
+void DestinationCache::OnResolveFailed(int id)
+{
+    // keep the last address, try again when it expires
+    Entry *e = Resolved(id);
+    if (e && !e -> sa_len)
+    {
+        e -> expires = time(nullptr) + RetryTtl();
+        if (!e -> queue.empty())
+        {
+            Handler().LogError(this, "OnResolveFailed", 0, "can't resolve " + e -> host + ", " + Utility::l2string((long)e -> queue.size()) + " datagrams dropped", LOG_LEVEL_WARNING);
+            m_queued -= e -> queue.size();
+            e -> queue.clear();
+        }
+    }
+}
+#endif // ENABLE_RESOLVER
+
+
+}//namespace dai
@@ -0,0 +1,829 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "DnsClient.h"
+
+#ifdef ENABLE_RESOLVER
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "ISocketHandler.h"
+#include "TcpSocket.h"
+#include "UdpSocket.h"
+#include "Ipv4Address.h"
+#include "File.h"
+#include "Parse.h"
+#include "Utility.h"
+
+namespace dai {
+
+
+namespace {
+
+const uint16_t TYPE_A     = 1;
+const uint16_t TYPE_PTR   = 12;
+const uint16_t TYPE_AAAA  = 28;
+const uint16_t TYPE_SRV   = 33;
+const uint16_t CLASS_IN   = 1;
+
+const uint16_t FLAG_QR    = 0x8000;
+const uint16_t FLAG_TC    = 0x0200;
+const uint16_t FLAG_RD    = 0x0100;
+const uint16_t RCODE_MASK = 0x000f;
+const uint16_t RCODE_NAME = 3;
+
+const size_t HEADER_SIZE  = 12;
+
+
+uint16_t Get16(const unsigned char *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+
+void Put16(std::string& s, uint16_t x)
+{
+    s += (char)(x >> 8);
+    s += (char)(x & 0xff);
+}
+
+
+/** Append name in wire format, false if it is not a valid domain name. */
+bool PutName(std::string& s, const std::string& name)
+{
+    size_t len = name.size();
+    if (len && name[len - 1] == '.')
+    {
+        len--;
+    }
+    if (!len || len > 253)
+    {
+        return false;
+    }
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t x = name.find('.', i);
+        if (x == std::string::npos || x > len)
+        {
+            x = len;
+        }
+        if (x == i || x - i > 63)
+        {
+            return false;
+        }
+        s += (char)(x - i);
+        s.append(name, i, x - i);
+        i = x + 1;
+    }
+    s += '\0';
+    return true;
+}
+
+
+/** Read a possibly compressed name, pos is moved past it. */
+bool GetName(const unsigned char *msg, size_t len, size_t& pos, std::string *name)
+{
+    size_t p = pos;
+    bool jumped = false;
+    int jumps = 0;
+    if (name)
+    {
+        name -> clear();
+    }
+    while (true)
+    {
+        if (p >= len)
+        {
+            return false;
+        }
+        size_t l = msg[p];
+        if ((l & 0xc0) == 0xc0)
+        {
+            // pointer, limit the number of jumps to stop loops
+            if (p + 1 >= len || ++jumps > 32)
+            {
+                return false;
+            }
+            if (!jumped)
+            {
+                pos = p + 2;
+                jumped = true;
+            }
+            p = ((l & 0x3f) << 8) | msg[p + 1];
+            continue;
+        }
+        if (l & 0xc0)
+        {
+            return false;
+        }
+        p++;
+        if (!l)
+        {
+            break;
+        }
+        if (p + l > len)
+        {
+            return false;
+        }
+        if (name)
+        {
+            if (!name -> empty())
+            {
+                *name += '.';
+            }
+            name -> append(reinterpret_cast<const char *>(msg + p), l);
+        }
+        p += l;
+    }
+    if (!jumped)
+    {
+        pos = p;
+    }
+    return true;
+}
+
+
+/** Compare the echoed question, names are case insensitive. */
+bool SameQuestion(const char *a, const char *b, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+std::string PtrName(ipaddr_t a)
+{
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(&a);
+    char name[32];
+    snprintf(name, sizeof(name), "%u.%u.%u.%u.in-addr.arpa", b[3], b[2], b[1], b[0]);
+    return name;
+}
+
+
+#ifdef ENABLE_IPV6
+std::string PtrName(const in6_addr& a)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(&a);
+    std::string name;
+    for (int i = 15; i >= 0; i--)
+    {
+        name += hex[b[i] & 0x0f];
+        name += '.';
+        name += hex[b[i] >> 4];
+        name += '.';
+    }
+    return name + "ip6.arpa";
+}
+#endif
+
+
+/** Sends one query, connected to the name server. */
+class DnsUdpSocket : public UdpSocket, public DnsClient::Transport
+{
+public:
+    DnsUdpSocket(ISocketHandler& h, DnsClient& client, uint16_t id)
+        : UdpSocket(h)
+        , DnsClient::Transport(client, id)
+    {
+    }
+
+    void OnRawData(const char *buf, size_t len, struct sockaddr *, socklen_t)
+    {
+        // only the connected name server is received from
+        Answer(buf, len, false);
+    }
+
+private:
+    void Drop()
+    {
+        SetCloseAndDelete();
+    }
+};
+
+
+/** Asks a truncated query again over tcp. */
+class DnsTcpSocket : public TcpSocket, public DnsClient::Transport
+{
+public:
+    DnsTcpSocket(ISocketHandler& h, DnsClient& client, uint16_t id, const std::string& packet)
+        : TcpSocket(h)
+        , DnsClient::Transport(client, id)
+        , m_packet(packet)
+        , m_b_done(false)
+    {
+    }
+
+    void OnConnect()
+    {
+        std::string msg;
+        Put16(msg, (uint16_t)m_packet.size());
+        msg += m_packet;
+        SendBuf(msg.data(), msg.size());
+    }
+
+    void OnRawData(const char *buf, size_t len)
+    {
+        if (m_b_done)
+        {
+            return;
+        }
+        m_answer.append(buf, len);
+        if (m_answer.size() < 2)
+        {
+            return;
+        }
+        size_t n = Get16(reinterpret_cast<const unsigned char *>(m_answer.data()));
+        if (m_answer.size() < n + 2)
+        {
+            return;
+        }
+        m_b_done = true;
+        Answer(m_answer.data() + 2, n, true);
+        SetCloseAndDelete();
+    }
+
+private:
+    void Drop()
+    {
+        SetCloseAndDelete();
+    }
+
+    std::string m_packet;
+    std::string m_answer;
+    bool        m_b_done;
+};
+
+} // namespace
+
+
+DnsClient::Transport::~Transport()
+{
+    if (m_client)
+    {
+        m_client -> Gone(m_id, this);
+    }
+}
+
+
+void DnsClient::Transport::Detach()
+{
+    m_client = NULL;
+    Drop();
+}
+
+
+void DnsClient::Transport::Answer(const char *buf, size_t len, bool tcp)
+{
+    if (m_client)
+    {
+        m_client -> Answer(m_id, buf, len, tcp);
+    }
+}
+
+
+DnsClient::DnsClient(ISocketHandler& h)
+    : Socket(h)
+    , m_timeout(DNS_TIMEOUT)
+    , m_attempts(DNS_ATTEMPTS)
+{
+    LoadResolvConf();
+    LoadHosts();
+    if (m_servers.empty())
+    {
+        AddServer("127.0.0.1");
+    }
+}
+
+
+DnsClient::~DnsClient()
+{
+    // unanswered lookups fail
+    for (auto& it : m_pending)
+    {
+        CloseSockets(it.second);
+        it.second.job -> ok = false;
+        ResolverPool::Complete(it.second.job);
+    }
+}
+
+
+bool DnsClient::LoadResolvConf(const std::string& path)
+{
+    File f;
+    if (!f.fopen(path, "r"))
+    {
+        return false;
+    }
+    char slask[1000];
+    while (f.fgets(slask, sizeof(slask)))
+    {
+        Parse pa(slask, " \t\r\n");
+        std::string key = pa.getword();
+        if (key == "nameserver")
+        {
+            std::string ip = pa.getword();
+            if (Utility::isIpv4(ip))
+            {
+                AddServer(ip);
+            }
+        }
+        else if (key == "options")
+        {
+            std::string opt = pa.getword();
+            while (!opt.empty())
+            {
+                if (opt.compare(0, 8, "timeout:") == 0)
+                {
+                    SetTimeout(atol(opt.c_str() + 8) * 1000000L);
+                }
+                else if (opt.compare(0, 9, "attempts:") == 0)
+                {
+                    SetAttempts(atoi(opt.c_str() + 9));
+                }
+                opt = pa.getword();
+            }
+        }
+    }
+    f.fclose();
+    return true;
+}
+
+
+bool DnsClient::LoadHosts(const std::string& path)
+{
+    File f;
+    if (!f.fopen(path, "r"))
+    {
+        return false;
+    }
+    char slask[1000];
+    while (f.fgets(slask, sizeof(slask)))
+    {
+        char *comment = strchr(slask, '#');
+        if (comment)
+        {
+            *comment = 0;
+        }
+        Parse pa(slask, " \t\r\n");
+        std::string ip = pa.getword();
+        std::vector<std::string> names;
+        std::string name = pa.getword();
+        while (!name.empty())
+        {
+            names.push_back(Utility::ToLower(name));
+            name = pa.getword();
+        }
+        if (names.empty())
+        {
+            continue;
+        }
+        if (Utility::isIpv4(ip))
+        {
+            ipaddr_t a;
+            Utility::u2ip(ip, a);
+            for (auto& n : names)
+            {
+                m_hosts.insert(std::make_pair(n, a));
+            }
+            // first name of the first line is the canonical name
+            m_names.insert(std::make_pair(PtrName(a), names[0]));
+        }
+#ifdef ENABLE_IPV6
+        else if (Utility::isIpv6(ip))
+        {
+            in6_addr a;
+            Utility::u2ip(ip, a);
+            for (auto& n : names)
+            {
+                m_hosts6.insert(std::make_pair(n, a));
+            }
+            m_names.insert(std::make_pair(PtrName(a), names[0]));
+        }
+#endif
+    }
+    f.fclose();
+    return true;
+}
+
+
+void DnsClient::AddServer(const std::string& ip, port_t port)
+{
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    if (!Utility::isIpv4(ip) || !Utility::u2ip(ip, sa))
+    {
+        Handler().LogError(this, "AddServer", 0, "not an ipv4 address: " + ip, LOG_LEVEL_ERROR);
+        return;
+    }
+    sa.sin_port = htons(port);
+    m_servers.push_back(sa);
+}
+
+
+void DnsClient::ClearServers()
+{
+    m_servers.clear();
+}
+
+
+size_t DnsClient::Servers() const
+{
+    return m_servers.size();
+}
+
+
+void DnsClient::SetTimeout(long usec)
+{
+    m_timeout = usec > 0 ? usec : DNS_TIMEOUT;
+}
+
+
+void DnsClient::SetAttempts(int n)
+{
+    m_attempts = n > 0 ? n : 1;
+}
+
+
+bool DnsClient::Hosts(ResolverPool::Job *job)
+{
+    switch (job -> query)
+    {
+    case ResolverPool::QUERY_A:
+        {
+            if (Utility::isIpv4(job -> host))
+            {
+                return Utility::u2ip(job -> host, job -> a);
+            }
+            auto it = m_hosts.find(Utility::ToLower(job -> host));
+            if (it != m_hosts.end())
+            {
+                job -> a = it -> second;
+                return true;
+            }
+        }
+        break;
+    case ResolverPool::QUERY_AAAA:
+#ifdef ENABLE_IPV6
+        {
+            if (Utility::isIpv6(job -> host))
+            {
+                return Utility::u2ip(job -> host, job -> a6);
+            }
+            auto it = m_hosts6.find(Utility::ToLower(job -> host));
+            if (it != m_hosts6.end())
+            {
+                job -> a6 = it -> second;
+                return true;
+            }
+        }
+#endif
+        break;
+    case ResolverPool::QUERY_PTR:
+        {
+            auto it = m_names.find(PtrName(job -> a));
+            if (it != m_names.end())
+            {
+                job -> name = it -> second;
+                return true;
+            }
+        }
+        break;
+    case ResolverPool::QUERY_PTR6:
+#ifdef ENABLE_IPV6
+        {
+            auto it = m_names.find(PtrName(job -> a6));
+            if (it != m_names.end())
+            {
+                job -> name = it -> second;
+                return true;
+            }
+        }
+#endif
+        break;
+    case ResolverPool::QUERY_SRV:
+        break;
+    }
+    return false;
+}
+
+
+void DnsClient::Query(ResolverPool::Job *job)
+{
+    if (Hosts(job))
+    {
+        job -> ok = true;
+        ResolverPool::Complete(job);
+        return;
+    }
+    std::string name;
+    uint16_t type = 0;
+    switch (job -> query)
+    {
+    case ResolverPool::QUERY_A:
+        name = job -> host;
+        type = TYPE_A;
+        break;
+    case ResolverPool::QUERY_AAAA:
+        name = job -> host;
+        type = TYPE_AAAA;
+        break;
+    case ResolverPool::QUERY_PTR:
+        name = PtrName(job -> a);
+        type = TYPE_PTR;
+        break;
+    case ResolverPool::QUERY_PTR6:
+#ifdef ENABLE_IPV6
+        name = PtrName(job -> a6);
+        type = TYPE_PTR;
+#endif
+        break;
+    case ResolverPool::QUERY_SRV:
+        name = job -> host;
+        type = TYPE_SRV;
+        break;
+    }
+    uint16_t id;
+    do
+    {
+        if (!Utility::RandomBytes(&id, sizeof(id)))
+        {
+            Handler().LogError(this, "Query", 0, "no random source for query id's", LOG_LEVEL_ERROR);
+            job -> ok = false;
+            ResolverPool::Complete(job);
+            return;
+        }
+    } while (m_pending.find(id) != m_pending.end());
+    std::string packet;
+    Put16(packet, id);
+    Put16(packet, FLAG_RD);
+    Put16(packet, 1); // qdcount
+    Put16(packet, 0);
+    Put16(packet, 0);
+    Put16(packet, 0);
+    if (!type || m_servers.empty() || !PutName(packet, name))
+    {
+        job -> ok = false;
+        ResolverPool::Complete(job);
+        return;
+    }
+    Put16(packet, type);
+    Put16(packet, CLASS_IN);
+    Pending& q = m_pending[id];
+    q.job = job;
+    q.packet = packet;
+    q.server = 0;
+    q.sends = 0;
+    q.udp = NULL;
+    q.tcp = NULL;
+    Send(id, q);
+}
+
+
+void DnsClient::Send(uint16_t id, Pending& q)
+{
+    // each attempt tries all servers in order
+    q.server = q.sends % m_servers.size();
+    q.sends++;
+    // a new socket, and source port, for each attempt
+    if (q.udp)
+    {
+        q.udp -> Detach();
+        q.udp = NULL;
+    }
+    DnsUdpSocket *p = new DnsUdpSocket(Handler(), *this, id);
+    p -> SetDeleteByHandler();
+    Ipv4Address ad(m_servers[q.server]);
+    if (p -> Open(ad))
+    {
+        Handler().Add(p);
+        p -> SendBuf(q.packet.data(), q.packet.size());
+        q.udp = p;
+    }
+    else
+    {
+        delete p;
+    }
+    Handler().AddTimer(this, m_timeout, TimerId(id));
+}
+
+
+void DnsClient::Retry(uint16_t id, Pending& q)
+{
+    if (q.sends < m_attempts * (int)m_servers.size())
+    {
+        Send(id, q);
+    }
+    else
+    {
+        Done(id, false);
+    }
+}
+
+
+void DnsClient::Done(uint16_t id, bool ok)
+{
+    auto it = m_pending.find(id);
+    if (it == m_pending.end())
+    {
+        return;
+    }
+    Handler().RemoveTimer(this, TimerId(id));
+    CloseSockets(it -> second);
+    ResolverPool::Job *job = it -> second.job;
+    m_pending.erase(it);
+    job -> ok = ok;
+    ResolverPool::Complete(job);
+}
+
+
+void DnsClient::CloseSockets(Pending& q)
+{
+    if (q.udp)
+    {
+        q.udp -> Detach();
+        q.udp = NULL;
+    }
+    if (q.tcp)
+    {
+        q.tcp -> Detach();
+        q.tcp = NULL;
+    }
+}
+
+
+void DnsClient::Gone(uint16_t id, Transport *t)
+{
+    auto it = m_pending.find(id);
+    if (it == m_pending.end())
+    {
+        return;
+    }
+    if (it -> second.udp == t)
+    {
+        it -> second.udp = NULL;
+    }
+    if (it -> second.tcp == t)
+    {
+        it -> second.tcp = NULL;
+    }
+}
+
+
+void DnsClient::OnInternalTimer(int id)
+{
+    if (id > TimerId(0) || id < TimerId(0xffff))
+    {
+        Socket::OnInternalTimer(id);
+        return;
+    }
+    uint16_t qid = (uint16_t)(-1 - id);
+    auto it = m_pending.find(qid);
+    if (it != m_pending.end())
+    {
+        Retry(qid, it -> second);
+    }
+}
+
+
+void DnsClient::Answer(uint16_t id, const char *buf, size_t len, bool tcp)
+{
+    const unsigned char *msg = reinterpret_cast<const unsigned char *>(buf);
+    // the socket belongs to query id
+    if (len < HEADER_SIZE || Get16(msg) != id)
+    {
+        return;
+    }
+    auto it = m_pending.find(id);
+    if (it == m_pending.end())
+    {
+        return;
+    }
+    Pending& q = it -> second;
+    uint16_t flags = Get16(msg + 2);
+    size_t qlen = q.packet.size() - HEADER_SIZE;
+    if (!(flags & FLAG_QR) || Get16(msg + 4) != 1 || len < HEADER_SIZE + qlen ||
+        !SameQuestion(buf + HEADER_SIZE, q.packet.data() + HEADER_SIZE, qlen))
+    {
+        return;
+    }
+    if ((flags & FLAG_TC) && !tcp)
+    {
+        // the timer keeps running, a failed tcp query is retried over udp
+        if (q.tcp)
+        {
+            q.tcp -> Detach();
+        }
+        DnsTcpSocket *p = new DnsTcpSocket(Handler(), *this, id, q.packet);
+        p -> SetDeleteByHandler();
+        Ipv4Address ad(m_servers[q.server]);
+        p -> Open(ad);
+        Handler().Add(p);
+        q.tcp = p;
+        return;
+    }
+    uint16_t rcode = flags & RCODE_MASK;
+    if (rcode == RCODE_NAME)
+    {
+        Done(id, false);
+    }
+    else if (rcode)
+    {
+        Retry(id, q);
+    }
+    else
+    {
+        Done(id, Records(q, msg, len, HEADER_SIZE + qlen, Get16(msg + 6)));
+    }
+}
+
+
+bool DnsClient::Records(Pending& q, const unsigned char *msg, size_t len, size_t pos, int count)
+{
+    ResolverPool::Job *job = q.job;
+    bool ok = false;
+    for (int i = 0; i < count; i++)
+    {
+        if (!GetName(msg, len, pos, NULL) || pos + 10 > len)
+        {
+            break;
+        }
+        uint16_t type = Get16(msg + pos);
+        uint16_t cls = Get16(msg + pos + 2);
+        size_t rdlen = Get16(msg + pos + 8);
+        pos += 10;
+        if (pos + rdlen > len)
+        {
+            break;
+        }
+        if (cls != CLASS_IN)
+        {
+            pos += rdlen;
+            continue;
+        }
+        // other records, e.g. cname, are skipped - the recursive server follows them
+        switch (job -> query)
+        {
+        case ResolverPool::QUERY_A:
+            if (type == TYPE_A && rdlen == 4 && !ok)
+            {
+                memcpy(&job -> a, msg + pos, 4);
+                ok = true;
+            }
+            break;
+        case ResolverPool::QUERY_AAAA:
+#ifdef ENABLE_IPV6
+            if (type == TYPE_AAAA && rdlen == 16 && !ok)
+            {
+                memcpy(&job -> a6, msg + pos, 16);
+                ok = true;
+            }
+#endif
+            break;
+        case ResolverPool::QUERY_PTR:
+        case ResolverPool::QUERY_PTR6:
+            if (type == TYPE_PTR && !ok)
+            {
+                size_t p = pos;
+                ok = GetName(msg, len, p, &job -> name) && !job -> name.empty();
+            }
+            break;
+        case ResolverPool::QUERY_SRV:
+            if (type == TYPE_SRV && rdlen >= 7)
+            {
+                Socket::SrvRecord r;
+                r.priority = Get16(msg + pos);
+                r.weight = Get16(msg + pos + 2);
+                r.port = Get16(msg + pos + 4);
+                size_t p = pos + 6;
+                if (GetName(msg, len, p, &r.target))
+                {
+                    job -> srv.push_back(r);
+                    ok = true;
+                }
+            }
+            break;
+        }
+        pos += rdlen;
+    }
+    return ok;
+}
+
+
+}//namespace dai
+
+#endif // ENABLE_RESOLVER
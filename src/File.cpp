@@ -142,6 +142,15 @@ const std::string& File::Path() const
     return m_path;
 }
 
+int File::fd() const
+{
+#if defined( _WIN32) && !defined(__CYGWIN__)
+    return -1;
+#else
+    return m_fil ? fileno(m_fil) : -1;
+#endif
+}
+
 }//namespace dai
 
 
@@ -264,14 +264,25 @@ void HTTPSocket::SendResponse()
 
 void HTTPSocket::AddResponseHeader(const std::string& header, const char *format, ...)
 {
-    char slask[8192]; // temporary for vsprintf / vsnprintf
     va_list ap;
+    va_list ap2;
 
+    // format straight into the header value, measure first
     va_start(ap, format);
-    vsnprintf(slask, sizeof(slask), format, ap);
+    va_copy(ap2, ap);
+    int n = vsnprintf(nullptr, 0, format, ap);
+    std::string& value = m_response_header[header];
+    if (n > 0)
+    {
+        value.resize(n);
+        vsnprintf(&value[0], n + 1, format, ap2);
+    }
+    else
+    {
+        value.clear();
+    }
+    va_end(ap2);
     va_end(ap);
-
-    m_response_header[header] = slask;
 }
 
 
@@ -463,6 +474,10 @@ void HTTPSocket::url_this(const std::string& url_in,
         pa.getword(host);
         port = static_cast<port_t>(pa.getvalue());
     }
+#ifdef HAVE_OPENSSL
+    // resume tls sessions per host, whatever address it resolves to
+    SetSslSessionKey(host + ":" + Utility::l2string(port));
+#endif
     url = "/" + pa.getrest();
     {
         Parse pa(url, "/");
@@ -137,6 +137,23 @@ void HttpBaseSocket::IHttpServer_Respond(const HttpResponse& res)
 // --------------------------------------------------------------------------------------
 void HttpBaseSocket::OnTransferLimit()
 {
+#ifndef _WIN32
+    IFile& f = m_res.GetFile();
+    off_t sz = f.fd() != -1 ? f.size() : 0;
+    if (sz > 0)
+    {
+        // queue the whole file for sendfile(); SendFile keeps its own descriptor,
+        // so the file is closed here and the next call only completes the response
+        if (SendFile(f.fd(), 0, (size_t)sz))
+        {
+            f.fclose();
+            if (GetOutputLength())
+            {
+                SetTransferLimit(1);
+            }
+        }
+    }
+#endif
     char msg[32768];
     size_t n = m_res.GetFile().fread(msg, 1, 32768);
     while (n > 0)
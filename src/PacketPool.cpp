@@ -0,0 +1,116 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "PacketPool.h"
+
+namespace dai {
+
+
+PacketPool::PacketPool(size_t bufsz)
+    : m_bufsz(bufsz)
+    , m_max_free(PACKET_POOL_MAX_FREE)
+    , m_outstanding(0)
+    , m_b_closed(false)
+{
+}
+
+
+PacketPool::~PacketPool()
+{
+    for (auto b : m_free)
+    {
+        delete[] reinterpret_cast<char *>(b);
+    }
+}
+
+
+size_t PacketPool::BufferSize() const
+{
+    return m_bufsz;
+}
+
+
+void PacketPool::SetMaxFree(size_t n)
+{
+    m_mutex.Lock();
+    m_max_free = n;
+    m_mutex.Unlock();
+}
+
+
+size_t PacketPool::Outstanding() const
+{
+    m_mutex.Lock();
+    size_t n = m_outstanding;
+    m_mutex.Unlock();
+    return n;
+}
+
+
+size_t PacketPool::Free() const
+{
+    m_mutex.Lock();
+    size_t n = m_free.size();
+    m_mutex.Unlock();
+    return n;
+}
+
+
+void PacketPool::Get(std::vector<Block *>& blocks, size_t n)
+{
+    m_mutex.Lock();
+    m_outstanding += n;
+    while (n && !m_free.empty())
+    {
+        blocks.push_back(m_free.back());
+        m_free.pop_back();
+        n--;
+    }
+    m_mutex.Unlock();
+    // allocate outside the lock
+    while (n--)
+    {
+        Block *b = reinterpret_cast<Block *>(new char[sizeof(Block) + m_bufsz]);
+        b -> pool = this;
+        blocks.push_back(b);
+    }
+}
+
+
+void PacketPool::Put(Block *b)
+{
+    m_mutex.Lock();
+    m_outstanding--;
+    if (!m_b_closed && m_free.size() < m_max_free)
+    {
+        m_free.push_back(b);
+        b = NULL;
+    }
+    bool done = m_b_closed && !m_outstanding;
+    m_mutex.Unlock();
+    delete[] reinterpret_cast<char *>(b);
+    if (done)
+    {
+        delete this;
+    }
+}
+
+
+void PacketPool::Close()
+{
+    m_mutex.Lock();
+    m_b_closed = true;
+    bool done = !m_outstanding;
+    m_mutex.Unlock();
+    if (done)
+    {
+        delete this;
+    }
+}
+
+
+}//namespace dai
@@ -157,7 +157,10 @@ void ResolvSocket::OnLine(const std::string& line)
         return;
     }
     std::string key = pa.getword();
-    std::string value = pa.getrest();
+    // not getrest, it would skip the leading ':' of an ipv6 address like "::1"
+    size_t x = line.find(':');
+    x = (x == std::string::npos) ? line.size() : line.find_first_not_of(' ', x + 1);
+    std::string value = (x == std::string::npos) ? "" : line.substr(x);
     DEB(    fprintf(stderr, " *** ResolvSocket response;  %s: %s\n", key.c_str(), value.c_str());)
 
     if (key == "Cached")
@@ -0,0 +1,246 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "ResolverPool.h"
+
+#ifdef ENABLE_RESOLVER
+
+#include <cstring>
+
+#include "Lock.h"
+#include "Utility.h"
+#include "Wakeup.h"
+
+namespace dai {
+
+
+ResolverPool::Queue::~Queue()
+{
+    // lookups finished after the sockethandler was gone
+    Job *job = Take();
+    while (job)
+    {
+        Job *next = job -> next;
+        delete job;
+        job = next;
+    }
+}
+
+
+void ResolverPool::Queue::Push(Job *job)
+{
+    Job *head = m_head.load(std::memory_order_relaxed);
+    do
+    {
+        job -> next = head;
+    } while (!m_head.compare_exchange_weak(head, job, std::memory_order_release, std::memory_order_relaxed));
+}
+
+
+void ResolverPool::Queue::Wake()
+{
+    if (m_wakeup)
+    {
+        m_wakeup -> Wake();
+    }
+}
+
+
+ResolverPool::Job *ResolverPool::Queue::Take()
+{
+    Job *job = m_head.exchange(NULL, std::memory_order_acquire);
+    // pushed newest first
+    Job *prev = NULL;
+    while (job)
+    {
+        Job *next = job -> next;
+        job -> next = prev;
+        prev = job;
+        job = next;
+    }
+    return prev;
+}
+
+
+ResolverPool::ResolverPool()
+    : WorkerPool(RESOLVER_THREADS)
+    , m_lookups(0)
+{
+}
+
+
+ResolverPool::~ResolverPool()
+{
+    Stop();
+    for (auto job : m_queue)
+    {
+        delete job;
+    }
+}
+
+
+ResolverPool& ResolverPool::Instance()
+{
+    static ResolverPool pool;
+    return pool;
+}
+
+
+void ResolverPool::Post(Job *job)
+{
+    {
+        Lock lock(m_mutex);
+        StartWorkers();
+        m_queue.push_back(job);
+    }
+    Signal();
+}
+
+
+uint64_t ResolverPool::Lookups() const
+{
+    return m_lookups;
+}
+
+
+std::string ResolverPool::CacheKey(const Job *job)
+{
+    switch (job -> query)
+    {
+    case QUERY_A:
+        return "A " + job -> host;
+    case QUERY_AAAA:
+        return "AAAA " + job -> host;
+    case QUERY_PTR:
+        return "PTR " + std::string(reinterpret_cast<const char *>(&job -> a), sizeof(job -> a));
+    case QUERY_PTR6:
+#ifdef ENABLE_IPV6
+        return "PTR6 " + std::string(reinterpret_cast<const char *>(&job -> a6), sizeof(job -> a6));
+#endif
+        break;
+    case QUERY_SRV:
+        return "SRV " + job -> host;
+    }
+    return "";
+}
+
+
+void ResolverPool::Lookup(Job *job)
+{
+    std::string key = CacheKey(job);
+    {
+        Lock lock(m_cache_mutex);
+        auto it = m_cache.find(key);
+        if (it != m_cache.end() && time(NULL) - it -> second.time < (it -> second.ok ? RESOLVER_CACHE_TTL : RESOLVER_CACHE_RETRY))
+        {
+            job -> ok = it -> second.ok;
+            job -> a = it -> second.a;
+#ifdef ENABLE_IPV6
+            job -> a6 = it -> second.a6;
+#endif
+            job -> name = it -> second.name;
+            return;
+        }
+    }
+    ++m_lookups;
+    job -> ok = false;
+    switch (job -> query)
+    {
+    case QUERY_A:
+        {
+            struct sockaddr_in sa;
+            if (Utility::u2ip(job -> host, sa))
+            {
+                memcpy(&job -> a, &sa.sin_addr, sizeof(job -> a));
+                job -> ok = true;
+            }
+        }
+        break;
+    case QUERY_PTR:
+        {
+            struct sockaddr_in sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sin_family = AF_INET;
+            memcpy(&sa.sin_addr, &job -> a, sizeof(job -> a));
+            job -> ok = Utility::reverse((struct sockaddr *)&sa, sizeof(sa), job -> name);
+        }
+        break;
+#ifdef ENABLE_IPV6
+#ifdef IPPROTO_IPV6
+    case QUERY_AAAA:
+        {
+            struct sockaddr_in6 sa;
+            if (Utility::u2ip(job -> host, sa))
+            {
+                job -> a6 = sa.sin6_addr;
+                job -> ok = true;
+            }
+        }
+        break;
+    case QUERY_PTR6:
+        {
+            struct sockaddr_in6 sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sin6_family = AF_INET6;
+            sa.sin6_addr = job -> a6;
+            job -> ok = Utility::reverse((struct sockaddr *)&sa, sizeof(sa), job -> name);
+        }
+        break;
+#endif
+#endif
+    default:
+        break;
+    }
+    Result r;
+    r.ok = job -> ok;
+    r.a = job -> a;
+#ifdef ENABLE_IPV6
+    r.a6 = job -> a6;
+#endif
+    r.name = job -> name;
+    r.time = time(NULL);
+    Lock lock(m_cache_mutex);
+    while (!m_cache.empty() && m_cache.size() >= RESOLVER_CACHE_MAX && m_cache.find(key) == m_cache.end())
+    {
+        m_cache.erase(m_cache.begin());
+    }
+    m_cache[key] = r;
+}
+
+
+void ResolverPool::Work()
+{
+    Job *job = NULL;
+    {
+        Lock lock(m_mutex);
+        if (m_queue.empty())
+        {
+            return;
+        }
+        job = m_queue.front();
+        m_queue.pop_front();
+    }
+    // Complete gives up the job and its queue
+    std::shared_ptr<Queue> queue = job -> queue;
+    Lookup(job);
+    Complete(job);
+    queue -> Wake();
+}
+
+
+void ResolverPool::Complete(Job *job)
+{
+    // the queue is deleted here if its sockethandler is gone
+    std::shared_ptr<Queue> queue;
+    queue.swap(job -> queue);
+    queue -> Push(job);
+}
+
+
+}//namespace dai
+
+#endif // ENABLE_RESOLVER
@@ -0,0 +1,89 @@
+#include "RetryPolicy.h"
+#include "Utility.h"
+
+namespace dai {
+
+RetryPolicy::RetryPolicy()
+    : m_b_enabled(false)
+    , m_base(0)
+    , m_multiplier(1)
+    , m_cap(0)
+    , m_max_attempts(0)
+    , m_b_jitter(false)
+{
+}
+
+
+RetryPolicy::RetryPolicy(long base_usec, double multiplier, long cap_usec, int max_attempts, bool jitter)
+    : m_b_enabled(true)
+    , m_base(base_usec)
+    , m_multiplier(multiplier < 1 ? 1 : multiplier)
+    , m_cap(cap_usec < base_usec ? base_usec : cap_usec)
+    , m_max_attempts(max_attempts)
+    , m_b_jitter(jitter)
+{
+}
+
+
+long RetryPolicy::BaseDelay() const
+{
+    return m_base;
+}
+
+
+double RetryPolicy::Multiplier() const
+{
+    return m_multiplier;
+}
+
+
+long RetryPolicy::MaxDelay() const
+{
+    return m_cap;
+}
+
+
+int RetryPolicy::MaxAttempts() const
+{
+    return m_max_attempts;
+}
+
+
+bool RetryPolicy::Jitter() const
+{
+    return m_b_jitter;
+}
+
+
+bool RetryPolicy::Enabled() const
+{
+    return m_b_enabled;
+}
+
+
+bool RetryPolicy::Retry(int n) const
+{
+    return m_b_enabled && (m_max_attempts == -1 || n < m_max_attempts);
+}
+
+
+long RetryPolicy::Delay(int n) const
+{
+    double d = (double)m_base;
+    for (int i = 0; i < n && d < (double)m_cap; ++i)
+    {
+        d *= m_multiplier;
+    }
+    if (d > (double)m_cap)
+    {
+        d = (double)m_cap;
+    }
+    if (m_b_jitter)
+    {
+        // random 32 bit value scaled to 0 .. d
+        d = d * (double)(Utility::Rnd() & 0xffffffffUL) / 4294967295.0;
+    }
+    return (long)d;
+}
+
+}//namespace dai
@@ -0,0 +1,161 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "SSLHandshakePool.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <algorithm>
+#include <openssl/err.h>
+
+#include "ISocketHandler.h"
+#include "Lock.h"
+#include "Socket.h"
+#include "Utility.h"
+#include "Wakeup.h"
+
+namespace dai {
+
+
+SSLHandshakePool::SSLHandshakePool()
+    : WorkerPool(SSL_HANDSHAKE_THREADS)
+    , m_handshakes(0)
+{
+}
+
+
+SSLHandshakePool::~SSLHandshakePool()
+{
+    Stop();
+}
+
+
+SSLHandshakePool& SSLHandshakePool::Instance()
+{
+    static SSLHandshakePool pool;
+    return pool;
+}
+
+
+void SSLHandshakePool::Post(ISocketHandler& h, Socket *p, SSL *ssl, bool server)
+{
+    std::shared_ptr<Wakeup> wakeup = h.GetWakeup();
+    {
+        Lock lock(m_mutex);
+        StartWorkers();
+        Job job;
+        job.handler = &h;
+        job.socket = p;
+        job.uid = p -> UniqueIdentifier();
+        job.ssl = ssl;
+        job.server = server;
+        job.result = 0;
+        job.error = SSL_ERROR_NONE;
+        m_queue.push_back(job);
+        Queue& q = m_handlers[&h];
+        q.pending++;
+        q.wakeup = wakeup;
+    }
+    Signal();
+}
+
+
+bool SSLHandshakePool::Collect(ISocketHandler& h, std::vector<Job>& jobs)
+{
+    Lock lock(m_mutex);
+    auto it = m_handlers.find(&h);
+    if (it == m_handlers.end())
+    {
+        return false;
+    }
+    Queue& q = it -> second;
+    q.pending -= q.done.size();
+    jobs.insert(jobs.end(), q.done.begin(), q.done.end());
+    q.done.clear();
+    if (!q.pending)
+    {
+        m_handlers.erase(it);
+        return false;
+    }
+    return true;
+}
+
+
+void SSLHandshakePool::Cancel(SSL *ssl)
+{
+    Lock lock(m_mutex);
+    for (auto it = m_queue.begin(); it != m_queue.end(); ++it)
+    {
+        if (it -> ssl == ssl)
+        {
+            m_handlers[it -> handler].pending--;
+            m_queue.erase(it);
+            return;
+        }
+    }
+    // a running step is not interrupted, it ends at the next WANT_READ / WANT_WRITE
+    while (std::find(m_running.begin(), m_running.end(), ssl) != m_running.end())
+    {
+        m_mutex.Unlock();
+        Utility::Sleep(1);
+        m_mutex.Lock();
+    }
+    for (auto& h : m_handlers)
+    {
+        Queue& q = h.second;
+        for (auto it = q.done.begin(); it != q.done.end(); ++it)
+        {
+            if (it -> ssl == ssl)
+            {
+                q.pending--;
+                q.done.erase(it);
+                return;
+            }
+        }
+    }
+}
+
+
+uint64_t SSLHandshakePool::Handshakes() const
+{
+    return m_handshakes;
+}
+
+
+void SSLHandshakePool::Work()
+{
+    Job job;
+    {
+        Lock lock(m_mutex);
+        if (m_queue.empty())
+        {
+            return; // cancelled
+        }
+        job = m_queue.front();
+        m_queue.pop_front();
+        m_running.push_back(job.ssl);
+    }
+    job.result = job.server ? SSL_accept(job.ssl) : SSL_connect(job.ssl);
+    // the error queue is per thread, SSL_get_error must be called here
+    job.error = job.result > 0 ? SSL_ERROR_NONE : SSL_get_error(job.ssl, job.result);
+    ERR_clear_error();
+    ++m_handshakes;
+    std::shared_ptr<Wakeup> wakeup;
+    {
+        Lock lock(m_mutex);
+        m_running.erase(std::find(m_running.begin(), m_running.end(), job.ssl));
+        Queue& q = m_handlers[job.handler];
+        q.done.push_back(job);
+        wakeup = q.wakeup;
+    }
+    wakeup -> Wake();
+}
+
+
+}//namespace dai
+
+#endif // HAVE_OPENSSL
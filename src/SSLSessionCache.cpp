@@ -0,0 +1,354 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "SSLSessionCache.h"
+
+#ifdef HAVE_OPENSSL
+
+#include <cstring>
+#include <functional>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#   include <openssl/core_names.h>
+#   include <openssl/params.h>
+#endif
+
+#include "Lock.h"
+
+namespace dai {
+
+// defaults
+#define SSL_SESSION_CACHE_CAPACITY 20000
+#define SSL_TICKET_KEY_LIFETIME    3600
+
+
+SSLSessionCache::SSLSessionCache()
+    : m_capacity(SSL_SESSION_CACHE_CAPACITY)
+    , m_ticket_lifetime(SSL_TICKET_KEY_LIFETIME)
+    , m_ex_index(SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL))
+    , m_ctx_index(SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL))
+    , m_server_handshakes(0)
+    , m_server_resumed(0)
+    , m_client_handshakes(0)
+    , m_client_resumed(0)
+{
+}
+
+
+SSLSessionCache::~SSLSessionCache()
+{
+    for (int i = 0; i < SHARDS; i++)
+    {
+        for (auto& it : m_server[i].sessions)
+            SSL_SESSION_free(it.second);
+        for (auto& it : m_client[i].sessions)
+            SSL_SESSION_free(it.second);
+    }
+}
+
+
+SSLSessionCache& SSLSessionCache::Instance()
+{
+    static SSLSessionCache cache;
+    return cache;
+}
+
+
+void SSLSessionCache::SetCapacity(size_t n)
+{
+    m_capacity = n;
+}
+
+
+size_t SSLSessionCache::Capacity() const
+{
+    return m_capacity;
+}
+
+
+void SSLSessionCache::SetTicketKeyLifetime(long sec)
+{
+    m_ticket_lifetime = sec;
+}
+
+
+long SSLSessionCache::TicketKeyLifetime() const
+{
+    return m_ticket_lifetime;
+}
+
+
+void SSLSessionCache::InitServerContext(SSL_CTX *ctx)
+{
+    // the internal cache is one list behind one lock per context
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, NewServerSession);
+    SSL_CTX_sess_set_get_cb(ctx, GetServerSession);
+    SSL_CTX_sess_set_remove_cb(ctx, RemoveServerSession);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TicketKey);
+#endif
+}
+
+
+void SSLSessionCache::InitClientContext(SSL_CTX *ctx, const std::string *name)
+{
+    SSL_CTX_set_ex_data(ctx, m_ctx_index, const_cast<std::string *>(name));
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, NewClientSession);
+}
+
+
+void SSLSessionCache::Attach(SSL *ssl, const std::string *key)
+{
+    SSL_set_ex_data(ssl, m_ex_index, const_cast<std::string *>(key));
+    if (key -> empty())
+    {
+        return;
+    }
+    std::string id = ClientId(ssl, *key);
+    Shard& shard = GetShard(m_client, id);
+    Lock lock(shard.mutex);
+    auto it = shard.sessions.find(id);
+    if (it == shard.sessions.end())
+    {
+        return;
+    }
+    SSL_SESSION *sess = it -> second;
+    SSL_set_session(ssl, sess);
+    if (SSL_SESSION_get_protocol_version(sess) >= TLS1_3_VERSION)
+    {
+        // a tls 1.3 ticket is used once, ssl now holds the only reference
+        SSL_SESSION_free(sess);
+        shard.sessions.erase(it);
+    }
+}
+
+
+void SSLSessionCache::SetKey(SSL *ssl, const std::string *key)
+{
+    SSL_set_ex_data(ssl, m_ex_index, const_cast<std::string *>(key));
+}
+
+
+void SSLSessionCache::Handshake(SSL *ssl, bool server)
+{
+    bool reused = SSL_session_reused(ssl) != 0;
+    if (server)
+    {
+        ++m_server_handshakes;
+        if (reused)
+            ++m_server_resumed;
+    }
+    else
+    {
+        ++m_client_handshakes;
+        if (reused)
+            ++m_client_resumed;
+    }
+}
+
+
+uint64_t SSLSessionCache::ServerHandshakes() const
+{
+    return m_server_handshakes;
+}
+
+
+uint64_t SSLSessionCache::ServerResumed() const
+{
+    return m_server_resumed;
+}
+
+
+uint64_t SSLSessionCache::ClientHandshakes() const
+{
+    return m_client_handshakes;
+}
+
+
+uint64_t SSLSessionCache::ClientResumed() const
+{
+    return m_client_resumed;
+}
+
+
+std::string SSLSessionCache::ClientId(SSL *ssl, const std::string& key)
+{
+    const std::string *name = static_cast<const std::string *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), m_ctx_index));
+    return (name ? *name : std::string()) + "|" + key;
+}
+
+
+SSLSessionCache::Shard& SSLSessionCache::GetShard(Shard *shards, const std::string& id)
+{
+    return shards[std::hash<std::string>()(id) % SHARDS];
+}
+
+
+void SSLSessionCache::Store(Shard *shards, const std::string& id, SSL_SESSION *sess)
+{
+    Shard& shard = GetShard(shards, id);
+    size_t max = m_capacity / SHARDS;
+    Lock lock(shard.mutex);
+    auto it = shard.sessions.find(id);
+    if (it != shard.sessions.end())
+    {
+        SSL_SESSION_free(it -> second);
+        it -> second = sess;
+        return;
+    }
+    // id's are random, dropping the first one is dropping an arbitrary one
+    while (!shard.sessions.empty() && shard.sessions.size() >= (max ? max : 1))
+    {
+        SSL_SESSION_free(shard.sessions.begin() -> second);
+        shard.sessions.erase(shard.sessions.begin());
+    }
+    shard.sessions[id] = sess;
+}
+
+
+void SSLSessionCache::Erase(Shard *shards, const std::string& id)
+{
+    Shard& shard = GetShard(shards, id);
+    Lock lock(shard.mutex);
+    auto it = shard.sessions.find(id);
+    if (it != shard.sessions.end())
+    {
+        SSL_SESSION_free(it -> second);
+        shard.sessions.erase(it);
+    }
+}
+
+
+std::shared_ptr<const SSLSessionCache::TicketKeys> SSLSessionCache::GetTicketKeys()
+{
+    std::shared_ptr<const TicketKeys> keys = std::atomic_load(&m_ticket_keys);
+    time_t now = time(nullptr);
+    if (!keys || now - keys -> created >= m_ticket_lifetime)
+    {
+        std::shared_ptr<TicketKeys> next(new TicketKeys);
+        RAND_bytes(reinterpret_cast<unsigned char *>(&next -> current), sizeof(next -> current));
+        next -> has_previous = keys != nullptr;
+        if (keys)
+            next -> previous = keys -> current;
+        next -> created = now;
+        std::shared_ptr<const TicketKeys> tmp = next;
+        // another thread may have rotated first, then use its keys
+        if (std::atomic_compare_exchange_strong(&m_ticket_keys, &keys, tmp))
+            keys = tmp;
+    }
+    return keys;
+}
+
+
+int SSLSessionCache::NewServerSession(SSL *, SSL_SESSION *sess)
+{
+    unsigned int len = 0;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &len);
+    Instance().Store(Instance().m_server, std::string(reinterpret_cast<const char *>(id), len), sess);
+    return 1; // the cache keeps the reference
+}
+
+
+SSL_SESSION *SSLSessionCache::GetServerSession(SSL *, const unsigned char *id, int len, int *copy)
+{
+    SSLSessionCache& cache = Instance();
+    std::string key(reinterpret_cast<const char *>(id), len);
+    Shard& shard = cache.GetShard(cache.m_server, key);
+    Lock lock(shard.mutex);
+    *copy = 0;
+    auto it = shard.sessions.find(key);
+    if (it == shard.sessions.end())
+    {
+        return NULL;
+    }
+    SSL_SESSION *sess = it -> second;
+    if (SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) < time(nullptr))
+    {
+        SSL_SESSION_free(sess);
+        shard.sessions.erase(it);
+        return NULL;
+    }
+    // reference for the caller, taken under the shard lock
+    SSL_SESSION_up_ref(sess);
+    return sess;
+}
+
+
+void SSLSessionCache::RemoveServerSession(SSL_CTX *, SSL_SESSION *sess)
+{
+    unsigned int len = 0;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &len);
+    Instance().Erase(Instance().m_server, std::string(reinterpret_cast<const char *>(id), len));
+}
+
+
+int SSLSessionCache::NewClientSession(SSL *ssl, SSL_SESSION *sess)
+{
+    SSLSessionCache& cache = Instance();
+    const std::string *key = static_cast<const std::string *>(SSL_get_ex_data(ssl, cache.m_ex_index));
+    if (!key || key -> empty())
+    {
+        return 0;
+    }
+    cache.Store(cache.m_client, cache.ClientId(ssl, *key), sess);
+    return 1;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int SSLSessionCache::TicketKey(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+    std::shared_ptr<const TicketKeys> keys = Instance().GetTicketKeys();
+    const TicketKeys::Key *key = NULL;
+    int r = 1;
+    if (enc)
+    {
+        key = &keys -> current;
+        memcpy(name, key -> name, sizeof(key -> name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+        {
+            return -1;
+        }
+    }
+    else if (!memcmp(name, keys -> current.name, sizeof(keys -> current.name)))
+    {
+        key = &keys -> current;
+        if (SSL_version(ssl) >= TLS1_3_VERSION)
+        {
+            r = 2; // tls 1.3 clients use a ticket once, always issue a new one
+        }
+    }
+    else if (keys -> has_previous && !memcmp(name, keys -> previous.name, sizeof(keys -> previous.name)))
+    {
+        key = &keys -> previous;
+        r = 2; // valid, issue a new ticket with the current key
+    }
+    else
+    {
+        return 0; // unknown key, full handshake
+    }
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(key -> hmac), sizeof(key -> hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (!EVP_MAC_CTX_set_params(hctx, params))
+    {
+        return -1;
+    }
+    int ok = enc ? EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key -> aes, iv)
+                 : EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key -> aes, iv);
+    return ok ? r : -1;
+}
+#endif
+
+
+}//namespace dai
+
+#endif // HAVE_OPENSSL
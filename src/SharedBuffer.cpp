@@ -0,0 +1,51 @@
+#include "SharedBuffer.h"
+
+namespace dai {
+
+SharedBuffer::SharedBuffer()
+{
+}
+
+
+SharedBuffer::SharedBuffer(const char *buf, size_t len)
+    : m_data(std::make_shared<const std::string>(buf, len))
+{
+}
+
+
+SharedBuffer::SharedBuffer(const std::string& str)
+    : m_data(std::make_shared<const std::string>(str))
+{
+}
+
+
+SharedBuffer::SharedBuffer(std::string&& str)
+    : m_data(std::make_shared<const std::string>(std::move(str)))
+{
+}
+
+
+const char *SharedBuffer::Data() const
+{
+    return m_data ? m_data -> data() : nullptr;
+}
+
+
+size_t SharedBuffer::Len() const
+{
+    return m_data ? m_data -> size() : 0;
+}
+
+
+bool SharedBuffer::Empty() const
+{
+    return !Len();
+}
+
+
+long SharedBuffer::UseCount() const
+{
+    return m_data.use_count();
+}
+
+}//namespace dai
@@ -54,6 +54,7 @@ Socket::Socket(ISocketHandler& h):
     m_client_remote_address(nullptr),
     m_remote_address(nullptr),
     m_traffic_monitor(nullptr),
+    m_traffic_capture(nullptr),
     m_timeout_start(0),
     m_timeout_limit(0),
     m_bLost(false),
@@ -143,6 +144,11 @@ int Socket::Close()
     }
     int n;
     Handler().ISocketHandler_Del(this); // remove from fd_set's
+    if (m_capture_flow)
+    {
+        m_traffic_capture -> Closed(*m_capture_flow);
+        *m_capture_flow = TrafficCapture::Flow(m_uid);
+    }
     if ((n = closesocket(m_socket)) == -1)
     {
         // failed...
@@ -410,6 +416,45 @@ Socket *Socket::GetParent()
 void Socket::SetParent(Socket *x)
 {
     m_parent = x;
+    if (x)
+    {
+        if (x -> m_input_limit.Enabled())
+            m_input_limit.SetRate(x -> m_input_limit.Rate(), x -> m_input_limit.Burst());
+        if (x -> m_output_limit.Enabled())
+            m_output_limit.SetRate(x -> m_output_limit.Rate(), x -> m_output_limit.Burst());
+        if (x -> m_traffic_capture)
+            SetTrafficCapture(x -> m_traffic_capture);
+    }
+}
+
+
+void Socket::SetTrafficCapture(TrafficCapture *p)
+{
+    m_traffic_capture = p;
+    m_capture_flow = p ? p -> Sample(m_uid) : nullptr;
+}
+
+
+void Socket::CaptureTraffic(bool out, const char *buf, size_t caplen, size_t len)
+{
+    TrafficCapture::Flow *f = m_capture_flow.get();
+    if (!f || (!f -> ready && !f -> SetEndpoints(m_socket)))
+    {
+        return;
+    }
+    m_traffic_capture -> Capture(*f, out, buf, caplen, len);
+}
+
+
+void Socket::SetInputRateLimit(uint64_t bytes_per_sec, uint64_t burst)
+{
+    m_input_limit.SetRate(bytes_per_sec, burst);
+}
+
+
+void Socket::SetOutputRateLimit(uint64_t bytes_per_sec, uint64_t burst)
+{
+    m_output_limit.SetRate(bytes_per_sec, burst);
 }
 
 port_t Socket::GetPort()
@@ -807,6 +852,11 @@ int Socket::Resolve6(const std::string& host, port_t port)
 }
 #endif
 
+int Socket::ResolveSrv(const std::string& name)
+{
+    return Handler().ResolveSrv(this, name);
+}
+
 int Socket::Resolve(ipaddr_t a)
 {
     return Handler().Resolve(this, a);
@@ -836,6 +886,10 @@ void Socket::OnReverseResolved(int, const std::string&)
 void Socket::OnResolveFailed(int)
 {
 }
+
+void Socket::OnResolvedSrv(int, const std::vector<SrvRecord>&)
+{
+}
 #endif // ENABLE_RESOLVER
 
 
@@ -1195,6 +1249,23 @@ bool Socket::SetSoReuseaddr(bool x)
 }
 
 
+bool Socket::SetSoReuseport(bool x)
+{
+#ifdef SO_REUSEPORT
+    int optval = x ? 1 : 0;
+    if (setsockopt(GetSocket(), SOL_SOCKET, SO_REUSEPORT, (char *)&optval, sizeof(optval)) == -1)
+    {
+        Handler().LogError(this, "setsockopt(SOL_SOCKET, SO_REUSEPORT)", Errno, StrError(Errno), LOG_LEVEL_FATAL);
+        return false;
+    }
+    return true;
+#else
+    Handler().LogError(this, "socket option not available", 0, "SO_REUSEPORT", LOG_LEVEL_INFO);
+    return false;
+#endif
+}
+
+
 bool Socket::SetSoKeepalive(bool x)
 {
 #ifdef SO_KEEPALIVE
@@ -1626,6 +1697,16 @@ void Socket::OnConnectTimeout()
 }
 
 
+void Socket::OnTimer(int)
+{
+}
+
+
+void Socket::OnInternalTimer(int)
+{
+}
+
+
 bool Socket::Timeout(time_t tnow)
 {
     if (m_timeout_start > 0 && tnow - m_timeout_start > m_timeout_limit)
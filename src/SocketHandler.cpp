@@ -7,11 +7,10 @@
 #include <cstdlib>
 #include <cerrno>
 #include <cstdio>
+#include <climits>
 
 #include "SocketHandler.h"
 #include "UdpSocket.h"
-#include "ResolvSocket.h"
-#include "ResolvServer.h"
 #include "TcpSocket.h"
 #include "IMutex.h"
 #include "Utility.h"
@@ -19,6 +18,11 @@
 #include "Exception.h"
 #include "SocketHandlerThread.h"
 #include "Lock.h"
+#include "SSLHandshakePool.h"
+#include "DestinationCache.h"
+#include "PacketPool.h"
+#include "DnsClient.h"
+#include "Wakeup.h"
 
 namespace dai {
 
@@ -43,6 +47,9 @@ SocketHandler::SocketHandler(StdLog *p)
     , m_b_check_timeout(false)
     , m_b_check_retry(false)
     , m_b_check_close(false)
+    , m_b_check_ssl_handshake(false)
+    , m_tcpinfo_budget(TCP_INFO_BUDGET)
+    , m_destinations(NULL)
 #ifdef ENABLE_SOCKS4
     , m_socks4_host(0)
     , m_socks4_port(0)
@@ -50,10 +57,18 @@ SocketHandler::SocketHandler(StdLog *p)
 #endif
 #ifdef ENABLE_RESOLVER
     , m_resolv_id(0)
-    , m_resolver(NULL)
+    , m_resolve_pending(0)
+    , m_dns(NULL)
+    , m_b_dns(false)
 #endif
 #ifdef ENABLE_POOL
     , m_b_enable_pool(false)
+    , m_pool_max_idle(POOL_MAX_IDLE)
+    , m_pool_max_total(POOL_MAX_TOTAL)
+    , m_pool_idle_timeout(POOL_IDLE_TIMEOUT)
+    , m_pool_hits(0)
+    , m_pool_misses(0)
+    , m_pool_evictions(0)
 #endif
 #ifdef ENABLE_DETACH
     , m_slave(false)
@@ -79,6 +94,9 @@ SocketHandler::SocketHandler(IMutex& mutex, StdLog *p)
     , m_b_check_timeout(false)
     , m_b_check_retry(false)
     , m_b_check_close(false)
+    , m_b_check_ssl_handshake(false)
+    , m_tcpinfo_budget(TCP_INFO_BUDGET)
+    , m_destinations(NULL)
 #ifdef ENABLE_SOCKS4
     , m_socks4_host(0)
     , m_socks4_port(0)
@@ -86,10 +104,18 @@ SocketHandler::SocketHandler(IMutex& mutex, StdLog *p)
 #endif
 #ifdef ENABLE_RESOLVER
     , m_resolv_id(0)
-    , m_resolver(NULL)
+    , m_resolve_pending(0)
+    , m_dns(NULL)
+    , m_b_dns(false)
 #endif
 #ifdef ENABLE_POOL
     , m_b_enable_pool(false)
+    , m_pool_max_idle(POOL_MAX_IDLE)
+    , m_pool_max_total(POOL_MAX_TOTAL)
+    , m_pool_idle_timeout(POOL_IDLE_TIMEOUT)
+    , m_pool_hits(0)
+    , m_pool_misses(0)
+    , m_pool_evictions(0)
 #endif
 #ifdef ENABLE_DETACH
     , m_slave(false)
@@ -115,6 +141,9 @@ SocketHandler::SocketHandler(IMutex& mutex, ISocketHandler& parent, StdLog *p)
     , m_b_check_timeout(false)
     , m_b_check_retry(false)
     , m_b_check_close(false)
+    , m_b_check_ssl_handshake(false)
+    , m_tcpinfo_budget(TCP_INFO_BUDGET)
+    , m_destinations(NULL)
 #ifdef ENABLE_SOCKS4
     , m_socks4_host(0)
     , m_socks4_port(0)
@@ -122,10 +151,18 @@ SocketHandler::SocketHandler(IMutex& mutex, ISocketHandler& parent, StdLog *p)
 #endif
 #ifdef ENABLE_RESOLVER
     , m_resolv_id(0)
-    , m_resolver(NULL)
+    , m_resolve_pending(0)
+    , m_dns(NULL)
+    , m_b_dns(false)
 #endif
 #ifdef ENABLE_POOL
     , m_b_enable_pool(false)
+    , m_pool_max_idle(POOL_MAX_IDLE)
+    , m_pool_max_total(POOL_MAX_TOTAL)
+    , m_pool_idle_timeout(POOL_IDLE_TIMEOUT)
+    , m_pool_hits(0)
+    , m_pool_misses(0)
+    , m_pool_evictions(0)
 #endif
 #ifdef ENABLE_DETACH
     , m_slave(false)
@@ -139,17 +176,16 @@ SocketHandler::SocketHandler(IMutex& mutex, ISocketHandler& parent, StdLog *p)
 
 SocketHandler::~SocketHandler()
 {
+    if (m_wakeup)
+    {
+        // workers may still finish jobs of this handler
+        m_wakeup -> Close();
+    }
     for (std::list<SocketHandlerThread *>::iterator it = m_threads.begin(); it != m_threads.end(); ++it)
     {
         SocketHandlerThread *p = *it;
         p -> Stop();
     }
-#ifdef ENABLE_RESOLVER
-    if (m_resolver)
-    {
-        m_resolver -> Quit();
-    }
-#endif
     {
         while (m_sockets.size())
         {
@@ -187,13 +223,17 @@ SocketHandler::~SocketHandler()
         }
         DEB(fprintf(stderr, "/Emptying sockets list in SocketHandler destructor, %d instances\n", (int)m_sockets.size());)
     }
-
+    delete m_destinations;
+    m_destinations = NULL;
 #ifdef ENABLE_RESOLVER
-    if (m_resolver)
+    // after its query sockets, unanswered lookups fail
+    delete m_dns;
+#endif
+    for (auto& it : m_packet_pools)
     {
-        delete m_resolver;
+        // deleted when the last packet is released
+        it.second -> Close();
     }
-#endif
 
     if (m_b_use_mutex)
     {
@@ -278,6 +318,23 @@ bool SocketHandler::IsThreaded()
 }
 
 
+size_t SocketHandler::NumberOfThreads()
+{
+    return m_threads.size();
+}
+
+
+ISocketHandler& SocketHandler::GetThreadHandler(size_t i)
+{
+    for (auto thr : m_threads)
+    {
+        if (!i--)
+            return thr -> Handler();
+    }
+    throw Exception("No such sockethandler thread");
+}
+
+
 void SocketHandler::EnableRelease()
 {
     if (m_release)
@@ -294,7 +351,19 @@ void SocketHandler::Release()
 {
     if (!m_release)
         return;
-    m_release -> SendTo("127.0.0.1", m_release -> GetPort(), "\n");
+    // called from other threads, the destination cache is not used here
+    m_release -> SendTo(htonl(INADDR_LOOPBACK), m_release -> GetPort(), "\n");
+}
+
+
+std::shared_ptr<Wakeup> SocketHandler::GetWakeup()
+{
+    if (!m_wakeup)
+    {
+        EnableRelease();
+        m_wakeup = std::make_shared<Wakeup>(m_release -> GetPort());
+    }
+    return m_wakeup;
 }
 
 
@@ -354,6 +423,11 @@ void SocketHandler::ISocketHandler_Mod(Socket *p, bool bRead, bool bWrite)
 void SocketHandler::ISocketHandler_Del(Socket *p)
 {
     Set(p, false, false);
+    // the descriptor may be closed next, or handed to another socket
+    if (p -> GetSocket() >= 0)
+    {
+        FD_CLR(p -> GetSocket(), &m_efds);
+    }
 }
 
 
@@ -464,95 +538,165 @@ void SocketHandler::SetSocks4Userid(const std::string& id)
 
 
 #ifdef ENABLE_RESOLVER
-int SocketHandler::Resolve(Socket *p, const std::string& host, port_t port)
+int SocketHandler::Resolve(Socket *p, ResolverPool::Job *job)
 {
-    // check cache
-    ResolvSocket *resolv = new ResolvSocket(*this, p, host, port);
-    resolv -> SetId(++m_resolv_id);
-    resolv -> SetDeleteByHandler();
-    ipaddr_t local;
-    Utility::u2ip("127.0.0.1", local);
-    if (!resolv -> Open(local, m_resolver_port))
+    if (!m_resolver)
+    {
+        LogError(p, "Resolve", -1, "Resolver not enabled, enabling", LOG_LEVEL_WARNING);
+        EnableResolver();
+    }
+    job -> next = NULL;
+    job -> queue = m_resolver;
+    job -> socket = p;
+    job -> uid = p -> UniqueIdentifier();
+    job -> id = ++m_resolv_id;
+    job -> ok = false;
+    int id = job -> id;
+    // the DnsClient may complete the job at once
+    if (!m_b_dns && job -> query != ResolverPool::QUERY_SRV)
+    {
+        ResolverPool::Instance().Post(job);
+    }
+    else
     {
-        LogError(resolv, "Resolve", -1, "Can't connect to local resolve server", LOG_LEVEL_FATAL);
+        GetDnsClient().Query(job);
     }
-    Add(resolv);
+    m_resolve_pending++;
     m_resolve_q[p -> UniqueIdentifier()] = true;
-    DEB( fprintf(stderr, " *** Resolve '%s:%d' id#%d  m_resolve_q size: %d  p: %p\n", host.c_str(), port, resolv -> GetId(), m_resolve_q.size(), p);)
-    return resolv -> GetId();
+    DEB( fprintf(stderr, " *** Resolve id#%d  m_resolve_q size: %d  p: %p\n", id, m_resolve_q.size(), p);)
+    return id;
+}
+
+
+int SocketHandler::Resolve(Socket *p, const std::string& host, port_t port)
+{
+    ResolverPool::Job *job = new ResolverPool::Job;
+    job -> query = ResolverPool::QUERY_A;
+    job -> host = host;
+    job -> port = port;
+    return Resolve(p, job);
 }
 
 
 #ifdef ENABLE_IPV6
 int SocketHandler::Resolve6(Socket *p, const std::string& host, port_t port)
 {
-    // check cache
-    ResolvSocket *resolv = new ResolvSocket(*this, p, host, port, true);
-    resolv -> SetId(++m_resolv_id);
-    resolv -> SetDeleteByHandler();
-    ipaddr_t local;
-    Utility::u2ip("127.0.0.1", local);
-    if (!resolv -> Open(local, m_resolver_port))
-    {
-        LogError(resolv, "Resolve", -1, "Can't connect to local resolve server", LOG_LEVEL_FATAL);
-    }
-    Add(resolv);
-    m_resolve_q[p -> UniqueIdentifier()] = true;
-    return resolv -> GetId();
+    ResolverPool::Job *job = new ResolverPool::Job;
+    job -> query = ResolverPool::QUERY_AAAA;
+    job -> host = host;
+    job -> port = port;
+    return Resolve(p, job);
 }
 #endif
 
 int SocketHandler::Resolve(Socket *p, ipaddr_t a)
 {
-    // check cache
-    ResolvSocket *resolv = new ResolvSocket(*this, p, a);
-    resolv -> SetId(++m_resolv_id);
-    resolv -> SetDeleteByHandler();
-    ipaddr_t local;
-    Utility::u2ip("127.0.0.1", local);
-    if (!resolv -> Open(local, m_resolver_port))
-    {
-        LogError(resolv, "Resolve", -1, "Can't connect to local resolve server", LOG_LEVEL_FATAL);
-    }
-    Add(resolv);
-    m_resolve_q[p -> UniqueIdentifier()] = true;
-    return resolv -> GetId();
+    ResolverPool::Job *job = new ResolverPool::Job;
+    job -> query = ResolverPool::QUERY_PTR;
+    job -> port = 0;
+    job -> a = a;
+    return Resolve(p, job);
 }
 
 
 #ifdef ENABLE_IPV6
 int SocketHandler::Resolve(Socket *p, in6_addr& a)
 {
-    // check cache
-    ResolvSocket *resolv = new ResolvSocket(*this, p, a);
-    resolv -> SetId(++m_resolv_id);
-    resolv -> SetDeleteByHandler();
-    ipaddr_t local;
-    Utility::u2ip("127.0.0.1", local);
-    if (!resolv -> Open(local, m_resolver_port))
-    {
-        LogError(resolv, "Resolve", -1, "Can't connect to local resolve server", LOG_LEVEL_FATAL);
-    }
-    Add(resolv);
-    m_resolve_q[p -> UniqueIdentifier()] = true;
-    return resolv -> GetId();
+    ResolverPool::Job *job = new ResolverPool::Job;
+    job -> query = ResolverPool::QUERY_PTR6;
+    job -> port = 0;
+    job -> a6 = a;
+    return Resolve(p, job);
 }
 #endif
 
 
+int SocketHandler::ResolveSrv(Socket *p, const std::string& name)
+{
+    ResolverPool::Job *job = new ResolverPool::Job;
+    job -> query = ResolverPool::QUERY_SRV;
+    job -> host = name;
+    job -> port = 0;
+    return Resolve(p, job);
+}
+
+
 void SocketHandler::EnableResolver(port_t port)
 {
     if (!m_resolver)
     {
         m_resolver_port = port;
-        m_resolver = new ResolvServer(port);
+        m_resolver = std::make_shared<ResolverPool::Queue>(GetWakeup());
     }
 }
 
 
 bool SocketHandler::ResolverReady()
 {
-    return m_resolver ? m_resolver -> Ready() : false;
+    return m_resolver ? true : false;
+}
+
+
+void SocketHandler::EnableDnsClient(bool x)
+{
+    EnableResolver();
+    m_b_dns = x;
+}
+
+
+bool SocketHandler::DnsClientEnabled()
+{
+    return m_b_dns;
+}
+
+
+DnsClient& SocketHandler::GetDnsClient()
+{
+    if (!m_dns)
+    {
+        m_dns = new DnsClient(*this);
+    }
+    return *m_dns;
+}
+
+
+void SocketHandler::CheckResolve()
+{
+    ResolverPool::Job *job = m_resolver -> Take();
+    while (job)
+    {
+        ResolverPool::Job *next = job -> next;
+        m_resolve_pending--;
+        // the socket is still in m_resolve_q unless it has been deleted
+        if (m_resolve_q.find(job -> uid) != m_resolve_q.end())
+        {
+            Socket *p = job -> socket;
+            if (!job -> ok)
+            {
+                p -> OnResolveFailed(job -> id);
+            }
+            else if (job -> query == ResolverPool::QUERY_A)
+            {
+                p -> OnResolved(job -> id, job -> a, job -> port);
+            }
+#ifdef ENABLE_IPV6
+            else if (job -> query == ResolverPool::QUERY_AAAA)
+            {
+                p -> OnResolved(job -> id, job -> a6, job -> port);
+            }
+#endif
+            else if (job -> query == ResolverPool::QUERY_SRV)
+            {
+                p -> OnResolvedSrv(job -> id, job -> srv);
+            }
+            else
+            {
+                p -> OnReverseResolved(job -> id, job -> name);
+            }
+        }
+        delete job;
+        job = next;
+    }
 }
 #endif // ENABLE_RESOLVER
 
@@ -597,28 +741,161 @@ port_t SocketHandler::GetResolverPort()
 }
 #endif // ENABLE_RESOLVER
 
+
+bool SocketHandler::GetDestination(const std::string& host, port_t port, bool ipv6, struct sockaddr_storage& sa, socklen_t& sa_len)
+{
+    if (!m_destinations)
+    {
+        m_destinations = new DestinationCache(*this);
+    }
+    return m_destinations -> Get(host, port, ipv6, sa, sa_len);
+}
+
+
+bool SocketHandler::QueueDestination(UdpSocket *p, const std::string& host, port_t port, bool ipv6, const char *data, int len, int flags)
+{
+    if (!m_destinations)
+    {
+        return false;
+    }
+    return m_destinations -> Queue(p, host, port, ipv6, data, len, flags);
+}
+
+
+void SocketHandler::SetDestinationTtl(long sec)
+{
+    if (!m_destinations)
+    {
+        m_destinations = new DestinationCache(*this);
+    }
+    m_destinations -> SetTtl(sec);
+}
+
+
+PacketPool& SocketHandler::GetPacketPool(size_t bufsz)
+{
+    PacketPool *& p = m_packet_pools[bufsz];
+    if (!p)
+    {
+        p = new PacketPool(bufsz);
+    }
+    return *p;
+}
+
 #ifdef ENABLE_POOL
-ISocketHandler::PoolSocket *SocketHandler::FindConnection(int type, const std::string& protocol, SocketAddress& ad)
+std::string SocketHandler::PoolKey(int type, const std::string& protocol, SocketAddress& ad, const std::string& identity)
 {
-    for (socket_m::iterator it = m_sockets.begin(); it != m_sockets.end() && m_sockets.size(); ++it)
+    return Utility::l2string(type) + "/" + protocol + "/" + ad.Convert(true) + "/" + identity;
+}
+
+
+bool SocketHandler::PoolErase(Socket *p)
+{
+    auto it = m_pool_index.find(p);
+    if (it == m_pool_index.end())
     {
-        PoolSocket *pools = dynamic_cast<PoolSocket *>(it -> second);
-        if (pools)
+        return false;
+    }
+    auto q = m_pool.find(it -> second);
+    if (q != m_pool.end())
+    {
+        q -> second.remove(static_cast<PoolSocket *>(p));
+        if (q -> second.empty())
         {
-            if (pools -> GetSocketType() == type &&
-                pools -> GetSocketProtocol() == protocol &&
-                // %! pools -> GetClientRemoteAddress() &&
-                *pools -> GetClientRemoteAddress() == ad)
-            {
-                m_sockets.erase(it);
-                pools -> SetRetain(); // avoid Close in Socket destructor
-                return pools; // Caller is responsible that this socket is deleted
-            }
+            m_pool.erase(q);
+        }
+    }
+    m_pool_index.erase(it);
+    return true;
+}
+
+
+ISocketHandler::PoolSocket *SocketHandler::FindConnection(int type, const std::string& protocol, SocketAddress& ad, const std::string& identity)
+{
+    auto it = m_pool.find(PoolKey(type, protocol, ad, identity));
+    while (it != m_pool.end())
+    {
+        PoolSocket *pools = it -> second.back(); // most recently used
+        PoolErase(pools); // it is invalid now if that was the last one
+        // liveness; a hibernating connection has nothing to read
+        char c;
+        int n = pools -> CloseAndDelete() ? 0 : recv(pools -> GetSocket(), &c, 1, MSG_PEEK);
+#ifdef _WIN32
+        if (n == -1 && Errno == WSAEWOULDBLOCK)
+#else
+        if (n == -1 && Errno == EWOULDBLOCK)
+#endif
+        {
+            ISocketHandler_Del(pools);
+            m_sockets.erase(pools -> GetSocket());
+            RemoveTimer(pools);
+            pools -> SetRetain(); // avoid Close in Socket destructor
+            m_pool_hits++;
+            return pools; // Caller is responsible that this socket is deleted
         }
+        // closed by peer, or unexpected data
+        pools -> SetCloseAndDelete();
+        m_pool_evictions++;
+        it = m_pool.find(PoolKey(type, protocol, ad, identity));
     }
+    m_pool_misses++;
     return NULL;
 }
 
+
+bool SocketHandler::AddConnection(Socket *p)
+{
+    std::unique_ptr<SocketAddress> ad = p -> GetClientRemoteAddress();
+    if (!ad.get())
+    {
+        return false;
+    }
+    std::string identity;
+#ifdef HAVE_OPENSSL
+    TcpSocket *tcp = dynamic_cast<TcpSocket *>(p);
+    if (p -> IsSSL())
+    {
+        if (!tcp || p -> IsSSLNegotiate())
+        {
+            return false;
+        }
+        identity = tcp -> GetPoolIdentity();
+    }
+#endif
+    std::string key = PoolKey(p -> GetSocketType(), p -> GetSocketProtocol(), *ad, identity);
+    auto it = m_pool.find(key);
+    if (it != m_pool.end() && it -> second.size() >= m_pool_max_idle)
+    {
+        // least recently used of this destination makes room
+        PoolSocket *old = it -> second.front();
+        PoolErase(old);
+        old -> SetCloseAndDelete();
+        m_pool_evictions++;
+    }
+    if (m_pool_index.size() >= m_pool_max_total || !m_pool_max_idle)
+    {
+        m_pool_evictions++;
+        return false;
+    }
+    PoolSocket *pools = new PoolSocket(*this, p);
+#ifdef HAVE_OPENSSL
+    if (p -> IsSSL())
+    {
+        SSL_CTX *ctx = p -> GetSslContext();
+        pools -> SetSsl(tcp -> ReleaseSsl(), ctx);
+    }
+#endif
+    pools -> SetDeleteByHandler();
+    // the file descriptor is registered again by Add
+    ISocketHandler_Del(p);
+    Add(pools);
+    AddTimer(pools, m_pool_idle_timeout);
+    m_pool[key].push_back(pools);
+    m_pool_index[pools] = key;
+    return true;
+}
+
+
 void SocketHandler::EnablePool(bool x)
 {
     m_b_enable_pool = x;
@@ -628,14 +905,88 @@ bool SocketHandler::PoolEnabled()
 {
     return m_b_enable_pool;
 }
+
+
+void SocketHandler::SetPoolMaxIdle(size_t n)
+{
+    m_pool_max_idle = n;
+}
+
+
+void SocketHandler::SetPoolMaxTotal(size_t n)
+{
+    m_pool_max_total = n;
+}
+
+
+void SocketHandler::SetPoolIdleTimeout(long usec)
+{
+    m_pool_idle_timeout = usec;
+}
+
+
+size_t SocketHandler::PoolSize()
+{
+    return m_pool_index.size();
+}
+
+
+uint64_t SocketHandler::PoolHits()
+{
+    return m_pool_hits;
+}
+
+
+uint64_t SocketHandler::PoolMisses()
+{
+    return m_pool_misses;
+}
+
+
+uint64_t SocketHandler::PoolEvictions()
+{
+    return m_pool_evictions;
+}
 #endif
 
 void SocketHandler::Remove(Socket *p)
 {
+#ifdef ENABLE_POOL
+    if (!m_pool_index.empty() && PoolErase(p))
+    {
+        m_pool_evictions++;
+    }
+#endif
+    while (!m_timer_index.empty())
+    {
+        auto it = m_timer_index.lower_bound(timer_id_t(p, INT_MIN));
+        if (it == m_timer_index.end() || it -> first.first != p)
+        {
+            break;
+        }
+        RemoveTimer(p, it -> first.second);
+    }
+    for (auto it = m_flush.begin(); it != m_flush.end(); ++it)
+    {
+        if (*it == p)
+        {
+            m_flush.erase(it);
+            break;
+        }
+    }
+    RemoveTcpInfo(p);
+    if (m_destinations && p != m_destinations)
+    {
+        m_destinations -> Remove(p);
+    }
 #ifdef ENABLE_RESOLVER
     auto it4 = m_resolve_q.find(p -> UniqueIdentifier());
     if (it4 != m_resolve_q.end())
         m_resolve_q.erase(it4);
+    if (p == m_dns)
+    {
+        m_dns = NULL;
+    }
 #endif
 
     if (p -> ErasedByHandler())
@@ -702,6 +1053,116 @@ void SocketHandler::SetClose(bool x)
 }
 
 
+void SocketHandler::AddFlush(Socket *p)
+{
+    m_flush.push_back(p);
+}
+
+
+void SocketHandler::AddTimer(Socket *p, long usec, int id)
+{
+    RemoveTimer(p, id);
+    mytime_t t = EventTime::Tick() + usec;
+    m_timers.insert(std::make_pair(t, timer_id_t(p, id)));
+    m_timer_index[timer_id_t(p, id)] = t;
+}
+
+
+void SocketHandler::RemoveTimer(Socket *p, int id)
+{
+    auto it = m_timer_index.find(timer_id_t(p, id));
+    if (it == m_timer_index.end())
+    {
+        return;
+    }
+    auto range = m_timers.equal_range(it -> second);
+    for (auto it2 = range.first; it2 != range.second; ++it2)
+    {
+        if (it2 -> second == it -> first)
+        {
+            m_timers.erase(it2);
+            break;
+        }
+    }
+    m_timer_index.erase(it);
+}
+
+
+void SocketHandler::SetInputRateLimit(uint64_t bytes_per_sec, uint64_t burst)
+{
+    m_input_limit.SetRate(bytes_per_sec, burst);
+}
+
+
+void SocketHandler::SetOutputRateLimit(uint64_t bytes_per_sec, uint64_t burst)
+{
+    m_output_limit.SetRate(bytes_per_sec, burst);
+}
+
+
+TokenBucket& SocketHandler::InputRateLimit()
+{
+    return m_input_limit;
+}
+
+
+TokenBucket& SocketHandler::OutputRateLimit()
+{
+    return m_output_limit;
+}
+
+
+void SocketHandler::AddTcpInfo(Socket *p, long usec)
+{
+    RemoveTcpInfo(p);
+    mytime_t t = EventTime::Tick() + usec;
+    m_tcpinfo.insert(std::make_pair(t, p));
+    m_tcpinfo_index[p] = t;
+}
+
+
+void SocketHandler::RemoveTcpInfo(Socket *p)
+{
+    auto it = m_tcpinfo_index.find(p);
+    if (it == m_tcpinfo_index.end())
+    {
+        return;
+    }
+    auto range = m_tcpinfo.equal_range(it -> second);
+    for (auto it2 = range.first; it2 != range.second; ++it2)
+    {
+        if (it2 -> second == p)
+        {
+            m_tcpinfo.erase(it2);
+            break;
+        }
+    }
+    m_tcpinfo_index.erase(it);
+}
+
+
+void SocketHandler::SetTcpInfoBudget(size_t n)
+{
+    m_tcpinfo_budget = n ? n : 1;
+}
+
+
+TcpInfoStats& SocketHandler::GetTcpInfoStats()
+{
+    return m_tcpinfo_stats;
+}
+
+
+#ifdef HAVE_OPENSSL
+void SocketHandler::AddSSLHandshake(Socket *p, SSL *ssl, bool server)
+{
+    ISocketHandler_Mod(p, false, false);
+    SSLHandshakePool::Instance().Post(*this, p, ssl, server);
+    m_b_check_ssl_handshake = true;
+}
+#endif
+
+
 void SocketHandler::DeleteSocket(Socket *p)
 {
     p -> OnDelete();
@@ -848,15 +1309,19 @@ void SocketHandler::AddIncoming()
                         }
             */
             auto *scp = dynamic_cast<StreamSocket *>(p);
-            if (scp && scp -> Connecting()) // 'Open' called before adding socket
+            TcpSocket *tcp = dynamic_cast<TcpSocket *>(p);
+            if (tcp && tcp -> RetryPending())
+            {
+                // connect failed, monitoring starts with the retry
+            }
+            else if (scp && scp -> Connecting()) // 'Open' called before adding socket
             {
                 ISocketHandler_Add(p, false, true);
             }
             else
             {
-                TcpSocket *tcp = dynamic_cast<TcpSocket *>(p);
                 bool bWrite = tcp ? tcp -> GetOutputLength() != 0 : false;
-                if (p -> IsDisableRead())
+                if (p -> IsDisableRead() || (tcp && tcp -> IsReadPaused()))
                 {
                     ISocketHandler_Add(p, false, bWrite);
                 }
@@ -958,6 +1423,10 @@ void SocketHandler::CheckCallOnConnect()
                     {
                         p -> OnConnect();
                     }
+                    if (tcp)
+                    {
+                        tcp -> FastOpenConnect();
+                    }
                 }
             p -> SetCallOnConnect( false );
             m_b_check_callonconnect = true;
@@ -1077,6 +1546,10 @@ void SocketHandler::CheckClose()
                 if (tcp && p -> IsConnected() && tcp -> GetFlushBeforeClose() &&
 #ifdef HAVE_OPENSSL
                     !tcp -> IsSSL() &&
+#endif
+#ifdef ENABLE_POOL
+                    // a flushed connection kept for the pool is not shut down
+                    !(m_b_enable_pool && p -> Retain() && !tcp -> GetOutputLength()) &&
 #endif
                     p -> TimeSinceClose() < 5)
                 {
@@ -1109,6 +1582,18 @@ void SocketHandler::CheckClose()
                         p -> SetCloseAndDelete(false);
                         tcp -> SetIsReconnect();
                         p -> SetConnected(false);
+                        if (tcp -> GetRetryPolicy().Enabled())
+                        {
+                            // reconnect from retry timer, old file descriptor is closed then
+                            p -> OnDisconnect();
+                            tcp -> ResetConnectionRetries();
+                            if (!tcp -> ScheduleRetry())
+                            {
+                                p -> SetCloseAndDelete();
+                            }
+                            m_b_check_close = true;
+                            continue;
+                        }
                         DEB(                        fprintf(stderr, "Close() before reconnect\n");)
                         p -> Close(); // dispose of old file descriptor (Open creates a new)
                         p -> OnDisconnect();
@@ -1133,12 +1618,8 @@ void SocketHandler::CheckClose()
                             LogError(p, "Closing", (int)tcp -> GetOutputLength(), "Closing socket while data still left to send", LOG_LEVEL_WARNING);
                         }
 #ifdef ENABLE_POOL
-                        if (p -> Retain() && !p -> Lost())
+                        if (p -> Retain() && !p -> Lost() && AddConnection(p))
                         {
-                            PoolSocket *p2 = new PoolSocket(*this, p);
-                            p2 -> SetDeleteByHandler();
-                            Add(p2);
-                            //
                             p -> SetCloseAndDelete(false); // added - remove from m_fds_close
                         }
                         else
@@ -1156,6 +1637,103 @@ void SocketHandler::CheckClose()
 }
 
 
+void SocketHandler::CheckFlush()
+{
+    // sockets flushed here may queue more output on other sockets
+    std::vector<Socket *> flush;
+    flush.swap(m_flush);
+    for (auto p : flush)
+    {
+        TcpSocket *tcp = dynamic_cast<TcpSocket *>(p);
+        if (tcp)
+        {
+            tcp -> Flush();
+            continue;
+        }
+        UdpSocket *udp = dynamic_cast<UdpSocket *>(p);
+        if (udp)
+        {
+            udp -> Flush();
+        }
+    }
+}
+
+
+void SocketHandler::CheckTimers()
+{
+    mytime_t now = EventTime::Tick();
+    while (!m_timers.empty() && m_timers.begin() -> first <= now)
+    {
+        auto it = m_timers.begin();
+        timer_id_t t = it -> second;
+        m_timers.erase(it);
+        m_timer_index.erase(t);
+        // callback may schedule new timers
+        if (t.second < 0)
+        {
+            t.first -> OnInternalTimer(t.second);
+        }
+        else
+        {
+            t.first -> OnTimer(t.second);
+        }
+    }
+}
+
+
+void SocketHandler::CheckTcpInfo()
+{
+    mytime_t now = EventTime::Tick();
+    size_t n = 0;
+    while (!m_tcpinfo.empty() && m_tcpinfo.begin() -> first <= now && n++ < m_tcpinfo_budget)
+    {
+        Socket *p = m_tcpinfo.begin() -> second;
+        m_tcpinfo.erase(m_tcpinfo.begin());
+        m_tcpinfo_index.erase(p);
+        TcpSocket *tcp = dynamic_cast<TcpSocket *>(p);
+        if (!tcp || tcp -> TcpInfoInterval() <= 0)
+        {
+            continue;
+        }
+        const TcpInfoHistory *history = tcp -> GetTcpInfoHistory();
+        TcpInfoSample prev;
+        bool has_prev = history && history -> Size();
+        if (has_prev)
+        {
+            prev = history -> Get(0);
+        }
+        TcpInfoSample sample;
+        if (tcp -> SampleTcpInfo(sample))
+        {
+            m_tcpinfo_stats.Add(sample, has_prev ? &prev : nullptr);
+        }
+        AddTcpInfo(p, tcp -> TcpInfoInterval());
+    }
+}
+
+
+#ifdef HAVE_OPENSSL
+void SocketHandler::CheckSSLHandshake()
+{
+    std::vector<SSLHandshakePool::Job> jobs;
+    m_b_check_ssl_handshake = SSLHandshakePool::Instance().Collect(*this, jobs);
+    for (auto& job : jobs)
+    {
+        Socket *p = job.socket;
+        if (!Valid(p) || p -> UniqueIdentifier() != job.uid)
+        {
+            continue;
+        }
+        TcpSocket *tcp = dynamic_cast<TcpSocket *>(p);
+        if (tcp)
+        {
+            tcp -> OnSSLHandshake(job.result, job.error);
+        }
+    }
+}
+#endif
+
+
 int SocketHandler::ISocketHandler_Select(struct timeval *tsel)
 {
 #ifdef MACOSX
@@ -1320,7 +1898,72 @@ int SocketHandler::Select(struct timeval *tsel)
     {
         AddIncoming();
     }
+    // output coalesced outside of the event loop
+    if (!m_flush.empty())
+    {
+        CheckFlush();
+    }
+    // wake up in time for next timer or TCP_INFO sample
+    struct timeval tv;
+    if (!m_timers.empty() || !m_tcpinfo.empty())
+    {
+        mytime_t next = !m_timers.empty() ? m_timers.begin() -> first : m_tcpinfo.begin() -> first;
+        if (!m_tcpinfo.empty() && m_tcpinfo.begin() -> first < next)
+        {
+            next = m_tcpinfo.begin() -> first;
+        }
+        mytime_t diff = next - EventTime::Tick();
+        if (diff < 0)
+        {
+            diff = 0;
+        }
+        if (!tsel || diff < (mytime_t)tsel -> tv_sec * 1000000 + tsel -> tv_usec)
+        {
+            tv.tv_sec = static_cast<long>(diff / 1000000);
+            tv.tv_usec = static_cast<long>(diff % 1000000);
+            tsel = &tv;
+        }
+    }
+#ifdef ENABLE_RESOLVER
+    // lookups completed without a wakeup, by the DnsClient or before the last Reset
+    if (m_resolve_pending && !m_resolver -> Empty())
+    {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+        tsel = &tv;
+    }
+#endif
     int n = ISocketHandler_Select(tsel);
+    // work finished by other threads after this is reported by the next wakeup
+    if (m_wakeup)
+    {
+        m_wakeup -> Reset();
+    }
+
+    // timers - EVENT
+    if (!m_timers.empty())
+    {
+        CheckTimers();
+    }
+    // TCP_INFO sampling, bounded by budget - EVENT
+    if (!m_tcpinfo.empty())
+    {
+        CheckTcpInfo();
+    }
+#ifdef ENABLE_RESOLVER
+    // lookups done - EVENT
+    if (m_resolve_pending)
+    {
+        CheckResolve();
+    }
+#endif
+#ifdef HAVE_OPENSSL
+    // handshake steps done - EVENT
+    if (m_b_check_ssl_handshake)
+    {
+        CheckSSLHandshake();
+    }
+#endif
     // check CallOnConnect - EVENT
     if (m_b_check_callonconnect)
     {
@@ -1352,6 +1995,12 @@ int SocketHandler::Select(struct timeval *tsel)
         CheckRetry();
     }
 
+    // flush output coalesced during this dispatch - EVENT
+    if (!m_flush.empty())
+    {
+        CheckFlush();
+    }
+
     // check close and delete - conditional event
     if (m_b_check_close)
     {
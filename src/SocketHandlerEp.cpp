@@ -116,12 +116,12 @@ int SocketHandlerEp::ISocketHandler_Select(struct timeval *tsel)
     if (m_b_use_mutex)
     {
         m_mutex.Unlock();
-        n = epoll_wait(m_epoll, m_events, MAX_EVENTS_EP_WAIT, tsel ? tsel -> tv_sec * 1000 + tsel -> tv_usec / 1000 : -1);
+        n = epoll_wait(m_epoll, m_events, MAX_EVENTS_EP_WAIT, tsel ? tsel -> tv_sec * 1000 + (tsel -> tv_usec + 999) / 1000 : -1);
         m_mutex.Lock();
     }
     else
     {
-        n = epoll_wait(m_epoll, m_events, MAX_EVENTS_EP_WAIT, tsel ? tsel -> tv_sec * 1000 + tsel -> tv_usec / 1000 : -1);
+        n = epoll_wait(m_epoll, m_events, MAX_EVENTS_EP_WAIT, tsel ? tsel -> tv_sec * 1000 + (tsel -> tv_usec + 999) / 1000 : -1);
     }
     if (n == -1)
     {
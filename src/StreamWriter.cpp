@@ -1,54 +1,136 @@
 
 #include "StreamWriter.h"
 #include "IStream.h"
-#include "Utility.h"
+#include "TcpSocket.h"
+
+#include <charconv>
+#include <cstring>
 
 
 namespace dai {
 
-StreamWriter::StreamWriter(IStream& stream) : m_stream(stream)
+// longest to_chars result, shortest round trip double
+#define STREAM_WRITER_NUMBER_SIZE 32
+
+StreamWriter::StreamWriter(IStream& stream) : m_stream(&stream), m_socket(nullptr)
 {
 }
 
-StreamWriter& StreamWriter::operator<<(const char *buf)
+
+StreamWriter::StreamWriter(TcpSocket& sock) : m_stream(nullptr), m_socket(&sock)
+{
+}
+
+
+StreamWriter::~StreamWriter()
+{
+    Flush();
+}
+
+
+StreamWriter& StreamWriter::Write(const char *buf, size_t len)
 {
-    m_stream.IStreamWrite(buf, strlen(buf));
+    if (!m_socket)
+    {
+        m_stream -> IStreamWrite(buf, len);
+        return *this;
+    }
+    while (len)
+    {
+        size_t space;
+        char *p = m_socket -> ReserveOutput(1, space);
+        size_t sz = len < space ? len : space;
+        memcpy(p, buf, sz);
+        m_socket -> CommitOutput(sz);
+        buf += sz;
+        len -= sz;
+    }
     return *this;
 }
 
 
-StreamWriter& StreamWriter::operator<<(const std::string& str)
+void StreamWriter::Flush()
+{
+    if (m_socket)
+    {
+        m_socket -> SendOutput();
+    }
+}
+
+
+template <class T> StreamWriter& StreamWriter::Number(T x)
 {
-    m_stream.IStreamWrite(str.c_str(), str.size());
+    char tmp[STREAM_WRITER_NUMBER_SIZE];
+    char *p = tmp;
+    size_t space = sizeof(tmp);
+    if (m_socket)
+    {
+        p = m_socket -> ReserveOutput(STREAM_WRITER_NUMBER_SIZE, space);
+    }
+    std::to_chars_result r = std::to_chars(p, p + space, x);
+    if (m_socket)
+    {
+        m_socket -> CommitOutput(r.ptr - p);
+    }
+    else
+    {
+        m_stream -> IStreamWrite(tmp, r.ptr - tmp);
+    }
     return *this;
 }
 
 
+StreamWriter& StreamWriter::operator<<(const char *buf)
+{
+    return Write(buf, strlen(buf));
+}
+
+
+StreamWriter& StreamWriter::operator<<(const std::string& str)
+{
+    return Write(str.c_str(), str.size());
+}
+
+
+StreamWriter& StreamWriter::operator<<(char c)
+{
+    return Write(&c, 1);
+}
+
+
 StreamWriter& StreamWriter::operator<<(short x)
 {
-    *this << Utility::l2string(x);
-    return *this;
+    return Number(x);
 }
 
 
 StreamWriter& StreamWriter::operator<<(int x)
 {
-    *this << Utility::l2string(x);
-    return *this;
+    return Number(x);
 }
 
 
 StreamWriter& StreamWriter::operator<<(long x)
 {
-    *this << Utility::l2string(x);
-    return *this;
+    return Number(x);
+}
+
+
+StreamWriter& StreamWriter::operator<<(unsigned int x)
+{
+    return Number(x);
+}
+
+
+StreamWriter& StreamWriter::operator<<(unsigned long x)
+{
+    return Number(x);
 }
 
 
 StreamWriter& StreamWriter::operator<<(double x)
 {
-    *this << Utility::ToString(x);
-    return *this;
+    return Number(x);
 }
 
 }//namespace dai
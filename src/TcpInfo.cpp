@@ -0,0 +1,220 @@
+#include "TcpInfo.h"
+
+#include <cstring>
+#ifdef LINUX
+#   include <cstddef>
+#   include <netinet/tcp.h>
+#endif
+
+namespace dai {
+
+#ifdef LINUX
+namespace {
+
+// the libc tcp_info ends at tcpi_total_retrans, newer kernels append
+struct tcp_info_ext
+{
+    struct tcp_info info;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;
+    uint32_t min_rtt;
+    uint32_t data_segs_in;
+    uint32_t data_segs_out;
+    uint64_t delivery_rate;
+};
+
+}
+#endif
+
+
+bool TcpInfoSample::Read(SOCKET s)
+{
+#ifdef LINUX
+    struct tcp_info_ext ti;
+    memset(&ti, 0, sizeof(ti));
+    socklen_t len = sizeof(ti);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1 || len < sizeof(struct tcp_info))
+    {
+        return false;
+    }
+    time = EventTime::Tick();
+    rtt = ti.info.tcpi_rtt;
+    rttvar = ti.info.tcpi_rttvar;
+    cwnd = ti.info.tcpi_snd_cwnd;
+    retransmits = ti.info.tcpi_total_retrans;
+    unacked = ti.info.tcpi_unacked;
+    delivery_rate = len >= offsetof(struct tcp_info_ext, delivery_rate) + sizeof(ti.delivery_rate) ? ti.delivery_rate : 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+TcpInfoHistory::TcpInfoHistory()
+    : m_next(0)
+    , m_count(0)
+{
+    memset(m_samples, 0, sizeof(m_samples));
+}
+
+
+void TcpInfoHistory::Add(const TcpInfoSample& sample)
+{
+    m_samples[m_next] = sample;
+    m_next = (m_next + 1) % SIZE;
+    if (m_count < SIZE)
+        m_count++;
+}
+
+
+size_t TcpInfoHistory::Size() const
+{
+    return m_count;
+}
+
+
+const TcpInfoSample& TcpInfoHistory::Get(size_t i) const
+{
+    return m_samples[(m_next + SIZE - 1 - i % SIZE) % SIZE];
+}
+
+
+TcpInfoHistogram::TcpInfoHistogram()
+{
+    Reset();
+}
+
+
+void TcpInfoHistogram::Add(uint64_t value)
+{
+    size_t i = 0;
+    while (value && i < BUCKETS - 1)
+    {
+        value >>= 1;
+        i++;
+    }
+    m_buckets[i]++;
+    m_count++;
+}
+
+
+void TcpInfoHistogram::Reset()
+{
+    memset(m_buckets, 0, sizeof(m_buckets));
+    m_count = 0;
+}
+
+
+uint64_t TcpInfoHistogram::Count() const
+{
+    return m_count;
+}
+
+
+uint64_t TcpInfoHistogram::Bucket(size_t i) const
+{
+    return i < BUCKETS ? m_buckets[i] : 0;
+}
+
+
+uint64_t TcpInfoHistogram::Percentile(double p) const
+{
+    if (!m_count)
+    {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(m_count * p / 100);
+    if (want >= m_count)
+        want = m_count - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        seen += m_buckets[i];
+        if (seen > want)
+        {
+            return i ? (uint64_t)1 << i : 0;
+        }
+    }
+    return (uint64_t)1 << (BUCKETS - 1);
+}
+
+
+TcpInfoStats::TcpInfoStats()
+    : m_samples(0)
+{
+}
+
+
+void TcpInfoStats::Add(const TcpInfoSample& sample, const TcpInfoSample *prev)
+{
+    m_samples++;
+    m_rtt.Add(sample.rtt);
+    m_rttvar.Add(sample.rttvar);
+    m_cwnd.Add(sample.cwnd);
+    m_retransmits.Add(prev && sample.retransmits >= prev -> retransmits ? sample.retransmits - prev -> retransmits : sample.retransmits);
+    m_unacked.Add(sample.unacked);
+    m_delivery_rate.Add(sample.delivery_rate);
+}
+
+
+void TcpInfoStats::Reset()
+{
+    m_samples = 0;
+    m_rtt.Reset();
+    m_rttvar.Reset();
+    m_cwnd.Reset();
+    m_retransmits.Reset();
+    m_unacked.Reset();
+    m_delivery_rate.Reset();
+}
+
+
+uint64_t TcpInfoStats::Samples() const
+{
+    return m_samples;
+}
+
+
+const TcpInfoHistogram& TcpInfoStats::Rtt() const
+{
+    return m_rtt;
+}
+
+
+const TcpInfoHistogram& TcpInfoStats::RttVar() const
+{
+    return m_rttvar;
+}
+
+
+const TcpInfoHistogram& TcpInfoStats::Cwnd() const
+{
+    return m_cwnd;
+}
+
+
+const TcpInfoHistogram& TcpInfoStats::Retransmits() const
+{
+    return m_retransmits;
+}
+
+
+const TcpInfoHistogram& TcpInfoStats::Unacked() const
+{
+    return m_unacked;
+}
+
+
+const TcpInfoHistogram& TcpInfoStats::DeliveryRate() const
+{
+    return m_delivery_rate;
+}
+
+
+}//namespace dai
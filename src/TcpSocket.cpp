@@ -14,6 +14,16 @@
 #ifndef _WIN32
 #   include <netinet/tcp.h>
 #endif
+#ifdef LINUX
+#   include <sys/sendfile.h>
+#   include <linux/errqueue.h>
+#   ifndef SO_ZEROCOPY
+#       define SO_ZEROCOPY 60
+#   endif
+#   ifndef MSG_ZEROCOPY
+#       define MSG_ZEROCOPY 0x4000000
+#   endif
+#endif
 #include <map>
 #include <cstdio>
 #include <fcntl.h>
@@ -27,6 +37,10 @@
 #include "Ipv6Address.h"
 #include "IFile.h"
 #include "Lock.h"
+#ifdef HAVE_OPENSSL
+#   include "SSLHandshakePool.h"
+#   include "SSLSessionCache.h"
+#endif
 
 namespace dai {
 
@@ -65,22 +79,66 @@ TcpSocket::TcpSocket(ISocketHandler& h) : StreamSocket(h)
     , m_transfer_limit(0)
     , m_output_length(0)
     , m_repeat_length(0)
+    , m_b_coalesce(false)
+    , m_b_flush_pending(false)
+    , m_output_low(0)
+    , m_output_high(0)
+    , m_b_backpressure(false)
+    , m_upstream(NULL)
+    , m_read_paused(0)
+    , m_b_input_throttled(false)
+    , m_b_output_throttled(false)
+    , m_input_throttle_start(0)
+    , m_output_throttle_start(0)
+    , m_input_throttle_time(0)
+    , m_output_throttle_time(0)
+    , m_b_zerocopy(false)
+    , m_zerocopy_threshold(TCP_ZEROCOPY_THRESHOLD)
+    , m_zerocopy_socket(INVALID_SOCKET)
+    , m_zc_next(0)
+    , m_zc_done(0)
+    , m_b_fastopen(false)
+    , m_b_fastopen_deferred(false)
+    , m_relay(NULL)
+    , m_relay_pipe_size(0)
+    , m_relay_pending(0)
+    , m_b_relay_eof(false)
+    , m_b_retry_pending(false)
+    , m_tcpinfo_interval(0)
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    , m_b_happy_eyeballs(false)
+    , m_b_he_racing(false)
+    , m_b_he_own_failed(false)
+    , m_he_resolving(0)
+    , m_he_last_attempt(0)
+#endif
 #ifdef HAVE_OPENSSL
     , m_ssl_ctx(NULL)
     , m_ssl(NULL)
     , m_sbio(NULL)
+    , m_b_ktls(false)
+    , m_b_ktls_send(false)
+    , m_b_ssl_offload(false)
+    , m_b_ssl_dynamic_records(true)
+    , m_ssl_records(0)
+    , m_ssl_last_write(0)
+    , m_b_ssl_handshake(false)
 #endif
 #ifdef ENABLE_SOCKS4
     , m_socks4_state(0)
 #endif
 #ifdef ENABLE_RESOLVER
     , m_resolver_id(0)
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    , m_resolver_id6(0)
+#endif
 #endif
 #ifdef ENABLE_RECONNECT
     , m_b_reconnect(false)
     , m_b_is_reconnect(false)
 #endif
 {
+    m_relay_pipe[0] = m_relay_pipe[1] = -1;
 }
 #ifdef _MSC_VER
 #   pragma warning(default:4355)
@@ -105,22 +163,66 @@ TcpSocket::TcpSocket(ISocketHandler& h, size_t isize, size_t osize) : StreamSock
     , m_transfer_limit(0)
     , m_output_length(0)
     , m_repeat_length(0)
+    , m_b_coalesce(false)
+    , m_b_flush_pending(false)
+    , m_output_low(0)
+    , m_output_high(0)
+    , m_b_backpressure(false)
+    , m_upstream(NULL)
+    , m_read_paused(0)
+    , m_b_input_throttled(false)
+    , m_b_output_throttled(false)
+    , m_input_throttle_start(0)
+    , m_output_throttle_start(0)
+    , m_input_throttle_time(0)
+    , m_output_throttle_time(0)
+    , m_b_zerocopy(false)
+    , m_zerocopy_threshold(TCP_ZEROCOPY_THRESHOLD)
+    , m_zerocopy_socket(INVALID_SOCKET)
+    , m_zc_next(0)
+    , m_zc_done(0)
+    , m_b_fastopen(false)
+    , m_b_fastopen_deferred(false)
+    , m_relay(NULL)
+    , m_relay_pipe_size(0)
+    , m_relay_pending(0)
+    , m_b_relay_eof(false)
+    , m_b_retry_pending(false)
+    , m_tcpinfo_interval(0)
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    , m_b_happy_eyeballs(false)
+    , m_b_he_racing(false)
+    , m_b_he_own_failed(false)
+    , m_he_resolving(0)
+    , m_he_last_attempt(0)
+#endif
 #ifdef HAVE_OPENSSL
     , m_ssl_ctx(NULL)
     , m_ssl(NULL)
     , m_sbio(NULL)
+    , m_b_ktls(false)
+    , m_b_ktls_send(false)
+    , m_b_ssl_offload(false)
+    , m_b_ssl_dynamic_records(true)
+    , m_ssl_records(0)
+    , m_ssl_last_write(0)
+    , m_b_ssl_handshake(false)
 #endif
 #ifdef ENABLE_SOCKS4
     , m_socks4_state(0)
 #endif
 #ifdef ENABLE_RESOLVER
     , m_resolver_id(0)
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    , m_resolver_id6(0)
+#endif
 #endif
 #ifdef ENABLE_RECONNECT
     , m_b_reconnect(false)
     , m_b_is_reconnect(false)
 #endif
 {
+    m_relay_pipe[0] = m_relay_pipe[1] = -1;
 }
 #ifdef _MSC_VER
 #   pragma warning(default:4355)
@@ -128,6 +230,15 @@ TcpSocket::TcpSocket(ISocketHandler& h, size_t isize, size_t osize) : StreamSock
 
 TcpSocket::~TcpSocket()
 {
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    HappyEyeballsStop();
+#endif
+    RelayUnlink();
+    SetUpstream(NULL);
+    while (!m_downstream.empty())
+    {
+        m_downstream.front() -> SetUpstream(NULL);
+    }
 #ifdef SOCKETS_DYNAMIC_TEMP
     delete[] m_buf;
 #endif
@@ -139,7 +250,18 @@ TcpSocket::~TcpSocket()
         delete p;
         m_obuf.erase(it);
     }
+    while (!m_zc_pending.empty())
+    {
+        delete m_zc_pending.front();
+        m_zc_pending.pop_front();
+    }
 #ifdef HAVE_OPENSSL
+    if (m_b_ssl_handshake)
+    {
+        // the pool must be done with m_ssl
+        SSLHandshakePool::Instance().Cancel(m_ssl);
+        m_b_ssl_handshake = false;
+    }
     if (m_ssl)
     {
         SSL_free(m_ssl);
@@ -197,10 +319,36 @@ bool TcpSocket::Open(SocketAddress& ad, SocketAddress& bind_ad, bool skip_socks)
 #ifdef ENABLE_POOL
     if (Handler().PoolEnabled())
     {
-        ISocketHandler::PoolSocket *pools = Handler().FindConnection(SOCK_STREAM, "tcp", ad);
+        std::string identity;
+#ifdef HAVE_OPENSSL
+        if (IsSSL())
+        {
+            // a pooled tls connection is only reused with the same context and session key
+            if (m_ssl_session_key.empty())
+            {
+                m_ssl_session_key = ad.Convert(true);
+            }
+            SSL_CTX *ctx = m_ssl_ctx;
+            InitSSLClient();
+            identity = GetPoolIdentity();
+            m_ssl_ctx = ctx; // initialized again by OnSSLConnect
+        }
+#endif
+        ISocketHandler::PoolSocket *pools = Handler().FindConnection(SOCK_STREAM, "tcp", ad, identity);
         if (pools)
         {
             CopyConnection( pools );
+#ifdef HAVE_OPENSSL
+            if (IsSSL())
+            {
+                // negotiated; OnSSLConnect skips the handshake
+                m_ssl_ctx = pools -> GetSslContext();
+                m_ssl = pools -> GetSsl();
+                m_sbio = SSL_get_rbio(m_ssl);
+                pools -> SetSsl(NULL, NULL);
+                SSLSessionCache::Instance().SetKey(m_ssl, &m_ssl_session_key);
+            }
+#endif
             delete pools;
 
             SetIsClient();
@@ -227,6 +375,8 @@ bool TcpSocket::Open(SocketAddress& ad, SocketAddress& bind_ad, bool skip_socks)
     SetIsClient(); // client because we connect
 #endif
     SetClientRemoteAddress(ad);
+    m_b_fastopen_deferred = false;
+    bool b_fastopen = false;
     int n = 0;
     if (bind_ad.GetPort() != 0)
     {
@@ -249,6 +399,20 @@ bool TcpSocket::Open(SocketAddress& ad, SocketAddress& bind_ad, bool skip_socks)
     else
 #endif
     {
+#ifdef TCP_FASTOPEN_CONNECT
+        if (m_b_fastopen)
+        {
+            int optval = 1;
+            if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char *)&optval, sizeof(optval)) == -1)
+            {
+                Handler().LogError(this, "setsockopt(IPPROTO_TCP, TCP_FASTOPEN_CONNECT)", Errno, StrError(Errno), LOG_LEVEL_WARNING);
+            }
+            else
+            {
+                b_fastopen = true;
+            }
+        }
+#endif
         n = connect(s, ad, ad);
         SetRemoteAddress(ad);
     }
@@ -273,6 +437,13 @@ bool TcpSocket::Open(SocketAddress& ad, SocketAddress& bind_ad, bool skip_socks)
             }
             else
 #endif
+                if (m_retry_policy.Retry(GetConnectionRetries()))
+                {
+                    Handler().LogError(this, "connect: failed, retry pending", Errno, StrError(Errno), LOG_LEVEL_INFO);
+                    Attach(s);
+                    ScheduleRetry();
+                }
+                else
 #ifdef ENABLE_RECONNECT
                 if (Reconnect())
                 {
@@ -293,6 +464,8 @@ bool TcpSocket::Open(SocketAddress& ad, SocketAddress& bind_ad, bool skip_socks)
     {
         Attach(s);
         SetCallOnConnect(); // ISocketHandler must call OnConnect
+        // with a fast open cookie the SYN waits for the first write
+        m_b_fastopen_deferred = b_fastopen;
     }
 
     // 'true' means connected or connecting(not yet connected)
@@ -303,6 +476,12 @@ bool TcpSocket::Open(SocketAddress& ad, SocketAddress& bind_ad, bool skip_socks)
 
 bool TcpSocket::Open(const std::string& host, port_t port)
 {
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    if (m_b_happy_eyeballs && !Utility::isIpv4(host) && !Utility::isIpv6(host))
+    {
+        return OpenHappyEyeballs(host, port);
+    }
+#endif
 #ifdef ENABLE_IPV6
 #ifdef IPPROTO_IPV6
     if (IsIpv6())
@@ -354,6 +533,17 @@ bool TcpSocket::Open(const std::string& host, port_t port)
 void TcpSocket::OnResolved(int id, ipaddr_t a, port_t port)
 {
     DEB(    fprintf(stderr, "TcpSocket::OnResolved id %d addr %x port %d\n", id, a, port);)
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    if (m_he_resolving && (id == m_resolver_id || id == m_resolver_id6))
+    {
+        m_he_resolving--;
+        if (m_b_he_racing)
+        {
+            HappyEyeballsResolved(a && port ? new Ipv4Address(a, port) : NULL);
+        }
+        return;
+    }
+#endif
     if (id == m_resolver_id)
     {
         if (a && port)
@@ -385,6 +575,23 @@ void TcpSocket::OnResolved(int id, ipaddr_t a, port_t port)
 #ifdef ENABLE_IPV6
 void TcpSocket::OnResolved(int id, in6_addr& a, port_t port)
 {
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    if (m_he_resolving && (id == m_resolver_id || id == m_resolver_id6))
+    {
+        m_he_resolving--;
+        if (m_b_he_racing)
+        {
+            Ipv6Address *ad = new Ipv6Address(a, port);
+            if (!ad -> IsValid())
+            {
+                delete ad;
+                ad = NULL;
+            }
+            HappyEyeballsResolved(ad);
+        }
+        return;
+    }
+#endif
     if (id == m_resolver_id)
     {
         Ipv6Address ad(a, port);
@@ -407,6 +614,21 @@ void TcpSocket::OnResolved(int id, in6_addr& a, port_t port)
     }
 }
 #endif
+
+
+void TcpSocket::OnResolveFailed(int id)
+{
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    if (m_he_resolving && (id == m_resolver_id || id == m_resolver_id6))
+    {
+        m_he_resolving--;
+        if (m_b_he_racing)
+        {
+            HappyEyeballsResolved(NULL);
+        }
+    }
+#endif
+}
 #endif
 
 
@@ -418,13 +640,31 @@ void TcpSocket::OnRead()
 #else
     char buf[TCP_BUFSIZE_READ];
 #endif
+#ifdef LINUX
+    if (m_relay)
+    {
+        RelayRead();
+        return;
+    }
+#endif
+    if (Connecting())
+    {
+        // hangup on failed connect (epoll), connect result is handled in OnWrite
+        return;
+    }
+    size_t max = InputAllowance(TCP_BUFSIZE_READ);
+    if (!max)
+    {
+        ThrottleInput();
+        return;
+    }
 
 #ifdef HAVE_OPENSSL
     if (IsSSL())
     {
         if (!Ready())
             return;
-        n = SSL_read(m_ssl, buf, TCP_BUFSIZE_READ);
+        n = SSL_read(m_ssl, buf, (int)max);
         if (n == -1)
         {
             n = SSL_get_error(m_ssl, n);
@@ -436,6 +676,7 @@ void TcpSocket::OnRead()
                     break;
                 case SSL_ERROR_ZERO_RETURN:
                     DEB( fprintf(stderr, "SSL_read() returns zero - closing socket\n");)
+                    SSL_shutdown(m_ssl); // answer close_notify, the session stays resumable
                     OnDisconnect();
                     OnDisconnect(TCP_DISCONNECT_SSL | TCP_DISCONNECT_ERROR, n);
                     SetCloseAndDelete(true);
@@ -461,6 +702,10 @@ void TcpSocket::OnRead()
             fprintf(stderr, "ERR_get_error() returns %ld\n", ERR_get_error());
                 perror("errno: SSL_read");
             })
+            if (SSL_get_error(m_ssl, 0) == SSL_ERROR_ZERO_RETURN)
+            {
+                SSL_shutdown(m_ssl); // answer close_notify, the session stays resumable
+            }
             OnDisconnect();
             OnDisconnect(TCP_DISCONNECT_SSL, 0);
             SetCloseAndDelete(true);
@@ -472,10 +717,12 @@ void TcpSocket::OnRead()
         else if (n > 0 && n <= TCP_BUFSIZE_READ)
         {
             m_bytes_received += n;
+            ConsumeInput(n);
             if (GetTrafficMonitor())
             {
                 GetTrafficMonitor() -> fwrite(buf, 1, n);
             }
+            CaptureTraffic(false, buf, n, n);
             if (!m_b_input_buffer_disabled && !ibuf.Write(buf, n))
             {
                 Handler().LogError(this, "OnRead(ssl)", 0, "ibuf overflow", LOG_LEVEL_WARNING);
@@ -489,9 +736,24 @@ void TcpSocket::OnRead()
     else
 #endif // HAVE_OPENSSL
     {
-        n = recv(GetSocket(), buf, TCP_BUFSIZE_READ, MSG_NOSIGNAL);
+#ifdef LINUX
+        // select reports pending zero-copy completions as readable
+        if (m_zc_next != m_zc_done)
+        {
+            ReadZeroCopyCompletions();
+        }
+#endif
+        n = recv(GetSocket(), buf, max, MSG_NOSIGNAL);
         if (n == -1)
         {
+#ifdef _WIN32
+            if (Errno == WSAEWOULDBLOCK)
+#else
+            if (Errno == EWOULDBLOCK)
+#endif
+            {
+                return;
+            }
             Handler().LogError(this, "read", Errno, StrError(Errno), LOG_LEVEL_FATAL);
             OnDisconnect();
             OnDisconnect(TCP_DISCONNECT_ERROR, Errno);
@@ -513,10 +775,12 @@ void TcpSocket::OnRead()
         else if (n > 0 && n <= TCP_BUFSIZE_READ)
         {
             m_bytes_received += n;
+            ConsumeInput(n);
             if (GetTrafficMonitor())
             {
                 GetTrafficMonitor() -> fwrite(buf, 1, n);
             }
+            CaptureTraffic(false, buf, n, n);
             if (!m_b_input_buffer_disabled && !ibuf.Write(buf, n))
             {
                 Handler().LogError(this, "OnRead", 0, "ibuf overflow", LOG_LEVEL_WARNING);
@@ -646,13 +910,23 @@ void TcpSocket::OnWrite()
         // don't reset connecting flag on error here, we want the OnConnectFailed timeout later on
         if (!err) // ok
         {
-            Handler().ISocketHandler_Mod(this, !IsDisableRead(), false);
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+            HappyEyeballsStop();
+#endif
+            Handler().ISocketHandler_Mod(this, !IsDisableRead() && !m_read_paused, false);
             SetConnecting(false);
             SetCallOnConnect();
             return;
         }
         Handler().LogError(this, "tcp: connect failed", err, StrError(err), LOG_LEVEL_FATAL);
         Handler().ISocketHandler_Mod(this, false, false); // no more monitoring because connection failed
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+        if (m_b_he_racing && HappyEyeballsFailed())
+        {
+            // other connection attempts still running
+            return;
+        }
+#endif
 
         // failed
 #ifdef ENABLE_SOCKS4
@@ -663,6 +937,16 @@ void TcpSocket::OnWrite()
             return;
         }
 #endif
+        if (m_retry_policy.Enabled())
+        {
+            if (!ScheduleRetry())
+            {
+                SetConnecting(false);
+                SetCloseAndDelete( true );
+                OnConnectFailed();
+            }
+            return;
+        }
         if (GetConnectionRetry() == -1 ||
             (GetConnectionRetry() && GetConnectionRetries() < GetConnectionRetry()) )
         {
@@ -679,14 +963,29 @@ void TcpSocket::OnWrite()
         return;
     }
 
+#ifdef LINUX
+    if (m_relay)
+    {
+        // buffered data first, then data from peer
+        if (!m_obuf.empty())
+        {
+            SendFromOutputBuffer();
+        }
+        if (m_obuf.empty())
+        {
+            RelayWrite();
+        }
+        return;
+    }
+#endif
     SendFromOutputBuffer();
 }
 
 
 void TcpSocket::SendFromOutputBuffer()
 {
-    // try send next block in buffer
-    // if full block is sent, repeat
+    // try send as many blocks in buffer as possible
+    // if everything attempted is sent, repeat
     // if all blocks are sent, reset m_wfds
 
     bool repeat = false;
@@ -698,28 +997,20 @@ void TcpSocket::SendFromOutputBuffer()
             Handler().LogError(this, "OnWrite", (int)m_output_length, "Empty output buffer in OnWrite", LOG_LEVEL_ERROR);
             break;
         }
-        output_l::iterator it = m_obuf.begin();
-        OUTPUT *p = *it;
         repeat = false;
-        int n = TryWrite(p -> Buf(), p -> Len());
+        size_t max = OutputAllowance();
+        if (!max)
+        {
+            ThrottleOutput();
+            break;
+        }
+        size_t len = 0;
+        int n = TryWriteOutput(len, max);
         if (n > 0)
         {
-            size_t left = p -> Remove(n);
-            m_output_length -= n;
-            if (!left)
-            {
-                delete p;
-                m_obuf.erase(it);
-                if (!m_obuf.size())
-                {
-                    m_obuf_top = NULL;
-                    OnWriteComplete();
-                }
-                else
-                {
-                    repeat = true;
-                }
-            }
+            ConsumeOutput(n);
+            RemoveOutput(n);
+            repeat = (size_t)n == len && !m_obuf.empty();
         }
     }
     while (repeat);
@@ -730,12 +1021,178 @@ void TcpSocket::SendFromOutputBuffer()
     }
 
     // check output buffer set, set/reset m_wfds accordingly
+    ModifyEvents();
+}
+
+
+int TcpSocket::TryWriteOutput(size_t& len, size_t max)
+{
+#ifndef _WIN32
+    if (m_obuf.front() -> _fd != -1)
     {
-        bool br = !IsDisableRead();
-        if (m_obuf.size())
-            Handler().ISocketHandler_Mod(this, br, true);
-        else
-            Handler().ISocketHandler_Mod(this, br, false);
+#ifdef LINUX
+#ifdef HAVE_OPENSSL
+        if (!SslWrite())
+#endif
+        {
+            OUTPUT *p = m_obuf.front();
+            len = p -> Len() < max ? p -> Len() : max;
+            return TrySendfile(p -> _fd, (off_t)p -> _b, len);
+        }
+#endif
+        if (!ReadFileOutput())
+        {
+            len = 0;
+            return 0;
+        }
+    }
+#ifdef HAVE_OPENSSL
+    if (!SslWrite())
+#endif
+    {
+        // gather owned and shared blocks into one sendmsg(), up to the next file region
+        struct iovec iov[TCP_OUTPUT_IOV_MAX];
+        int cnt = 0;
+        len = 0;
+        for (output_l::iterator it = m_obuf.begin(); it != m_obuf.end() && cnt < TCP_OUTPUT_IOV_MAX && len < max; ++it)
+        {
+            OUTPUT *p = *it;
+            if (p -> _fd != -1)
+            {
+                break;
+            }
+            size_t sz = p -> Len() < max - len ? p -> Len() : max - len;
+            iov[cnt].iov_base = const_cast<char *>(p -> Buf());
+            iov[cnt].iov_len = sz;
+            len += sz;
+            cnt++;
+        }
+#ifdef LINUX
+        if (m_b_zerocopy && len >= m_zerocopy_threshold && PrepareZeroCopy())
+        {
+            int n = TryWritev(iov, cnt, MSG_ZEROCOPY);
+            if (n != -1)
+            {
+                if (n > 0)
+                {
+                    MarkZeroCopy(n);
+                }
+                return n;
+            }
+            // out of memory for pinned pages, copy this time
+        }
+#endif
+        return TryWritev(iov, cnt);
+    }
+#endif
+#ifdef HAVE_OPENSSL
+    if (SslWrite())
+    {
+        return TrySslWriteOutput(len, max);
+    }
+#endif
+    OUTPUT *p = m_obuf.front();
+    len = p -> Len() < max ? p -> Len() : max;
+    return TryWrite(p -> Buf(), len);
+}
+
+
+#ifdef HAVE_OPENSSL
+int TcpSocket::TrySslWriteOutput(size_t& len, size_t max)
+{
+    // a repeated SSL_write must have the same length, the data is the same
+    // but may have moved (SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER)
+    size_t rec = m_repeat_length ? m_repeat_length : SslRecordSize();
+    if (max > rec)
+    {
+        max = rec;
+    }
+    OUTPUT *p = m_obuf.front();
+    output_l::iterator it = m_obuf.begin();
+    if (p -> Len() >= max || ++it == m_obuf.end() || (*it) -> _fd != -1)
+    {
+        len = p -> Len() < max ? p -> Len() : max;
+        return TryWrite(p -> Buf(), len);
+    }
+    // gather small blocks into one record
+    if (!m_ssl_record)
+    {
+        m_ssl_record.reset(new char[TCP_SSL_RECORD_MAX]);
+    }
+    len = 0;
+    for (it = m_obuf.begin(); it != m_obuf.end() && len < max; ++it)
+    {
+        p = *it;
+        if (p -> _fd != -1)
+        {
+            break;
+        }
+        size_t sz = p -> Len() < max - len ? p -> Len() : max - len;
+        memcpy(m_ssl_record.get() + len, p -> Buf(), sz);
+        len += sz;
+    }
+    return TryWrite(m_ssl_record.get(), len);
+}
+
+
+size_t TcpSocket::SslRecordSize()
+{
+    if (!m_b_ssl_dynamic_records)
+    {
+        return TCP_SSL_RECORD_MAX;
+    }
+    if (EventTime::Tick() - m_ssl_last_write > TCP_SSL_RECORD_IDLE)
+    {
+        m_ssl_records = 0;
+    }
+    return m_ssl_records < TCP_SSL_RECORD_BOOST ? TCP_SSL_RECORD_SMALL : TCP_SSL_RECORD_MAX;
+}
+
+
+void TcpSocket::SetSslDynamicRecords(bool x)
+{
+    m_b_ssl_dynamic_records = x;
+}
+
+
+bool TcpSocket::SslDynamicRecords()
+{
+    return m_b_ssl_dynamic_records;
+}
+#endif
+
+
+void TcpSocket::RemoveOutput(size_t len)
+{
+    m_output_length -= len;
+    while (len && !m_obuf.empty())
+    {
+        OUTPUT *p = m_obuf.front();
+        size_t sz = p -> Len() < len ? p -> Len() : len;
+        len -= sz;
+        if (!p -> Remove(sz))
+        {
+            if (p == m_obuf_top)
+            {
+                m_obuf_top = NULL;
+            }
+            if (p -> _zc)
+            {
+                // the kernel may still reference the data
+                m_zc_pending.push_back(p);
+            }
+            else
+            {
+                delete p;
+            }
+            m_obuf.pop_front();
+        }
+    }
+    CheckWatermarks();
+    if (m_obuf.empty())
+    {
+        m_obuf_top = NULL;
+        OnWriteComplete();
     }
 }
 
@@ -744,7 +1201,7 @@ int TcpSocket::TryWrite(const char *buf, size_t len)
 {
     int n = 0;
 #ifdef HAVE_OPENSSL
-    if (IsSSL())
+    if (SslWrite())
     {
         n = SSL_write(m_ssl, buf, (int)(m_repeat_length ? m_repeat_length : len));
         if (n == -1)
@@ -777,6 +1234,11 @@ int TcpSocket::TryWrite(const char *buf, size_t len)
             SetFlushBeforeClose(false);
             SetLost();
         }
+        else
+        {
+            m_ssl_records++;
+            m_ssl_last_write = EventTime::Tick();
+        }
         m_repeat_length = 0;
     }
     else
@@ -811,50 +1273,271 @@ int TcpSocket::TryWrite(const char *buf, size_t len)
         {
             GetTrafficMonitor() -> fwrite(buf, 1, n);
         }
+        CaptureTraffic(true, buf, n, n);
     }
     return n;
 }
 
 
-void TcpSocket::Buffer(const char *buf, size_t len)
+#ifndef _WIN32
+int TcpSocket::TryWritev(const struct iovec *iov, int cnt, int flags)
 {
-    size_t ptr = 0;
-    m_output_length += len;
-    while (ptr < len)
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = cnt;
+    int n = (int)sendmsg(GetSocket(), &msg, MSG_NOSIGNAL | flags);
+    if (n == -1)
     {
-        // buf/len => pbuf/sz
-        size_t space = 0;
-        if ((space = m_obuf_top ? m_obuf_top -> Space() : 0) > 0)
+#ifdef LINUX
+        if ((flags & MSG_ZEROCOPY) && Errno == ENOBUFS)
         {
-            const char *pbuf = buf + ptr;
-            size_t sz = len - ptr;
-            if (space >= sz)
-            {
-                m_obuf_top -> Add(pbuf, sz);
-                ptr += sz;
-            }
-            else
+            return -1;
+        }
+#endif
+        if (Errno != EWOULDBLOCK)
+        {
+            Handler().LogError(this, "sendmsg", Errno, StrError(Errno), LOG_LEVEL_FATAL);
+            OnDisconnect();
+            OnDisconnect(TCP_DISCONNECT_WRITE | TCP_DISCONNECT_ERROR, Errno);
+            SetCloseAndDelete(true);
+            SetFlushBeforeClose(false);
+            SetLost();
+        }
+        return 0;
+    }
+    if (n > 0)
+    {
+        m_bytes_sent += n;
+        if (GetTrafficMonitor())
+        {
+            size_t left = n;
+            for (int i = 0; i < cnt && left; i++)
             {
-                m_obuf_top -> Add(pbuf, space);
-                ptr += space;
+                size_t sz = iov[i].iov_len < left ? iov[i].iov_len : left;
+                GetTrafficMonitor() -> fwrite(static_cast<const char *>(iov[i].iov_base), 1, sz);
+                left -= sz;
             }
         }
-        else
+        if (TrafficCaptured())
         {
-            m_obuf_top = new OUTPUT;
-            m_obuf.push_back( m_obuf_top );
+            size_t left = n;
+            for (int i = 0; i < cnt && left; i++)
+            {
+                size_t sz = iov[i].iov_len < left ? iov[i].iov_len : left;
+                CaptureTraffic(true, static_cast<const char *>(iov[i].iov_base), sz, sz);
+                left -= sz;
+            }
         }
     }
+    return n;
 }
+#endif
 
 
-void TcpSocket::Send(const std::string& str, int i)
+#ifdef LINUX
+int TcpSocket::TrySendfile(int fd, off_t offset, size_t len)
 {
-    SendBuf(str.c_str(), str.size(), i);
-}
-
-
-void TcpSocket::SendBuf(const char *buf, size_t len, int)
+    off_t off = offset;
+    int n = (int)sendfile(GetSocket(), fd, &off, len);
+    if (n == -1)
+    {
+        if (Errno != EWOULDBLOCK)
+        {
+            Handler().LogError(this, "sendfile", Errno, StrError(Errno), LOG_LEVEL_FATAL);
+            OnDisconnect();
+            OnDisconnect(TCP_DISCONNECT_WRITE | TCP_DISCONNECT_ERROR, Errno);
+            SetCloseAndDelete(true);
+            SetFlushBeforeClose(false);
+            SetLost();
+        }
+        return 0;
+    }
+    if (!n)
+    {
+        Handler().LogError(this, "sendfile", 0, "Unexpected end of file", LOG_LEVEL_FATAL);
+        SetCloseAndDelete(true);
+        SetFlushBeforeClose(false);
+        return 0;
+    }
+    m_bytes_sent += n;
+    if (GetTrafficMonitor())
+    {
+        // the data never passed through user space, read it back for the monitor
+        char buf[TCP_BUFSIZE_READ];
+        size_t left = n;
+        off = offset;
+        while (left)
+        {
+            int r = (int)pread(fd, buf, left < sizeof(buf) ? left : sizeof(buf), off);
+            if (r <= 0)
+                break;
+            GetTrafficMonitor() -> fwrite(buf, 1, r);
+            left -= r;
+            off += r;
+        }
+    }
+    if (TrafficCaptured())
+    {
+        // only the head of the region is read back, the capture truncates anyway
+        char buf[TCP_BUFSIZE_READ];
+        int r = (int)pread(fd, buf, (size_t)n < sizeof(buf) ? n : sizeof(buf), offset);
+        CaptureTraffic(true, buf, r > 0 ? r : 0, n);
+    }
+    return n;
+}
+#endif
+
+
+#ifndef _WIN32
+bool TcpSocket::ReadFileOutput()
+{
+    OUTPUT *p = m_obuf.front();
+    size_t sz = p -> Len() < TCP_OUTPUT_CAPACITY ? p -> Len() : TCP_OUTPUT_CAPACITY;
+    OUTPUT *blk = new OUTPUT;
+    int n = (int)pread(p -> _fd, blk -> _buf, sz, (off_t)p -> _b);
+    if (n <= 0)
+    {
+        delete blk;
+        if (n)
+            Handler().LogError(this, "pread", Errno, StrError(Errno), LOG_LEVEL_FATAL);
+        else
+            Handler().LogError(this, "pread", 0, "Unexpected end of file", LOG_LEVEL_FATAL);
+        SetCloseAndDelete(true);
+        SetFlushBeforeClose(false);
+        return false;
+    }
+    blk -> _t = n;
+    blk -> _q = n;
+    if (!p -> Remove(n))
+    {
+        if (p == m_obuf_top)
+        {
+            m_obuf_top = blk;
+        }
+        delete p;
+        m_obuf.pop_front();
+    }
+    m_obuf.push_front(blk);
+    return true;
+}
+#endif
+
+
+void TcpSocket::Buffer(const char *buf, size_t len)
+{
+    size_t ptr = 0;
+    m_output_length += len;
+    while (ptr < len)
+    {
+        // buf/len => pbuf/sz
+        size_t space = 0;
+        if ((space = m_obuf_top ? m_obuf_top -> Space() : 0) > 0)
+        {
+            const char *pbuf = buf + ptr;
+            size_t sz = len - ptr;
+            if (space >= sz)
+            {
+                m_obuf_top -> Add(pbuf, sz);
+                ptr += sz;
+            }
+            else
+            {
+                m_obuf_top -> Add(pbuf, space);
+                ptr += space;
+            }
+        }
+        else
+        {
+            m_obuf_top = new OUTPUT;
+            m_obuf.push_back( m_obuf_top );
+        }
+    }
+    CheckWatermarks();
+}
+
+
+void TcpSocket::BufferShared(const SharedBuffer& buf, size_t offset)
+{
+    m_output_length += buf.Len() - offset;
+    // a shared segment has no space, so the next Buffer call starts a new block
+    m_obuf_top = new OUTPUT(buf, offset);
+    m_obuf.push_back( m_obuf_top );
+    CheckWatermarks();
+}
+
+
+#ifndef _WIN32
+void TcpSocket::BufferFile(int fd, off_t offset, size_t len)
+{
+    m_output_length += len;
+    // a file region has no space, so the next Buffer call starts a new block
+    m_obuf_top = new OUTPUT(fd, offset, len);
+    m_obuf.push_back( m_obuf_top );
+    CheckWatermarks();
+}
+#endif
+
+
+char *TcpSocket::ReserveOutput(size_t len, size_t& space)
+{
+    if (len > TCP_OUTPUT_CAPACITY)
+    {
+        len = TCP_OUTPUT_CAPACITY;
+    }
+    if (!m_obuf_top || m_obuf_top -> Space() < len)
+    {
+        m_obuf_top = new OUTPUT;
+        m_obuf.push_back( m_obuf_top );
+    }
+    space = m_obuf_top -> Space();
+    return m_obuf_top -> _buf + m_obuf_top -> _t;
+}
+
+
+void TcpSocket::CommitOutput(size_t n)
+{
+    if (!n)
+    {
+        // nothing written, an empty block would stall the output queue
+        if (m_obuf_top && !m_obuf_top -> Len())
+        {
+            delete m_obuf_top;
+            m_obuf.pop_back();
+            m_obuf_top = m_obuf.empty() ? NULL : m_obuf.back();
+        }
+        return;
+    }
+    m_obuf_top -> _t += n;
+    m_obuf_top -> _q += n;
+    m_output_length += n;
+    CheckWatermarks();
+}
+
+
+void TcpSocket::SendOutput()
+{
+    if (!GetOutputLength() || !IsConnected())
+    {
+        // not connected yet - will be sent on connect
+        return;
+    }
+    if (m_b_coalesce)
+    {
+        ScheduleFlush();
+        return;
+    }
+    SendFromOutputBuffer();
+}
+
+
+void TcpSocket::Send(const std::string& str, int i)
+{
+    SendBuf(str.c_str(), str.size(), i);
+}
+
+
+void TcpSocket::SendBuf(const char *buf, size_t len, int)
 {
     if (!Ready() && !Connecting())
     {
@@ -878,14 +1561,26 @@ void TcpSocket::SendBuf(const char *buf, size_t len, int)
         Buffer(buf, len);
         return;
     }
+    if (m_b_coalesce)
+    {
+        Buffer(buf, len);
+        ScheduleFlush();
+        return;
+    }
 #ifdef HAVE_OPENSSL
-    if (IsSSL())
+    if (SslWrite())
     {
         Buffer(buf, len);
         SendFromOutputBuffer();
         return;
     }
 #endif
+    if (OutputLimited())
+    {
+        Buffer(buf, len);
+        SendFromOutputBuffer();
+        return;
+    }
     int n = TryWrite(buf, len);
     if (n >= 0 && n < (int)len)
     {
@@ -900,13 +1595,133 @@ void TcpSocket::SendBuf(const char *buf, size_t len, int)
     // if any data is unsent, buffer it and set m_wfds
 
     // check output buffer set, set/reset m_wfds accordingly
+    ModifyEvents();
+}
+
+
+void TcpSocket::SendShared(const SharedBuffer& buf)
+{
+    if (!Ready() && !Connecting())
     {
-        bool br = !IsDisableRead();
-        if (m_obuf.size())
-            Handler().ISocketHandler_Mod(this, br, true);
-        else
-            Handler().ISocketHandler_Mod(this, br, false);
+        Handler().LogError(this, "SendShared", -1, "Attempt to write to a non-ready socket" ); // warning
+        return;
+    }
+    if (buf.Empty())
+    {
+        return;
+    }
+    if (!IsConnected())
+    {
+        Handler().LogError(this, "SendShared", -1, "Attempt to write to a non-connected socket, will be sent on connect" ); // warning
+        BufferShared(buf, 0);
+        return;
+    }
+    if (m_obuf_top)
+    {
+        BufferShared(buf, 0);
+        return;
+    }
+    if (m_b_coalesce)
+    {
+        BufferShared(buf, 0);
+        ScheduleFlush();
+        return;
+    }
+#ifdef HAVE_OPENSSL
+    if (SslWrite())
+    {
+        BufferShared(buf, 0);
+        SendFromOutputBuffer();
+        return;
+    }
+#endif
+    if (OutputLimited() || (m_b_zerocopy && buf.Len() >= m_zerocopy_threshold))
+    {
+        BufferShared(buf, 0);
+        SendFromOutputBuffer();
+        return;
+    }
+    int n = TryWrite(buf.Data(), buf.Len());
+    if (n >= 0 && n < (int)buf.Len())
+    {
+        BufferShared(buf, n);
+    }
+
+    // check output buffer set, set/reset m_wfds accordingly
+    ModifyEvents();
+}
+
+
+#ifndef _WIN32
+bool TcpSocket::SendFile(int fd, off_t offset, size_t length)
+{
+    if (!Ready() && !Connecting())
+    {
+        Handler().LogError(this, "SendFile", -1, "Attempt to write to a non-ready socket" ); // warning
+        return false;
+    }
+    if (!length)
+    {
+        return true;
+    }
+    int fd_dup = dup(fd);
+    if (fd_dup == -1)
+    {
+        Handler().LogError(this, "SendFile/dup", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+        return false;
+    }
+    bool queued = m_obuf_top != NULL;
+    BufferFile(fd_dup, offset, length);
+    if (!IsConnected())
+    {
+        Handler().LogError(this, "SendFile", -1, "Attempt to write to a non-connected socket, will be sent on connect" ); // warning
+        return true;
+    }
+    if (queued)
+    {
+        return true;
+    }
+    if (m_b_coalesce)
+    {
+        ScheduleFlush();
+        return true;
+    }
+    SendFromOutputBuffer();
+    return true;
+}
+#endif
+
+
+void TcpSocket::SetSendCoalescing(bool x)
+{
+    m_b_coalesce = x;
+}
+
+
+bool TcpSocket::SendCoalescing()
+{
+    return m_b_coalesce;
+}
+
+
+void TcpSocket::ScheduleFlush()
+{
+    if (!m_b_flush_pending)
+    {
+        m_b_flush_pending = true;
+        Handler().AddFlush(this);
+    }
+}
+
+
+void TcpSocket::Flush()
+{
+    m_b_flush_pending = false;
+    if (GetSocket() == INVALID_SOCKET || !IsConnected() || m_obuf.empty())
+    {
+        return;
     }
+    SendFromOutputBuffer();
 }
 
 
@@ -1045,12 +1860,42 @@ bool TcpSocket::OnSocks4Read()
 
 void TcpSocket::Sendf(const char *format, ...)
 {
+    if (!Ready() && !Connecting())
+    {
+        Handler().LogError(this, "Sendf", -1, "Attempt to write to a non-ready socket" ); // warning
+        return;
+    }
+    if (!IsConnected())
+    {
+        Handler().LogError(this, "Sendf", -1, "Attempt to write to a non-connected socket, will be sent on connect" ); // warning
+    }
     va_list ap;
+    va_list ap2;
     va_start(ap, format);
-    char slask[5000]; // vsprintf / vsnprintf temporary
-    vsnprintf(slask, sizeof(slask), format, ap);
+    va_copy(ap2, ap);
+    size_t space;
+    char *p = ReserveOutput(1, space);
+    int n = vsnprintf(p, space, format, ap);
+    if (n >= 0 && (size_t)n >= space)
+    {
+        if ((size_t)n < TCP_OUTPUT_CAPACITY)
+        {
+            // retry in a block with room for the whole string and terminator
+            p = ReserveOutput(n + 1, space);
+            vsnprintf(p, space, format, ap2);
+        }
+        else
+        {
+            std::string str(n, 0);
+            vsnprintf(&str[0], n + 1, format, ap2);
+            Buffer(str.c_str(), n);
+            n = 0;
+        }
+    }
+    va_end(ap2);
     va_end(ap);
-    Send( slask );
+    CommitOutput(n > 0 ? n : 0);
+    SendOutput();
 }
 
 
@@ -1058,6 +1903,20 @@ void TcpSocket::Sendf(const char *format, ...)
 void TcpSocket::OnSSLConnect()
 {
     SetNonblocking(true);
+#ifdef ENABLE_POOL
+    if (m_ssl)
+    {
+        // reused from the connection pool
+        CheckKtls();
+        SetConnected();
+        if (GetOutputLength())
+        {
+            OnWrite();
+        }
+        OnConnect();
+        return;
+    }
+#endif
     {
         if (m_ssl_ctx)
         {
@@ -1085,6 +1944,19 @@ void TcpSocket::OnSSLConnect()
             return;
         }
         SSL_set_bio(m_ssl, m_sbio, m_sbio);
+        // output may be gathered into a record buffer when SSL_write is repeated
+        SSL_set_mode(m_ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+        if (m_b_ktls)
+        {
+            SSL_set_options(m_ssl, SSL_OP_ENABLE_KTLS);
+        }
+#endif
+        if (m_ssl_session_key.empty())
+        {
+            m_ssl_session_key = GetRemoteAddress() + ":" + Utility::l2string(GetRemotePort());
+        }
+        SSLSessionCache::Instance().Attach(m_ssl, &m_ssl_session_key);
         if (!SSLNegotiate())
         {
             SetSSLNegotiate();
@@ -1127,6 +1999,14 @@ void TcpSocket::OnSSLAccept()
             return;
         }
         SSL_set_bio(m_ssl, m_sbio, m_sbio);
+        // output may be gathered into a record buffer when SSL_write is repeated
+        SSL_set_mode(m_ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+        if (m_b_ktls)
+        {
+            SSL_set_options(m_ssl, SSL_OP_ENABLE_KTLS);
+        }
+#endif
         //      if (!SSLNegotiate())
         {
             SetSSLNegotiate();
@@ -1135,20 +2015,92 @@ void TcpSocket::OnSSLAccept()
 }
 
 
-bool TcpSocket::SSLNegotiate()
+void TcpSocket::SetKtls(bool x)
 {
-    if (!IsSSLServer()) // client
-    {
-        int r = SSL_connect(m_ssl);
-        if (r > 0)
-        {
-            SetSSLNegotiate(false);
-            /// \todo: resurrect certificate check... client
-            //          CheckCertificateChain( "");//ServerHOST);
-            SetConnected();
-            if (GetOutputLength())
-            {
-                OnWrite();
+    m_b_ktls = x;
+}
+
+
+bool TcpSocket::Ktls()
+{
+    return m_b_ktls;
+}
+
+
+bool TcpSocket::KtlsSend()
+{
+    return m_b_ktls_send;
+}
+
+
+void TcpSocket::SetSslSessionKey(const std::string& key)
+{
+    m_ssl_session_key = key;
+}
+
+
+const std::string& TcpSocket::GetSslSessionKey()
+{
+    return m_ssl_session_key;
+}
+
+
+bool TcpSocket::SslWrite()
+{
+    return IsSSL() && !m_b_ktls_send;
+}
+
+
+void TcpSocket::CheckKtls()
+{
+#ifdef BIO_get_ktls_send
+    m_b_ktls_send = m_b_ktls && BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+#endif
+    if (m_b_ktls_send)
+    {
+        // the tls ulp does not take MSG_ZEROCOPY
+        m_b_zerocopy = false;
+        Handler().LogError(this, "SSLNegotiate", 0, "kernel tls send offload enabled", LOG_LEVEL_INFO);
+    }
+    else if (m_b_ktls)
+    {
+        Handler().LogError(this, "SSLNegotiate", 0, "kernel tls not available for this connection, using SSL_write", LOG_LEVEL_INFO);
+    }
+}
+
+
+bool TcpSocket::SSLNegotiate()
+{
+    if (m_b_ssl_offload)
+    {
+        // private key operations run in the SSLHandshakePool, OnSSLHandshake continues
+        if (!m_b_ssl_handshake)
+        {
+            m_b_ssl_handshake = true;
+            Handler().AddSSLHandshake(this, m_ssl, IsSSLServer());
+        }
+        return false;
+    }
+    int r = IsSSLServer() ? SSL_accept(m_ssl) : SSL_connect(m_ssl);
+    return SSLNegotiate(r, r > 0 ? SSL_ERROR_NONE : SSL_get_error(m_ssl, r));
+}
+
+
+bool TcpSocket::SSLNegotiate(int r, int err)
+{
+    if (!IsSSLServer()) // client
+    {
+        if (r > 0)
+        {
+            SetSSLNegotiate(false);
+            CheckKtls();
+            SSLSessionCache::Instance().Handshake(m_ssl, false);
+            /// \todo: resurrect certificate check... client
+            //          CheckCertificateChain( "");//ServerHOST);
+            SetConnected();
+            if (GetOutputLength())
+            {
+                OnWrite();
             }
 #ifdef ENABLE_RECONNECT
             if (IsReconnect())
@@ -1172,11 +2124,10 @@ bool TcpSocket::SSLNegotiate()
         }
         else
         {
-            r = SSL_get_error(m_ssl, r);
-            if (r != SSL_ERROR_WANT_READ && r != SSL_ERROR_WANT_WRITE)
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
             {
                 Handler().LogError(this, "SSLNegotiate/SSL_connect", -1, "Connection failed", LOG_LEVEL_INFO);
-                DEB(                fprintf(stderr, "SSL_connect() failed - closing socket, return code: %d\n", r);)
+                DEB(                fprintf(stderr, "SSL_connect() failed - closing socket, return code: %d\n", err);)
                 SetSSLNegotiate(false);
                 SetCloseAndDelete(true);
                 OnSSLConnectFailed();
@@ -1185,10 +2136,11 @@ bool TcpSocket::SSLNegotiate()
     }
     else // server
     {
-        int r = SSL_accept(m_ssl);
         if (r > 0)
         {
             SetSSLNegotiate(false);
+            CheckKtls();
+            SSLSessionCache::Instance().Handshake(m_ssl, true);
             /// \todo: resurrect certificate check... server
             //          CheckCertificateChain( "");//ClientHOST);
             SetConnected();
@@ -1209,11 +2161,10 @@ bool TcpSocket::SSLNegotiate()
         }
         else
         {
-            r = SSL_get_error(m_ssl, r);
-            if (r != SSL_ERROR_WANT_READ && r != SSL_ERROR_WANT_WRITE)
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
             {
                 Handler().LogError(this, "SSLNegotiate/SSL_accept", -1, "Connection failed", LOG_LEVEL_INFO);
-                DEB(                fprintf(stderr, "SSL_accept() failed - closing socket, return code: %d\n", r);)
+                DEB(                fprintf(stderr, "SSL_accept() failed - closing socket, return code: %d\n", err);)
                 SetSSLNegotiate(false);
                 SetCloseAndDelete(true);
                 OnSSLAcceptFailed();
@@ -1224,6 +2175,27 @@ bool TcpSocket::SSLNegotiate()
 }
 
 
+void TcpSocket::OnSSLHandshake(int r, int err)
+{
+    m_b_ssl_handshake = false;
+    // monitored again, as before the step
+    Handler().ISocketHandler_Mod(this, true, err == SSL_ERROR_WANT_WRITE);
+    SSLNegotiate(r, err);
+}
+
+
+void TcpSocket::SetSslOffload(bool x)
+{
+    m_b_ssl_offload = x;
+}
+
+
+bool TcpSocket::SslOffload()
+{
+    return m_b_ssl_offload;
+}
+
+
 void TcpSocket::InitSSLClient()
 {
     InitializeContext("", SSLv23_method());
@@ -1242,11 +2214,14 @@ void TcpSocket::InitializeContext(const std::string& context, const SSL_METHOD *
     static Mutex mutex;
     Lock lock(mutex);
     /* Create our context*/
+    m_ssl_context = context;
     if (m_client_contexts.find(context) == m_client_contexts.end())
     {
         const SSL_METHOD *meth = meth_in ? meth_in : SSLv3_method();
         m_ssl_ctx = m_client_contexts[context] = SSL_CTX_new(const_cast<SSL_METHOD *>(meth));
         SSL_CTX_set_mode(m_ssl_ctx, SSL_MODE_AUTO_RETRY | SSL_MODE_ENABLE_PARTIAL_WRITE);
+        // the map key lives as long as the context
+        SSLSessionCache::Instance().InitClientContext(m_ssl_ctx, &m_client_contexts.find(context) -> first);
     }
     else
     {
@@ -1309,6 +2284,7 @@ void TcpSocket::InitializeContext(const std::string& context, const std::string&
             SSL_CTX_set_session_id_context(m_ssl_ctx, (const unsigned char *)context.c_str(), (unsigned int)context.size());
         else
             SSL_CTX_set_session_id_context(m_ssl_ctx, (const unsigned char *)"--empty--", 9);
+        SSLSessionCache::Instance().InitServerContext(m_ssl_ctx);
     }
     else
     {
@@ -1367,7 +2343,23 @@ int TcpSocket::Close()
         return 0;
     }
     int n;
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    HappyEyeballsStop();
+#endif
+    RelayUnlink();
     SetNonblocking(true);
+#ifdef HAVE_OPENSSL
+    if (m_b_ssl_handshake)
+    {
+        // the pool must be done with m_ssl
+        SSLHandshakePool::Instance().Cancel(m_ssl);
+        m_b_ssl_handshake = false;
+    }
+    // close_notify before the tcp shutdown, the session of a truncated
+    // connection is not resumed
+    if (IsSSL() && m_ssl)
+        SSL_shutdown(m_ssl);
+#endif
     if (!Lost() && IsConnected() && !(GetShutdown() & SHUT_WR))
     {
         if (shutdown(GetSocket(), SHUT_WR) == -1)
@@ -1386,8 +2378,6 @@ int TcpSocket::Close()
         }
     }
 #ifdef HAVE_OPENSSL
-    if (IsSSL() && m_ssl)
-        SSL_shutdown(m_ssl);
     if (m_ssl)
     {
         SSL_free(m_ssl);
@@ -1412,6 +2402,27 @@ SSL *TcpSocket::GetSsl()
         Handler().LogError(this, "GetSsl", 0, "SSL is NULL; check InitSSLServer/InitSSLClient", LOG_LEVEL_WARNING);
     return m_ssl;
 }
+
+
+#ifdef ENABLE_POOL
+SSL *TcpSocket::ReleaseSsl()
+{
+    SSL *ssl = m_ssl;
+    if (ssl)
+    {
+        SSLSessionCache::Instance().SetKey(ssl, NULL);
+    }
+    m_ssl = NULL;
+    m_sbio = NULL;
+    return ssl;
+}
+
+
+std::string TcpSocket::GetPoolIdentity()
+{
+    return m_ssl_context + "|" + m_ssl_session_key;
+}
+#endif
 #endif
 
 
@@ -1543,6 +2554,47 @@ bool TcpSocket::SetTcpNodelay(bool x)
 }
 
 
+void TcpSocket::SetTcpFastOpen(bool x)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+    m_b_fastopen = x;
+#else
+    Handler().LogError(this, "socket option not available", 0, "TCP_FASTOPEN_CONNECT", LOG_LEVEL_INFO);
+#endif
+}
+
+
+bool TcpSocket::TcpFastOpen()
+{
+    return m_b_fastopen;
+}
+
+
+void TcpSocket::FastOpenConnect()
+{
+    if (!m_b_fastopen_deferred)
+    {
+        return;
+    }
+    m_b_fastopen_deferred = false;
+    if (m_bytes_sent || !m_obuf.empty())
+    {
+        // write already attempted, SYN is on its way
+        return;
+    }
+    // nothing to carry in the SYN, an empty write starts the handshake
+    if (send(GetSocket(), "", 0, MSG_NOSIGNAL) == -1 && Errno != EINPROGRESS)
+    {
+        Handler().LogError(this, "FastOpenConnect", Errno, StrError(Errno), LOG_LEVEL_FATAL);
+        OnDisconnect();
+        OnDisconnect(TCP_DISCONNECT_WRITE | TCP_DISCONNECT_ERROR, Errno);
+        SetCloseAndDelete(true);
+        SetFlushBeforeClose(false);
+        SetLost();
+    }
+}
+
+
 TcpSocket::CircularBuffer::CircularBuffer(size_t size)
     : buf(new char[2 * size])
     , m_max(size)
@@ -1685,6 +2737,9 @@ std::string TcpSocket::CircularBuffer::ReadString(size_t l)
 
 void TcpSocket::OnConnectTimeout()
 {
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    HappyEyeballsStop();
+#endif
     Handler().LogError(this, "connect", -1, "connect timeout", LOG_LEVEL_FATAL);
 #ifdef ENABLE_SOCKS4
     if (Socks4())
@@ -1694,7 +2749,16 @@ void TcpSocket::OnConnectTimeout()
     }
     else
 #endif
-        if (GetConnectionRetry() == -1 ||
+        if (m_retry_policy.Enabled())
+        {
+            if (!ScheduleRetry())
+            {
+                SetCloseAndDelete(true);
+                OnConnectFailed();
+                SetConnecting(false);
+            }
+        }
+        else if (GetConnectionRetry() == -1 ||
             (GetConnectionRetry() && GetConnectionRetries() < GetConnectionRetry()) )
         {
             IncreaseConnectionRetries();
@@ -1723,6 +2787,83 @@ void TcpSocket::OnConnectTimeout()
 }
 
 
+void TcpSocket::SetRetryPolicy(const RetryPolicy& x)
+{
+    m_retry_policy = x;
+}
+
+
+const RetryPolicy& TcpSocket::GetRetryPolicy()
+{
+    return m_retry_policy;
+}
+
+
+bool TcpSocket::ScheduleRetry()
+{
+    if (!m_retry_policy.Retry(GetConnectionRetries()))
+    {
+        return false;
+    }
+    long usec = m_retry_policy.Delay(GetConnectionRetries());
+    IncreaseConnectionRetries();
+    SetConnecting(false);
+    if (GetSocket() != INVALID_SOCKET)
+    {
+        // no monitoring of the failed connection while waiting
+        Handler().ISocketHandler_Del(this);
+    }
+    m_b_retry_pending = true;
+    Handler().AddTimer(this, usec, TCP_TIMER_RETRY);
+    return true;
+}
+
+
+bool TcpSocket::RetryPending()
+{
+    return m_b_retry_pending;
+}
+
+
+void TcpSocket::SetTcpInfoInterval(long usec)
+{
+    m_tcpinfo_interval = usec > 0 ? usec : 0;
+    if (m_tcpinfo_interval)
+    {
+        if (!m_tcpinfo)
+            m_tcpinfo.reset(new TcpInfoHistory);
+        Handler().AddTcpInfo(this, m_tcpinfo_interval);
+    }
+    else
+    {
+        Handler().RemoveTcpInfo(this);
+    }
+}
+
+
+long TcpSocket::TcpInfoInterval()
+{
+    return m_tcpinfo_interval;
+}
+
+
+const TcpInfoHistory *TcpSocket::GetTcpInfoHistory()
+{
+    return m_tcpinfo.get();
+}
+
+
+bool TcpSocket::SampleTcpInfo(TcpInfoSample& sample)
+{
+    if (!m_tcpinfo || GetSocket() == INVALID_SOCKET || Connecting() || !sample.Read(GetSocket()))
+    {
+        return false;
+    }
+    m_tcpinfo -> Add(sample);
+    return true;
+}
+
+
 #ifdef _WIN32
 void TcpSocket::OnException()
 {
@@ -1773,37 +2914,997 @@ void TcpSocket::OnTransferLimit()
 {
 }
 
-TcpSocket::OUTPUT::OUTPUT() : _b(0), _t(0), _q(0)
+void TcpSocket::SetOutputWatermarks(size_t low, size_t high)
 {
+    m_output_low = low < high ? low : high;
+    m_output_high = high;
+    CheckWatermarks();
 }
 
-TcpSocket::OUTPUT::OUTPUT(const char *buf, size_t len) : _b(0), _t(len), _q(len)
+bool TcpSocket::IsBackpressure()
 {
-    memcpy(_buf, buf, len);
+    return m_b_backpressure;
 }
 
-size_t TcpSocket::OUTPUT::Space()
+void TcpSocket::OnBackpressure()
 {
-    return TCP_OUTPUT_CAPACITY - _t;
 }
 
-void TcpSocket::OUTPUT::Add(const char *buf, size_t len)
+void TcpSocket::OnWritable()
 {
-    memcpy(_buf + _t, buf, len);
-    _t += len;
-    _q += len;
 }
 
-size_t TcpSocket::OUTPUT::Remove(size_t len)
+void TcpSocket::CheckWatermarks()
 {
-    _b += len;
-    _q -= len;
-    return _q;
+    if (!m_b_backpressure && m_output_high && m_output_length > m_output_high)
+    {
+        m_b_backpressure = true;
+        if (m_upstream)
+        {
+            m_upstream -> PauseRead();
+        }
+        OnBackpressure();
+    }
+    else if (m_b_backpressure && (!m_output_high || m_output_length <= m_output_low))
+    {
+        m_b_backpressure = false;
+        if (m_upstream)
+        {
+            m_upstream -> ResumeRead();
+        }
+        OnWritable();
+    }
 }
 
-const char *TcpSocket::OUTPUT::Buf()
+void TcpSocket::SetUpstream(TcpSocket *p)
+{
+    if (m_upstream)
+    {
+        if (m_b_backpressure)
+        {
+            m_upstream -> ResumeRead();
+        }
+        m_upstream -> m_downstream.remove(this);
+    }
+    m_upstream = p;
+    if (m_upstream)
+    {
+        m_upstream -> m_downstream.push_back(this);
+        if (m_b_backpressure)
+        {
+            m_upstream -> PauseRead();
+        }
+    }
+}
+
+void TcpSocket::ModifyEvents()
+{
+    bool br = !IsDisableRead() && !m_read_paused && !m_b_input_throttled;
+    bool bw = !m_obuf.empty() && !m_b_output_throttled;
+    if (m_relay)
+    {
+        br = br && !m_b_relay_eof && m_relay_pending < m_relay_pipe_size;
+        bw = bw || (m_relay -> m_relay_pending && !m_b_output_throttled);
+    }
+    Handler().ISocketHandler_Mod(this, br, bw);
+}
+
+bool TcpSocket::OutputLimited()
+{
+    return OutputRateLimit().Enabled() || Handler().OutputRateLimit().Enabled();
+}
+
+size_t TcpSocket::InputAllowance(size_t max)
+{
+    if (m_b_input_throttled)
+    {
+        return 0;
+    }
+    uint64_t a = InputRateLimit().Available();
+    uint64_t b = Handler().InputRateLimit().Available();
+    if (a < max)
+        max = (size_t)a;
+    if (b < max)
+        max = (size_t)b;
+    return max;
+}
+
+size_t TcpSocket::OutputAllowance()
+{
+    if (m_b_output_throttled)
+    {
+        return 0;
+    }
+    size_t max = (size_t)-1;
+    uint64_t a = OutputRateLimit().Available();
+    uint64_t b = Handler().OutputRateLimit().Available();
+    if (a < max)
+        max = (size_t)a;
+    if (b < max)
+        max = (size_t)b;
+    return max;
+}
+
+void TcpSocket::ConsumeInput(size_t n)
+{
+    InputRateLimit().Consume(n);
+    Handler().InputRateLimit().Consume(n);
+}
+
+void TcpSocket::ConsumeOutput(size_t n)
+{
+    OutputRateLimit().Consume(n);
+    Handler().OutputRateLimit().Consume(n);
+}
+
+void TcpSocket::ThrottleInput()
+{
+    if (m_b_input_throttled)
+    {
+        return;
+    }
+    // wait for enough tokens for a full read
+    long a = InputRateLimit().TimeUntilAvailable(TCP_BUFSIZE_READ);
+    long b = Handler().InputRateLimit().TimeUntilAvailable(TCP_BUFSIZE_READ);
+    m_b_input_throttled = true;
+    m_input_throttle_start = EventTime::Tick();
+    ModifyEvents();
+    Handler().AddTimer(this, a > b ? a : b, TCP_TIMER_INPUT_LIMIT);
+}
+
+void TcpSocket::ThrottleOutput()
+{
+    if (m_b_output_throttled)
+    {
+        return;
+    }
+    size_t sz = m_output_length < TCP_BUFSIZE_READ ? m_output_length : TCP_BUFSIZE_READ;
+    long a = OutputRateLimit().TimeUntilAvailable(sz);
+    long b = Handler().OutputRateLimit().TimeUntilAvailable(sz);
+    m_b_output_throttled = true;
+    m_output_throttle_start = EventTime::Tick();
+    Handler().AddTimer(this, a > b ? a : b, TCP_TIMER_OUTPUT_LIMIT);
+}
+
+void TcpSocket::OnInternalTimer(int id)
 {
-    return _buf + _b;
+    switch (id)
+    {
+        case TCP_TIMER_INPUT_LIMIT:
+            if (m_b_input_throttled)
+            {
+                m_b_input_throttled = false;
+                m_input_throttle_time += EventTime::Tick() - m_input_throttle_start;
+                if (GetSocket() != INVALID_SOCKET && !Connecting())
+                {
+                    ModifyEvents();
+                }
+            }
+            break;
+        case TCP_TIMER_OUTPUT_LIMIT:
+            if (m_b_output_throttled)
+            {
+                m_b_output_throttled = false;
+                m_output_throttle_time += EventTime::Tick() - m_output_throttle_start;
+                if (GetSocket() != INVALID_SOCKET && IsConnected() && !m_obuf.empty())
+                {
+                    SendFromOutputBuffer();
+                }
+            }
+            break;
+        case TCP_TIMER_RETRY:
+            if (m_b_retry_pending)
+            {
+                m_b_retry_pending = false;
+                // the sockethandler reopens the connection
+                if (OnConnectRetry())
+                {
+                    SetRetryClientConnect();
+                }
+                else
+                {
+                    SetCloseAndDelete();
+                    OnConnectFailed();
+                }
+            }
+            break;
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+        case TCP_TIMER_HE_ATTEMPT:
+        case TCP_TIMER_HE_RESOLUTION:
+            if (m_b_he_racing)
+            {
+                HappyEyeballsNext();
+                HappyEyeballsCheck();
+            }
+            break;
+#endif
+    }
+}
+
+uint64_t TcpSocket::GetInputThrottleTime(bool clear)
+{
+    uint64_t z = m_input_throttle_time;
+    if (m_b_input_throttled)
+        z += EventTime::Tick() - m_input_throttle_start;
+    if (clear)
+    {
+        m_input_throttle_time = 0;
+        m_input_throttle_start = EventTime::Tick();
+    }
+    return z;
+}
+
+uint64_t TcpSocket::GetOutputThrottleTime(bool clear)
+{
+    uint64_t z = m_output_throttle_time;
+    if (m_b_output_throttled)
+        z += EventTime::Tick() - m_output_throttle_start;
+    if (clear)
+    {
+        m_output_throttle_time = 0;
+        m_output_throttle_start = EventTime::Tick();
+    }
+    return z;
+}
+
+void TcpSocket::SetZeroCopy(bool x, size_t threshold)
+{
+#ifdef LINUX
+    m_b_zerocopy = x;
+    m_zerocopy_threshold = threshold;
+#else
+    Handler().LogError(this, "SetZeroCopy", 0, "MSG_ZEROCOPY not available", LOG_LEVEL_INFO);
+#endif
+}
+
+
+bool TcpSocket::ZeroCopy()
+{
+    return m_b_zerocopy;
+}
+
+
+size_t TcpSocket::GetZeroCopyPending()
+{
+    return m_zc_pending.size();
+}
+
+
+#ifdef LINUX
+bool TcpSocket::PrepareZeroCopy()
+{
+    if (m_zerocopy_socket == GetSocket())
+    {
+        return true;
+    }
+    // new connection, completions for the previous one will not arrive
+    while (!m_zc_pending.empty())
+    {
+        delete m_zc_pending.front();
+        m_zc_pending.pop_front();
+    }
+    m_zc_ranges.clear();
+    m_zc_next = 0;
+    m_zc_done = 0;
+    int optval = 1;
+    if (setsockopt(GetSocket(), SOL_SOCKET, SO_ZEROCOPY, (char *)&optval, sizeof(optval)) == -1)
+    {
+        Handler().LogError(this, "setsockopt(SOL_SOCKET, SO_ZEROCOPY)", Errno, StrError(Errno), LOG_LEVEL_WARNING);
+        m_b_zerocopy = false;
+        return false;
+    }
+    m_zerocopy_socket = GetSocket();
+    return true;
+}
+
+
+void TcpSocket::MarkZeroCopy(size_t len)
+{
+    for (output_l::iterator it = m_obuf.begin(); it != m_obuf.end() && len; ++it)
+    {
+        OUTPUT *p = *it;
+        size_t sz = p -> Len() < len ? p -> Len() : len;
+        p -> _zc = true;
+        p -> _zc_seq = m_zc_next;
+        len -= sz;
+    }
+    m_zc_next++;
+}
+
+
+bool TcpSocket::ReadZeroCopyCompletions()
+{
+    bool got = false;
+    while (true)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(GetSocket(), &msg, MSG_ERRQUEUE) == -1)
+        {
+            break;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm -> cmsg_level == SOL_IP && cm -> cmsg_type == IP_RECVERR) &&
+                !(cm -> cmsg_level == IPPROTO_IPV6 && cm -> cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee -> ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee -> ee_errno)
+            {
+                continue;
+            }
+            if ((ee -> ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && m_b_zerocopy)
+            {
+                // e.g. loopback, pinning pages only costs here
+                Handler().LogError(this, "ReadZeroCopyCompletions", 0, "kernel copied zero-copy data, disabling", LOG_LEVEL_INFO);
+                m_b_zerocopy = false;
+            }
+            m_zc_ranges[ee -> ee_info] = ee -> ee_data;
+            got = true;
+        }
+    }
+    std::map<uint32_t, uint32_t>::iterator it;
+    while ((it = m_zc_ranges.find(m_zc_done)) != m_zc_ranges.end())
+    {
+        m_zc_done = it -> second + 1;
+        m_zc_ranges.erase(it);
+    }
+    ReleaseZeroCopy();
+    return got;
+}
+
+
+void TcpSocket::ReleaseZeroCopy()
+{
+    while (!m_zc_pending.empty() && (int32_t)(m_zc_pending.front() -> _zc_seq - m_zc_done) < 0)
+    {
+        delete m_zc_pending.front();
+        m_zc_pending.pop_front();
+    }
+}
+
+
+void TcpSocket::OnException()
+{
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+    if (m_b_he_racing && m_b_he_own_failed)
+    {
+        // failed connect already handled in OnWrite
+        return;
+    }
+#endif
+    if (m_b_retry_pending)
+    {
+        return;
+    }
+    if (m_zerocopy_socket != INVALID_SOCKET && m_zerocopy_socket == GetSocket())
+    {
+        ReadZeroCopyCompletions();
+        int err = SoError();
+        if (!err)
+        {
+            return;
+        }
+        Handler().LogError(this, "exception on select", err, StrError(err), LOG_LEVEL_FATAL);
+        SetCloseAndDelete();
+        return;
+    }
+    Socket::OnException();
+}
+#endif
+
+
+bool TcpSocket::Relay(TcpSocket& peer)
+{
+#ifdef LINUX
+    if (m_relay || peer.m_relay || &peer == this)
+    {
+        Handler().LogError(this, "Relay", 0, "socket already relayed", LOG_LEVEL_ERROR);
+        return false;
+    }
+    if (!IsConnected() || !peer.IsConnected())
+    {
+        Handler().LogError(this, "Relay", 0, "socket not connected", LOG_LEVEL_ERROR);
+        return false;
+    }
+#ifdef HAVE_OPENSSL
+    if (IsSSL() || peer.IsSSL())
+    {
+        Handler().LogError(this, "Relay", 0, "can not relay ssl socket", LOG_LEVEL_ERROR);
+        return false;
+    }
+#endif
+    if (!RelayPipe() || !peer.RelayPipe())
+    {
+        RelayUnlink();
+        peer.RelayUnlink();
+        return false;
+    }
+    m_relay = &peer;
+    peer.m_relay = this;
+    ModifyEvents();
+    peer.ModifyEvents();
+    return true;
+#else
+    Handler().LogError(this, "Relay", 0, "splice not available", LOG_LEVEL_ERROR);
+    return false;
+#endif
+}
+
+
+TcpSocket *TcpSocket::GetRelay()
+{
+    return m_relay;
+}
+
+
+void TcpSocket::RelayUnlink()
+{
+    if (m_relay)
+    {
+        TcpSocket *peer = m_relay;
+        m_relay = NULL;
+        peer -> m_relay = NULL;
+        if (!peer -> CloseAndDelete())
+        {
+            peer -> SetCloseAndDelete();
+        }
+    }
+#ifndef _WIN32
+    for (int i = 0; i < 2; i++)
+    {
+        if (m_relay_pipe[i] != -1)
+        {
+            close(m_relay_pipe[i]);
+            m_relay_pipe[i] = -1;
+        }
+    }
+#endif
+    m_relay_pending = 0;
+}
+
+
+#ifdef LINUX
+bool TcpSocket::RelayPipe()
+{
+    if (pipe2(m_relay_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        Handler().LogError(this, "pipe2", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+        m_relay_pipe[0] = m_relay_pipe[1] = -1;
+        return false;
+    }
+    int sz = fcntl(m_relay_pipe[1], F_SETPIPE_SZ, TCP_RELAY_PIPE_SIZE);
+    if (sz == -1)
+    {
+        // limited by /proc/sys/fs/pipe-max-size, keep default size
+        sz = fcntl(m_relay_pipe[1], F_GETPIPE_SZ);
+    }
+    m_relay_pipe_size = sz > 0 ? sz : 65536;
+    m_relay_pending = 0;
+    m_b_relay_eof = false;
+    return true;
+}
+
+
+void TcpSocket::RelayRead()
+{
+    size_t space = m_relay_pipe_size - m_relay_pending;
+    if (space && !m_b_relay_eof)
+    {
+        int n = (int)splice(GetSocket(), NULL, m_relay_pipe[1], NULL, space, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1)
+        {
+            if (Errno != EWOULDBLOCK)
+            {
+                RelayError("splice", TCP_DISCONNECT_ERROR);
+                return;
+            }
+        }
+        else if (!n)
+        {
+            m_b_relay_eof = true;
+        }
+        else
+        {
+            m_relay_pending += n;
+            m_bytes_received += n;
+        }
+    }
+    m_relay -> RelayWrite();
+}
+
+
+void TcpSocket::RelayWrite()
+{
+    TcpSocket *src = m_relay;
+    while (src -> m_relay_pending && m_obuf.empty())
+    {
+        int n = (int)splice(src -> m_relay_pipe[0], NULL, GetSocket(), NULL, src -> m_relay_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == -1)
+        {
+            if (Errno != EWOULDBLOCK)
+            {
+                RelayError("splice", TCP_DISCONNECT_WRITE | TCP_DISCONNECT_ERROR);
+                return;
+            }
+            break;
+        }
+        src -> m_relay_pending -= n;
+        m_bytes_sent += n;
+    }
+    // half-close: pass end of stream on once the pipe is drained
+    if (src -> m_b_relay_eof && !src -> m_relay_pending && m_obuf.empty() && !(GetShutdown() & SHUT_WR))
+    {
+        if (shutdown(GetSocket(), SHUT_WR) == -1)
+        {
+            Handler().LogError(this, "shutdown", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+        }
+        SetShutdown(SHUT_WR);
+    }
+    if ((GetShutdown() & SHUT_WR) && (src -> GetShutdown() & SHUT_WR))
+    {
+        // both directions done
+        OnDisconnect();
+        OnDisconnect(0, 0);
+        src -> OnDisconnect();
+        src -> OnDisconnect(0, 0);
+        SetCloseAndDelete(true);
+        src -> SetCloseAndDelete(true);
+        return;
+    }
+    ModifyEvents();
+    src -> ModifyEvents();
+}
+
+
+void TcpSocket::RelayError(const char *msg, int flags)
+{
+    int err = Errno;
+    Handler().LogError(this, msg, err, StrError(err), LOG_LEVEL_FATAL);
+    OnDisconnect();
+    OnDisconnect(flags, err);
+    SetCloseAndDelete(true);
+    SetFlushBeforeClose(false);
+    SetLost();
+    RelayUnlink();
+}
+#endif
+
+
+void TcpSocket::PauseRead()
+{
+    if (!m_read_paused++)
+    {
+        if (GetSocket() != INVALID_SOCKET && !Connecting())
+        {
+            ModifyEvents();
+        }
+    }
+}
+
+bool TcpSocket::IsReadPaused() const
+{
+    return m_read_paused != 0;
+}
+
+void TcpSocket::ResumeRead()
+{
+    if (m_read_paused && !--m_read_paused)
+    {
+        if (GetSocket() != INVALID_SOCKET && !Connecting())
+        {
+            ModifyEvents();
+        }
+    }
+}
+
+#if defined(ENABLE_IPV6) && !defined(_WIN32)
+/**
+ * Happy Eyeballs connection attempt on a file descriptor separate
+ * from the owner's. The owner takes over the file descriptor of the
+ * first attempt to connect.
+ */
+class TcpSocket::ConnectAttempt : public StreamSocket
+{
+public:
+    ConnectAttempt(ISocketHandler& h, TcpSocket *owner) : StreamSocket(h), m_owner(owner)
+    {
+        SetDeleteByHandler();
+    }
+
+    bool Open(SocketAddress& ad)
+    {
+        SOCKET s = CreateSocket(ad.GetFamily(), SOCK_STREAM, "tcp");
+        if (s == INVALID_SOCKET)
+        {
+            return false;
+        }
+        if (!SetNonblocking(true, s))
+        {
+            closesocket(s);
+            return false;
+        }
+        if (connect(s, ad, ad) == -1 && Errno != EINPROGRESS)
+        {
+            Handler().LogError(this, "connect: failed", Errno, StrError(Errno), LOG_LEVEL_INFO);
+            closesocket(s);
+            return false;
+        }
+        // an immediate connect is reported by OnWrite as well
+        Attach(s);
+        SetConnecting(true);
+        m_address = ad.GetCopy();
+        return true;
+    }
+
+    void OnWrite()
+    {
+        if (Connecting())
+        {
+            Done(SoError());
+        }
+    }
+
+    void OnException()
+    {
+        if (Connecting())
+        {
+            Done(SoError());
+        }
+    }
+
+    void OnConnectTimeout()
+    {
+        Done(-1);
+    }
+
+    void OnOptions(int, int, int, SOCKET)
+    {
+#ifdef SO_NOSIGPIPE
+        SetSoNosigpipe(true);
+#endif
+        SetSoReuseaddr(true);
+        SetSoKeepalive(true);
+    }
+
+    int Protocol()
+    {
+        return IPPROTO_TCP;
+    }
+
+    TcpSocket *m_owner; ///< NULL when the race is over
+    std::unique_ptr<SocketAddress> m_address;
+
+private:
+    void Done(int err)
+    {
+        SetConnecting(false);
+        Handler().ISocketHandler_Mod(this, false, false);
+        if (!m_owner)
+        {
+            SetCloseAndDelete();
+        }
+        else if (err)
+        {
+            Handler().LogError(this, "tcp: connect failed", err, err == -1 ? "connect timeout" : StrError(err), LOG_LEVEL_INFO);
+            m_owner -> HappyEyeballsLost(this);
+        }
+        else
+        {
+            m_owner -> HappyEyeballsWin(this);
+        }
+    }
+};
+
+
+void TcpSocket::SetHappyEyeballs(bool x)
+{
+    m_b_happy_eyeballs = x;
+}
+
+
+bool TcpSocket::HappyEyeballs()
+{
+    return m_b_happy_eyeballs;
+}
+
+
+bool TcpSocket::OpenHappyEyeballs(const std::string& host, port_t port)
+{
+    HappyEyeballsStop();
+    m_b_he_racing = true;
+    m_b_he_own_failed = false;
+    m_he_last_attempt = 0;
+#ifdef ENABLE_RESOLVER
+    if (Handler().ResolverEnabled())
+    {
+        m_he_resolving = 2;
+        m_resolver_id6 = Resolve6(host, port);
+        m_resolver_id = Resolve(host, port);
+        return true;
+    }
+#endif
+    in6_addr a6;
+    if (Utility::u2ip(host, a6))
+    {
+        m_he_candidates.push_back(std::unique_ptr<SocketAddress>(new Ipv6Address(a6, port)));
+    }
+    ipaddr_t l;
+    if (Utility::u2ip(host, l))
+    {
+        m_he_candidates.push_back(std::unique_ptr<SocketAddress>(new Ipv4Address(l, port)));
+    }
+    HappyEyeballsNext();
+    if (GetSocket() == INVALID_SOCKET) // no address, or every connect failed at once
+    {
+        HappyEyeballsStop();
+        SetCloseAndDelete();
+        return false;
+    }
+    return true;
+}
+
+
+void TcpSocket::HappyEyeballsResolved(SocketAddress *ad)
+{
+    if (ad)
+    {
+        if (ad -> GetFamily() == AF_INET6)
+        {
+            m_he_candidates.push_front(std::unique_ptr<SocketAddress>(ad));
+            Handler().RemoveTimer(this, TCP_TIMER_HE_RESOLUTION);
+        }
+        else
+        {
+            m_he_candidates.push_back(std::unique_ptr<SocketAddress>(ad));
+            if (!m_he_last_attempt && m_he_resolving)
+            {
+                // give the ipv6 answer a moment before connecting with ipv4
+                Handler().AddTimer(this, TCP_HE_RESOLUTION_DELAY, TCP_TIMER_HE_RESOLUTION);
+                return;
+            }
+        }
+    }
+    else if (!m_he_last_attempt && !m_he_resolving)
+    {
+        // ipv6 lookup failed during resolution delay
+        Handler().RemoveTimer(this, TCP_TIMER_HE_RESOLUTION);
+    }
+    if (!m_he_candidates.empty())
+    {
+        bool own = GetSocket() != INVALID_SOCKET && Connecting() && !m_b_he_own_failed;
+        if (!own && m_he_attempts.empty()) // no attempt in progress
+        {
+            HappyEyeballsNext();
+            if (GetSocket() != INVALID_SOCKET && !Handler().Valid(this))
+            {
+                Handler().Add(this);
+            }
+        }
+        else
+        {
+            mytime_t t = m_he_last_attempt + TCP_HE_ATTEMPT_DELAY;
+            mytime_t now = EventTime::Tick();
+            Handler().AddTimer(this, t > now ? (long)(t - now) : 0, TCP_TIMER_HE_ATTEMPT);
+        }
+    }
+    HappyEyeballsCheck();
+}
+
+
+void TcpSocket::HappyEyeballsNext()
+{
+    Handler().RemoveTimer(this, TCP_TIMER_HE_ATTEMPT);
+    while (!m_he_candidates.empty())
+    {
+        std::unique_ptr<SocketAddress> ad = std::move(m_he_candidates.front());
+        m_he_candidates.pop_front();
+        if (GetSocket() == INVALID_SOCKET)
+        {
+            // first attempt is made on own file descriptor
+            if (Open(*ad))
+            {
+                m_he_last_attempt = EventTime::Tick();
+                if (!Connecting()) // connected at once
+                {
+                    HappyEyeballsStop();
+                    return;
+                }
+                break;
+            }
+            SetCloseAndDelete(false);
+            continue;
+        }
+        ConnectAttempt *p = new ConnectAttempt(Handler(), this);
+        if (p -> Open(*ad))
+        {
+            m_he_last_attempt = EventTime::Tick();
+            m_he_attempts.push_back(p);
+            Handler().Add(p);
+            break;
+        }
+        delete p;
+    }
+    if (!m_he_candidates.empty())
+    {
+        Handler().AddTimer(this, TCP_HE_ATTEMPT_DELAY, TCP_TIMER_HE_ATTEMPT);
+    }
+}
+
+
+bool TcpSocket::HappyEyeballsFailed()
+{
+    m_b_he_own_failed = true;
+    Handler().ISocketHandler_Del(this);
+    if (!m_he_candidates.empty())
+    {
+        HappyEyeballsNext();
+    }
+    if (HappyEyeballsPending())
+    {
+        return true;
+    }
+    HappyEyeballsStop();
+    return false;
+}
+
+
+void TcpSocket::HappyEyeballsWin(ConnectAttempt *p)
+{
+    m_he_attempts.remove(p);
+    p -> m_owner = NULL;
+    p -> SetCloseAndDelete();
+    // keep own file descriptor number, the sockethandler knows this socket by it
+    Handler().ISocketHandler_Del(this);
+    if (dup2(p -> GetSocket(), GetSocket()) == -1)
+    {
+        Handler().LogError(this, "dup2", Errno, StrError(Errno), LOG_LEVEL_FATAL);
+        HappyEyeballsStop();
+        SetConnecting(false);
+        SetCloseAndDelete();
+        OnConnectFailed();
+        return;
+    }
+    HappyEyeballsStop();
+    SetClientRemoteAddress(*p -> m_address);
+    SetRemoteAddress(*p -> m_address);
+    SetConnecting(false);
+    if (Handler().Valid(this))
+    {
+        Handler().ISocketHandler_Add(this, !IsDisableRead() && !m_read_paused, false);
+    }
+    SetCallOnConnect();
+}
+
+
+void TcpSocket::HappyEyeballsLost(ConnectAttempt *p)
+{
+    m_he_attempts.remove(p);
+    p -> m_owner = NULL;
+    p -> SetCloseAndDelete();
+    if (!m_he_candidates.empty())
+    {
+        HappyEyeballsNext();
+    }
+    HappyEyeballsCheck();
+}
+
+
+bool TcpSocket::HappyEyeballsPending()
+{
+    bool own = GetSocket() != INVALID_SOCKET && Connecting() && !m_b_he_own_failed;
+    return own || !m_he_attempts.empty() || !m_he_candidates.empty() || m_he_resolving;
+}
+
+
+void TcpSocket::HappyEyeballsCheck()
+{
+    if (!m_b_he_racing || HappyEyeballsPending())
+    {
+        return;
+    }
+    HappyEyeballsStop();
+    Handler().LogError(this, "connect", 0, "all connection attempts failed", LOG_LEVEL_FATAL);
+    SetConnecting(false);
+    SetCloseAndDelete(true);
+    OnConnectFailed();
+}
+
+
+void TcpSocket::HappyEyeballsStop()
+{
+    if (!m_b_he_racing)
+    {
+        return;
+    }
+    Handler().RemoveTimer(this, TCP_TIMER_HE_ATTEMPT);
+    Handler().RemoveTimer(this, TCP_TIMER_HE_RESOLUTION);
+    for (auto p : m_he_attempts)
+    {
+        p -> m_owner = NULL;
+        p -> SetCloseAndDelete();
+    }
+    m_he_attempts.clear();
+    m_he_candidates.clear();
+    m_b_he_racing = false;
+}
+#endif
+
+
+TcpSocket::OUTPUT::OUTPUT() : _b(0), _t(0), _q(0), _buf(new char[TCP_OUTPUT_CAPACITY]), _fd(-1), _zc(false), _zc_seq(0)
+{
+}
+
+TcpSocket::OUTPUT::OUTPUT(const char *buf, size_t len) : _b(0), _t(len), _q(len), _buf(new char[TCP_OUTPUT_CAPACITY]), _fd(-1), _zc(false), _zc_seq(0)
+{
+    memcpy(_buf, buf, len);
+}
+
+TcpSocket::OUTPUT::OUTPUT(const SharedBuffer& shared, size_t offset)
+    : _b(offset)
+    , _t(shared.Len())
+    , _q(shared.Len() - offset)
+    , _buf(NULL)
+    , _shared(shared)
+    , _fd(-1)
+    , _zc(false)
+    , _zc_seq(0)
+{
+}
+
+TcpSocket::OUTPUT::OUTPUT(int fd, off_t offset, size_t len)
+    : _b(offset)
+    , _t(offset + len)
+    , _q(len)
+    , _buf(NULL)
+    , _fd(fd)
+    , _zc(false)
+    , _zc_seq(0)
+{
+}
+
+TcpSocket::OUTPUT::~OUTPUT()
+{
+    delete[] _buf;
+#ifndef _WIN32
+    if (_fd != -1)
+    {
+        close(_fd);
+    }
+#endif
+}
+
+size_t TcpSocket::OUTPUT::Space()
+{
+    return _buf ? TCP_OUTPUT_CAPACITY - _t : 0;
+}
+
+void TcpSocket::OUTPUT::Add(const char *buf, size_t len)
+{
+    memcpy(_buf + _t, buf, len);
+    _t += len;
+    _q += len;
+}
+
+size_t TcpSocket::OUTPUT::Remove(size_t len)
+{
+    _b += len;
+    _q -= len;
+    return _q;
+}
+
+const char *TcpSocket::OUTPUT::Buf()
+{
+    if (_fd != -1)
+    {
+        return NULL;
+    }
+    return (_buf ? _buf : _shared.Data()) + _b;
 }
 
 size_t TcpSocket::OUTPUT::Len()
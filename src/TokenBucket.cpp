@@ -0,0 +1,99 @@
+#include "TokenBucket.h"
+
+namespace dai {
+
+TokenBucket::TokenBucket()
+    : m_rate(0)
+    , m_burst(0)
+    , m_tokens(0)
+    , m_last(0)
+{
+}
+
+
+void TokenBucket::SetRate(uint64_t bytes_per_sec, uint64_t burst)
+{
+    m_rate = bytes_per_sec;
+    m_burst = burst ? burst : bytes_per_sec;
+    m_tokens = (double)m_burst;
+    m_last = EventTime::Tick();
+}
+
+
+uint64_t TokenBucket::Rate() const
+{
+    return m_rate;
+}
+
+
+uint64_t TokenBucket::Burst() const
+{
+    return m_burst;
+}
+
+
+bool TokenBucket::Enabled() const
+{
+    return m_rate != 0;
+}
+
+
+uint64_t TokenBucket::Available()
+{
+    if (!m_rate)
+    {
+        return (uint64_t)-1;
+    }
+    Refill();
+    return (uint64_t)m_tokens;
+}
+
+
+void TokenBucket::Consume(uint64_t n)
+{
+    if (!m_rate)
+    {
+        return;
+    }
+    m_tokens -= (double)n;
+    if (m_tokens < 0)
+    {
+        m_tokens = 0;
+    }
+}
+
+
+long TokenBucket::TimeUntilAvailable(uint64_t n)
+{
+    if (!m_rate)
+    {
+        return 0;
+    }
+    Refill();
+    if (n > m_burst)
+    {
+        n = m_burst;
+    }
+    if (m_tokens >= (double)n)
+    {
+        return 0;
+    }
+    return (long)(((double)n - m_tokens) * 1000000 / (double)m_rate) + 1;
+}
+
+
+void TokenBucket::Refill()
+{
+    mytime_t now = EventTime::Tick();
+    if (now > m_last)
+    {
+        m_tokens += (double)(now - m_last) * (double)m_rate / 1000000;
+        if (m_tokens > (double)m_burst)
+        {
+            m_tokens = (double)m_burst;
+        }
+    }
+    m_last = now;
+}
+
+}//namespace dai
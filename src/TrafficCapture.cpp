@@ -0,0 +1,397 @@
+#include "TrafficCapture.h"
+#include "IFile.h"
+#include "Utility.h"
+
+#include <cstring>
+
+namespace dai {
+
+// pcapng block types
+#define PCAPNG_SHB        0x0a0d0d0a
+#define PCAPNG_IDB        0x00000001
+#define PCAPNG_EPB        0x00000006
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+#define LINKTYPE_RAW      101
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+
+namespace {
+
+void put16(std::string& b, uint16_t x)
+{
+    b.append(reinterpret_cast<const char *>(&x), sizeof(x));
+}
+
+void put32(std::string& b, uint32_t x)
+{
+    b.append(reinterpret_cast<const char *>(&x), sizeof(x));
+}
+
+void put16n(std::string& b, uint16_t x)
+{
+    put16(b, htons(x));
+}
+
+void put32n(std::string& b, uint32_t x)
+{
+    put32(b, htonl(x));
+}
+
+uint16_t checksum(const unsigned char *p, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (p[i] << 8) | p[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+}
+
+
+TrafficCapture::Flow::Flow(socketuid_t id)
+    : id(id)
+    , ready(false)
+    , family(AF_INET)
+    , local_port(0)
+    , remote_port(0)
+    , bytes(0)
+    , capped(false)
+    , seq_out(0)
+    , seq_in(0)
+{
+    memset(local, 0, sizeof(local));
+    memset(remote, 0, sizeof(remote));
+}
+
+
+bool TrafficCapture::Flow::SetEndpoints(SOCKET s)
+{
+    struct sockaddr_storage l;
+    struct sockaddr_storage r;
+    socklen_t ll = sizeof(l);
+    socklen_t rl = sizeof(r);
+    if (getsockname(s, (struct sockaddr *)&l, &ll) == -1 ||
+        getpeername(s, (struct sockaddr *)&r, &rl) == -1 ||
+        l.ss_family != r.ss_family)
+    {
+        return false;
+    }
+    family = l.ss_family;
+    if (family == AF_INET)
+    {
+        struct sockaddr_in *lp = (struct sockaddr_in *)&l;
+        struct sockaddr_in *rp = (struct sockaddr_in *)&r;
+        memcpy(local, &lp -> sin_addr, 4);
+        memcpy(remote, &rp -> sin_addr, 4);
+        local_port = ntohs(lp -> sin_port);
+        remote_port = ntohs(rp -> sin_port);
+    }
+#ifdef ENABLE_IPV6
+    else if (family == AF_INET6)
+    {
+        struct sockaddr_in6 *lp = (struct sockaddr_in6 *)&l;
+        struct sockaddr_in6 *rp = (struct sockaddr_in6 *)&r;
+        memcpy(local, &lp -> sin6_addr, 16);
+        memcpy(remote, &rp -> sin6_addr, 16);
+        local_port = ntohs(lp -> sin6_port);
+        remote_port = ntohs(rp -> sin6_port);
+    }
+#endif
+    else
+    {
+        return false;
+    }
+    ready = true;
+    return true;
+}
+
+
+TrafficCapture::TrafficCapture(IFile *f, size_t slots, size_t snaplen)
+    : Thread(false)
+    , m_file(f)
+    , m_mask(0)
+    , m_snaplen(snaplen)
+    , m_ring(nullptr)
+    , m_data(nullptr)
+    , m_head(0)
+    , m_tail(0)
+    , m_sampling(1)
+    , m_sample_count(0)
+    , m_limit(0)
+    , m_captured(0)
+    , m_dropped(0)
+    , m_quit(false)
+{
+    size_t n = 1;
+    while (n < slots)
+        n <<= 1;
+    m_mask = n - 1;
+    m_ring = new Record[n];
+    m_data = new char[n * m_snaplen];
+    for (size_t i = 0; i < n; i++)
+    {
+        m_ring[i].seq.store(i, std::memory_order_relaxed);
+        m_ring[i].data = m_data + i * m_snaplen;
+    }
+    // start the writer when the ring is in place
+    SetRelease(true);
+}
+
+
+TrafficCapture::~TrafficCapture()
+{
+    m_quit = true;
+    while (IsRunning())
+    {
+        Utility::Sleep(1);
+    }
+    delete[] m_ring;
+    delete[] m_data;
+}
+
+
+void TrafficCapture::SetSampling(unsigned n)
+{
+    m_sampling = n;
+}
+
+
+unsigned TrafficCapture::Sampling() const
+{
+    return m_sampling;
+}
+
+
+void TrafficCapture::SetConnectionLimit(uint64_t bytes)
+{
+    m_limit = bytes;
+}
+
+
+uint64_t TrafficCapture::ConnectionLimit() const
+{
+    return m_limit;
+}
+
+
+std::unique_ptr<TrafficCapture::Flow> TrafficCapture::Sample(socketuid_t id)
+{
+    unsigned n = m_sampling;
+    if (!n || m_sample_count++ % n)
+    {
+        return nullptr;
+    }
+    return std::unique_ptr<Flow>(new Flow(id));
+}
+
+
+void TrafficCapture::Capture(Flow& flow, bool out, const char *buf, size_t caplen, size_t len)
+{
+    if (flow.capped || !len)
+    {
+        return;
+    }
+    uint64_t limit = m_limit;
+    if (limit)
+    {
+        if (flow.bytes >= limit)
+        {
+            flow.capped = true;
+            return;
+        }
+        if (caplen > limit - flow.bytes)
+            caplen = (size_t)(limit - flow.bytes);
+    }
+    if (caplen > m_snaplen)
+        caplen = m_snaplen;
+    flow.bytes += caplen;
+    Queue(flow, out ? RECORD_OUT : RECORD_IN, buf, caplen, len);
+    // also when the record was dropped, the stream then has a gap
+    if (out)
+    {
+        flow.seq_out += (uint32_t)len;
+    }
+    else
+    {
+        flow.seq_in += (uint32_t)len;
+    }
+}
+
+
+void TrafficCapture::Closed(Flow& flow)
+{
+    if (flow.ready)
+    {
+        Queue(flow, RECORD_FIN, nullptr, 0, 0);
+    }
+}
+
+
+uint64_t TrafficCapture::Captured() const
+{
+    return m_captured;
+}
+
+
+uint64_t TrafficCapture::Dropped() const
+{
+    return m_dropped;
+}
+
+
+void TrafficCapture::Queue(Flow& flow, int type, const char *buf, size_t caplen, size_t len)
+{
+    // bounded multi producer queue, a slot is free for position pos when its
+    // sequence equals pos and holds a record when it equals pos + 1
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    Record *r;
+    for (;;)
+    {
+        r = &m_ring[pos & m_mask];
+        size_t seq = r -> seq.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (!dif)
+        {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+        {
+            ++m_dropped;
+            return;
+        }
+        else
+        {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+    struct timeval tv;
+    Utility::GetTime(&tv);
+    r -> type = type;
+    r -> ts = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    r -> flow = flow;
+    r -> caplen = caplen;
+    r -> len = len;
+    if (caplen)
+        memcpy(r -> data, buf, caplen);
+    r -> seq.store(pos + 1, std::memory_order_release);
+    ++m_captured;
+}
+
+
+void TrafficCapture::Run()
+{
+    WriteHeader();
+    while (!m_quit && IsRunning())
+    {
+        if (!Drain())
+        {
+            Utility::Sleep(10);
+        }
+    }
+    Drain();
+}
+
+
+bool TrafficCapture::Drain()
+{
+    bool any = false;
+    for (;;)
+    {
+        Record& r = m_ring[m_tail & m_mask];
+        if (r.seq.load(std::memory_order_acquire) != m_tail + 1)
+            break;
+        WritePacket(r);
+        r.seq.store(m_tail + m_mask + 1, std::memory_order_release);
+        ++m_tail;
+        any = true;
+    }
+    return any;
+}
+
+
+void TrafficCapture::WriteHeader()
+{
+    m_block.clear();
+    // section header block
+    put32(m_block, PCAPNG_SHB);
+    put32(m_block, 28);
+    put32(m_block, PCAPNG_BYTE_ORDER);
+    put16(m_block, 1);
+    put16(m_block, 0);
+    put32(m_block, 0xffffffff); // section length unknown
+    put32(m_block, 0xffffffff);
+    put32(m_block, 28);
+    // interface description block, raw ip, microsecond timestamps
+    put32(m_block, PCAPNG_IDB);
+    put32(m_block, 20);
+    put16(m_block, LINKTYPE_RAW);
+    put16(m_block, 0);
+    put32(m_block, (uint32_t)(60 + m_snaplen));
+    put32(m_block, 20);
+    m_file -> fwrite(m_block.data(), 1, m_block.size());
+}
+
+
+void TrafficCapture::WritePacket(const Record& r)
+{
+    const Flow& f = r.flow;
+    bool out = r.type != RECORD_IN;
+    const uint8_t *src = out ? f.local : f.remote;
+    const uint8_t *dst = out ? f.remote : f.local;
+    size_t iplen = f.family == AF_INET ? 20 : 40;
+    size_t wire = iplen + 20 + r.len;
+    size_t cap = iplen + 20 + r.caplen;
+    uint16_t ipfield = wire > 65535 ? 65535 : (uint16_t)wire;
+
+    m_block.clear();
+    put32(m_block, PCAPNG_EPB);
+    put32(m_block, (uint32_t)(32 + ((cap + 3) & ~3)));
+    put32(m_block, 0); // interface id
+    put32(m_block, (uint32_t)(r.ts >> 32));
+    put32(m_block, (uint32_t)r.ts);
+    put32(m_block, (uint32_t)cap);
+    put32(m_block, (uint32_t)wire);
+    size_t ip = m_block.size();
+    if (f.family == AF_INET)
+    {
+        put16n(m_block, 0x4500);
+        put16n(m_block, ipfield);
+        put16n(m_block, 0);
+        put16n(m_block, 0x4000); // don't fragment
+        put16n(m_block, 0x4006); // ttl 64, tcp
+        put16n(m_block, 0);
+        m_block.append((const char *)src, 4);
+        m_block.append((const char *)dst, 4);
+        uint16_t sum = htons(checksum((const unsigned char *)m_block.data() + ip, 20));
+        memcpy(&m_block[ip + 10], &sum, 2);
+    }
+    else
+    {
+        put32n(m_block, 0x60000000);
+        put16n(m_block, 20 + r.len > 65535 ? 65535 : (uint16_t)(20 + r.len));
+        put16n(m_block, 0x0640); // tcp, hop limit 64
+        m_block.append((const char *)src, 16);
+        m_block.append((const char *)dst, 16);
+    }
+    put16n(m_block, out ? f.local_port : f.remote_port);
+    put16n(m_block, out ? f.remote_port : f.local_port);
+    put32n(m_block, out ? f.seq_out : f.seq_in);
+    put32n(m_block, out ? f.seq_in : f.seq_out);
+    uint8_t flags = TCP_FLAG_ACK | (r.type == RECORD_FIN ? TCP_FLAG_FIN : TCP_FLAG_PSH);
+    put16n(m_block, (5 << 12) | flags);
+    put16n(m_block, 0xffff); // window
+    put16n(m_block, 0); // checksum not computed, payload may be truncated
+    put16n(m_block, 0);
+    m_block.append(r.data, r.caplen);
+    m_block.append((4 - (cap & 3)) & 3, 0);
+    put32(m_block, (uint32_t)(32 + ((cap + 3) & ~3)));
+    m_file -> fwrite(m_block.data(), 1, m_block.size());
+}
+
+
+}//namespace dai
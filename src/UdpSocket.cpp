@@ -6,6 +6,10 @@
 #else
 #   include <cerrno>
 #endif
+#ifdef LINUX
+#   include <netinet/udp.h>
+#   include <linux/filter.h>
+#endif
 
 #include "ISocketHandler.h"
 #include "UdpSocket.h"
@@ -22,6 +26,12 @@
 
 namespace dai {
 
+#ifdef LINUX
+#define UDP_GRO_CONTROL CMSG_SPACE(sizeof(int))
+#define UDP_PACKET_CONTROL (CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(int)))
+#endif
+
+
 UdpSocket::UdpSocket(ISocketHandler& h, int ibufsz, bool ipv6, int retries) : Socket(h)
     , m_ibuf(new char[ibufsz])
     , m_ibufsz(ibufsz)
@@ -30,6 +40,15 @@ UdpSocket::UdpSocket(ISocketHandler& h, int ibufsz, bool ipv6, int retries) : So
     , m_last_size_written(-1)
     , m_retries(retries)
     , m_b_read_ts(false)
+    , m_batch_size(0)
+    , m_packet_pool(NULL)
+    , m_b_gro(false)
+    , m_b_gso(true)
+    , m_b_reuseport(false)
+    , m_b_flush_pending(false)
+    , m_queue_max(UDP_QUEUE_MAX)
+    , m_queue_dropped(0)
+    , m_b_queue_full(false)
 {
 #ifdef ENABLE_IPV6
 #ifdef IPPROTO_IPV6
@@ -41,8 +60,13 @@ UdpSocket::UdpSocket(ISocketHandler& h, int ibufsz, bool ipv6, int retries) : So
 
 UdpSocket::~UdpSocket()
 {
-    Close();
+    // already closed if deleted by the sockethandler
+    if (GetSocket() != INVALID_SOCKET)
+    {
+        Close();
+    }
     delete[] m_ibuf;
+    SetPacketReceive(false);
 }
 
 
@@ -133,6 +157,10 @@ int UdpSocket::Bind(SocketAddress& ad, int range)
     if (GetSocket() != INVALID_SOCKET)
     {
         SetNonblocking(true);
+        if (m_b_reuseport)
+        {
+            SetSoReuseport();
+        }
         int n = bind(GetSocket(), ad, ad);
         int tries = range;
         while (n == -1 && tries--)
@@ -151,6 +179,16 @@ int UdpSocket::Bind(SocketAddress& ad, int range)
         }
         m_bind_ok = true;
         m_port = ad.GetPort();
+        if (!m_port)
+        {
+            // ephemeral port, Release() sends to it
+            struct sockaddr_storage sa;
+            socklen_t sa_len = sizeof(sa);
+            if (getsockname(GetSocket(), (struct sockaddr *)&sa, &sa_len) != -1)
+            {
+                m_port = ntohs(sa.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&sa) -> sin6_port : ((struct sockaddr_in *)&sa) -> sin_port);
+            }
+        }
         return 0;
     }
     return -1;
@@ -258,23 +296,21 @@ void UdpSocket::CreateConnection()
 /** send to specified address */
 void UdpSocket::SendToBuf(const std::string& h, port_t p, const char *data, int len, int flags)
 {
+    bool ipv6 = false;
 #ifdef ENABLE_IPV6
 #ifdef IPPROTO_IPV6
-    if (IsIpv6())
-    {
-        Ipv6Address ad(h, p);
-        if (ad.IsValid())
-        {
-            SendToBuf(ad, data, len, flags);
-        }
-        return;
-    }
+    ipv6 = IsIpv6();
 #endif
 #endif
-    Ipv4Address ad(h, p);
-    if (ad.IsValid())
+    struct sockaddr_storage sa;
+    socklen_t sa_len = 0;
+    if (Handler().GetDestination(h, p, ipv6, sa, sa_len))
+    {
+        SendToBuf((struct sockaddr *)&sa, sa_len, data, len, flags);
+    }
+    else if (!Handler().QueueDestination(this, h, p, ipv6, data, len, flags))
     {
-        SendToBuf(ad, data, len, flags);
+        Handler().LogError(this, "SendToBuf", 0, "no address for " + h + ", datagram dropped", LOG_LEVEL_WARNING);
     }
 }
 
@@ -299,15 +335,21 @@ void UdpSocket::SendToBuf(in6_addr a, port_t p, const char *data, int len, int f
 
 
 void UdpSocket::SendToBuf(SocketAddress& ad, const char *data, int len, int flags)
+{
+    SendToBuf((struct sockaddr *)ad, (socklen_t)ad, data, len, flags);
+}
+
+
+void UdpSocket::SendToBuf(struct sockaddr *sa, socklen_t sa_len, const char *data, int len, int flags)
 {
     if (GetSocket() == INVALID_SOCKET)
     {
-        Attach(CreateSocket(ad.GetFamily(), SOCK_DGRAM, "udp"));
+        Attach(CreateSocket(sa -> sa_family, SOCK_DGRAM, "udp"));
     }
     if (GetSocket() != INVALID_SOCKET)
     {
         SetNonblocking(true);
-        if ((m_last_size_written = sendto(GetSocket(), data, len, flags, ad, ad)) == -1)
+        if ((m_last_size_written = sendto(GetSocket(), data, len, flags, sa, sa_len)) == -1)
         {
             Handler().LogError(this, "sendto", Errno, StrError(Errno), LOG_LEVEL_ERROR);
         }
@@ -364,6 +406,398 @@ void UdpSocket::Send(const std::string& str, int flags)
 }
 
 
+void UdpSocket::QueueSendTo(SocketAddress& ad, const char *data, size_t len)
+{
+    if (GetSocket() == INVALID_SOCKET)
+    {
+        Attach(CreateSocket(ad.GetFamily(), SOCK_DGRAM, "udp"));
+        SetNonblocking(true);
+    }
+    if (GetSocket() == INVALID_SOCKET)
+    {
+        return;
+    }
+    QueueDatagram((struct sockaddr *)ad, (socklen_t)ad, data, len);
+}
+
+
+void UdpSocket::QueueSend(const char *data, size_t len)
+{
+    if (!IsConnected())
+    {
+        Handler().LogError(this, "QueueSend", 0, "not connected", LOG_LEVEL_ERROR);
+        return;
+    }
+    QueueDatagram(NULL, 0, data, len);
+}
+
+
+void UdpSocket::QueueDatagram(struct sockaddr *sa, socklen_t sa_len, const char *data, size_t len)
+{
+    if (m_queue.size() >= m_queue_max)
+    {
+        // the socket does not keep up, drop new datagrams
+        if (!m_b_queue_full)
+        {
+            Handler().LogError(this, "QueueSend", 0, "send queue full, dropping datagrams", LOG_LEVEL_WARNING);
+            m_b_queue_full = true;
+        }
+        m_queue_dropped++;
+        return;
+    }
+    Queued q;
+    q.offset = m_queue_buf.size();
+    q.len = len;
+    q.addr_len = sa_len;
+    if (sa_len)
+    {
+        memcpy(&q.addr, sa, sa_len);
+    }
+    m_queue.push_back(q);
+    m_queue_buf.insert(m_queue_buf.end(), data, data + len);
+    if (!m_b_flush_pending)
+    {
+        m_b_flush_pending = true;
+        Handler().AddFlush(this);
+    }
+}
+
+
+void UdpSocket::SetQueueLimit(size_t n)
+{
+    m_queue_max = n;
+}
+
+
+uint64_t UdpSocket::QueueDropped() const
+{
+    return m_queue_dropped;
+}
+
+
+void UdpSocket::Flush()
+{
+    m_b_flush_pending = false;
+    size_t i = 0;
+    bool wait = false;
+    while (i < m_queue.size() && !wait)
+    {
+#ifdef LINUX
+        struct mmsghdr msgs[UDP_BATCH_SIZE];
+        struct iovec iov[UDP_BATCH_SIZE];
+        unsigned int n = 0;
+        for (; n < UDP_BATCH_SIZE && i + n < m_queue.size(); n++)
+        {
+            Queued& q = m_queue[i + n];
+            iov[n].iov_base = &m_queue_buf[q.offset];
+            iov[n].iov_len = q.len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = q.addr_len ? &q.addr : NULL;
+            msgs[n].msg_hdr.msg_namelen = q.addr_len;
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+        int r = sendmmsg(GetSocket(), msgs, n, 0);
+        if (r > 0)
+        {
+            m_last_size_written = msgs[r - 1].msg_len;
+            i += r;
+            continue;
+        }
+        const char *call = "sendmmsg";
+#else
+        Queued& q = m_queue[i];
+        m_last_size_written = q.addr_len ?
+            sendto(GetSocket(), &m_queue_buf[q.offset], (int)q.len, 0, (struct sockaddr *)&q.addr, q.addr_len) :
+            send(GetSocket(), &m_queue_buf[q.offset], (int)q.len, 0);
+        if (m_last_size_written != -1)
+        {
+            i++;
+            continue;
+        }
+        const char *call = "sendto";
+#endif
+#ifdef _WIN32
+        if (Errno == WSAEWOULDBLOCK)
+#else
+        if (Errno == EWOULDBLOCK)
+#endif
+        {
+            // continue when writable
+            Handler().ISocketHandler_Mod(this, true, true);
+            wait = true;
+        }
+        else
+        {
+            // error is for the first datagram, drop it
+            Handler().LogError(this, call, Errno, StrError(Errno), LOG_LEVEL_ERROR);
+            i++;
+        }
+    }
+    if (!i)
+    {
+        return;
+    }
+    m_b_queue_full = false;
+    m_queue.erase(m_queue.begin(), m_queue.begin() + i);
+    if (m_queue.empty())
+    {
+        m_queue_buf.clear();
+    }
+    else if (m_queue[0].offset >= m_queue_buf.size() / 2)
+    {
+        // most of the buffer is sent, move the rest to the front
+        size_t offset = m_queue[0].offset;
+        m_queue_buf.erase(m_queue_buf.begin(), m_queue_buf.begin() + offset);
+        for (auto& q : m_queue)
+        {
+            q.offset -= offset;
+        }
+    }
+}
+
+
+void UdpSocket::OnWrite()
+{
+    Handler().ISocketHandler_Mod(this, true, false);
+    Flush();
+}
+
+
+void UdpSocket::SendToSegmented(SocketAddress& ad, const char *data, size_t len, size_t segment)
+{
+    if (GetSocket() == INVALID_SOCKET)
+    {
+        Attach(CreateSocket(ad.GetFamily(), SOCK_DGRAM, "udp"));
+    }
+    if (GetSocket() != INVALID_SOCKET)
+    {
+        SetNonblocking(true);
+        SendSegments(ad, ad, data, len, segment);
+    }
+}
+
+
+void UdpSocket::SendSegmented(const char *data, size_t len, size_t segment)
+{
+    if (!IsConnected())
+    {
+        Handler().LogError(this, "SendSegmented", 0, "not connected", LOG_LEVEL_ERROR);
+        return;
+    }
+    SendSegments(NULL, 0, data, len, segment);
+}
+
+
+void UdpSocket::SendSegments(struct sockaddr *sa, socklen_t sa_len, const char *data, size_t len, size_t segment)
+{
+    if (!segment)
+    {
+        return;
+    }
+#if defined(LINUX) && defined(UDP_SEGMENT)
+    size_t max = UDP_GSO_MAX_SIZE / segment;
+    if (max > UDP_GSO_MAX_SEGMENTS)
+    {
+        max = UDP_GSO_MAX_SEGMENTS;
+    }
+    while (m_b_gso && len > segment && max > 1)
+    {
+        size_t n = len < max * segment ? len : max * segment;
+        struct msghdr msg;
+        struct iovec vec;
+        union
+        {
+            struct cmsghdr cm;
+            char data[ CMSG_SPACE(sizeof(uint16_t)) ];
+        } cmsg_un;
+        memset(&msg, 0, sizeof(msg));
+        memset(&cmsg_un, 0, sizeof(cmsg_un));
+        vec.iov_base = const_cast<char *>(data);
+        vec.iov_len = n;
+        msg.msg_name = sa;
+        msg.msg_namelen = sa_len;
+        msg.msg_iov = &vec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_un.data;
+        msg.msg_controllen = sizeof(cmsg_un.data);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg -> cmsg_level = SOL_UDP;
+        cmsg -> cmsg_type = UDP_SEGMENT;
+        cmsg -> cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = (uint16_t)segment;
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        if ((m_last_size_written = sendmsg(GetSocket(), &msg, 0)) == -1)
+        {
+            if (Errno != EIO)
+            {
+                Handler().LogError(this, "sendmsg", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+                return;
+            }
+            // no checksum offload on the route, send datagrams one by one from now on
+            m_b_gso = false;
+            Handler().LogError(this, "SendSegments", Errno, "udp segmentation offload not available", LOG_LEVEL_INFO);
+            break;
+        }
+        data += n;
+        len -= n;
+    }
+#endif
+    while (len)
+    {
+        size_t n = len < segment ? len : segment;
+        m_last_size_written = sa_len ? sendto(GetSocket(), data, (int)n, 0, sa, sa_len) : send(GetSocket(), data, (int)n, 0);
+        if (m_last_size_written == -1)
+        {
+            Handler().LogError(this, "sendto", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+
+void UdpSocket::SetReuseport(bool x)
+{
+    m_b_reuseport = x;
+}
+
+
+bool UdpSocket::SetReuseportSteering(size_t n)
+{
+#if defined(LINUX) && defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (!n)
+    {
+        return false;
+    }
+    // offsets from the ip header, options not supported
+    bool ipv6 = false;
+#ifdef ENABLE_IPV6
+#ifdef IPPROTO_IPV6
+    ipv6 = IsIpv6();
+#endif
+#endif
+    uint32_t saddr = ipv6 ? 20 : 12; // last 32 bits of the source address
+    uint32_t sport = ipv6 ? 40 : 20;
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + saddr },
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        { BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + sport },
+        { BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9e3779b1 },
+        { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (setsockopt(GetSocket(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+    {
+        Handler().LogError(this, "setsockopt(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF)", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+        return false;
+    }
+    return true;
+#else
+    Handler().LogError(this, "socket option not available", 0, "SO_ATTACH_REUSEPORT_CBPF", LOG_LEVEL_INFO);
+    return false;
+#endif
+}
+
+
+void UdpSocket::SetGro(bool x)
+{
+#if defined(LINUX) && defined(UDP_GRO)
+    if (GetSocket() == INVALID_SOCKET)
+    {
+        CreateConnection();
+    }
+    if (x && m_b_read_ts && !m_packet_pool)
+    {
+        // the timestamp read path receives one datagram at a time
+        Handler().LogError(this, "SetGro", 0, "not available with read timestamps, use packet receive", LOG_LEVEL_WARNING);
+        return;
+    }
+    int val = x ? 1 : 0;
+    if (setsockopt(GetSocket(), SOL_UDP, UDP_GRO, (char *)&val, sizeof(val)) == -1)
+    {
+        Handler().LogError(this, "SetGro", Errno, StrError(Errno), LOG_LEVEL_WARNING);
+        return;
+    }
+    if (x && m_ibufsz < UDP_GRO_BUFSZ)
+    {
+        // a coalesced read is truncated to the buffer size
+        delete[] m_ibuf;
+        m_ibufsz = UDP_GRO_BUFSZ;
+        m_ibuf = new char[m_ibufsz];
+        if (m_batch_size)
+        {
+            SetBatchReceive(m_batch_size);
+        }
+        if (m_packet_pool)
+        {
+            SetPacketReceive(false);
+            SetPacketReceive(true);
+        }
+    }
+    m_b_gro = x;
+    if (x && !m_batch_size)
+    {
+        SetBatchReceive();
+    }
+#else
+    Handler().LogError(this, "SetGro", 0, "UDP_GRO not available", LOG_LEVEL_WARNING);
+#endif
+}
+
+
+void UdpSocket::SetBatchReceive(size_t n)
+{
+#ifdef LINUX
+    m_batch_size = n;
+    m_batch_buf.resize(n * m_ibufsz);
+    m_batch_addr.resize(n);
+    m_batch.resize(n);
+    m_batch_msg.resize(n);
+    m_batch_iov.resize(n);
+    m_batch_control.resize(n * UDP_GRO_CONTROL);
+    for (size_t i = 0; i < n; i++)
+    {
+        m_batch_iov[i].iov_base = &m_batch_buf[i * m_ibufsz];
+        m_batch_iov[i].iov_len = m_ibufsz;
+        memset(&m_batch_msg[i], 0, sizeof(m_batch_msg[i]));
+        m_batch_msg[i].msg_hdr.msg_name = &m_batch_addr[i];
+        m_batch_msg[i].msg_hdr.msg_iov = &m_batch_iov[i];
+        m_batch_msg[i].msg_hdr.msg_iovlen = 1;
+        m_batch[i].buf = &m_batch_buf[i * m_ibufsz];
+        m_batch[i].sa = (struct sockaddr *)&m_batch_addr[i];
+    }
+#else
+    Handler().LogError(this, "SetBatchReceive", 0, "recvmmsg not available", LOG_LEVEL_WARNING);
+#endif
+}
+
+
+void UdpSocket::SetPacketReceive(bool x)
+{
+    if (m_packet_pool && !x && m_b_gro && m_b_read_ts && GetSocket() != INVALID_SOCKET)
+    {
+        Handler().LogError(this, "SetPacketReceive", 0, "UDP_GRO disabled, not available with read timestamps", LOG_LEVEL_WARNING);
+        SetGro(false);
+    }
+    if (m_packet_pool && !x)
+    {
+        for (auto b : m_packet_blocks)
+        {
+            m_packet_pool -> Put(b);
+        }
+        m_packet_blocks.clear();
+    }
+    m_packet_pool = x ? &Handler().GetPacketPool(m_ibufsz) : NULL;
+}
+
+
 #if defined(LINUX) || defined(MACOSX)
 int UdpSocket::ReadTS(char *ioBuf, int inBufSize, struct sockaddr *from, socklen_t fromlen, struct timeval *ts)
 {
@@ -431,8 +865,201 @@ int UdpSocket::ReadTS(char *ioBuf, int inBufSize, struct sockaddr *from, socklen
 #endif
 
 
+#ifdef LINUX
+void UdpSocket::ReadBatch()
+{
+    int q = m_retries;
+    while (true)
+    {
+        for (size_t i = 0; i < m_batch_size; i++)
+        {
+            m_batch_msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            if (m_b_gro)
+            {
+                m_batch_msg[i].msg_hdr.msg_control = &m_batch_control[i * UDP_GRO_CONTROL];
+                m_batch_msg[i].msg_hdr.msg_controllen = UDP_GRO_CONTROL;
+            }
+        }
+        int n = recvmmsg(GetSocket(), &m_batch_msg[0], (unsigned int)m_batch_size, MSG_DONTWAIT, NULL);
+        if (n == -1)
+        {
+            if (Errno != EWOULDBLOCK)
+                Handler().LogError(this, "recvmmsg", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+            return;
+        }
+        bool truncated = false;
+        for (int i = 0; i < n; i++)
+        {
+            m_batch[i].len = m_batch_msg[i].msg_len;
+            m_batch[i].sa_len = m_batch_msg[i].msg_hdr.msg_namelen;
+            if (m_batch_msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                truncated = true;
+            }
+        }
+        if (m_b_gro || truncated)
+        {
+            // one received buffer may hold several datagrams of gso_size bytes
+            m_gro.clear();
+            for (int i = 0; i < n; i++)
+            {
+                int gso_size = 0;
+                struct msghdr *msg = &m_batch_msg[i].msg_hdr;
+                if (msg -> msg_flags & MSG_TRUNC)
+                {
+                    Handler().LogError(this, "recvmmsg", 0, "datagram larger than input buffer, dropped", LOG_LEVEL_WARNING);
+                    continue;
+                }
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+                {
+                    if (cmsg -> cmsg_level == SOL_UDP && cmsg -> cmsg_type == UDP_GRO)
+                    {
+                        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                    }
+                }
+                size_t len = m_batch[i].len;
+                size_t off = 0;
+                do
+                {
+                    Datagram d = m_batch[i];
+                    d.buf += off;
+                    d.len = gso_size > 0 && len - off > (size_t)gso_size ? gso_size : len - off;
+                    m_gro.push_back(d);
+                    off += d.len;
+                } while (off < len);
+            }
+            if (!m_gro.empty())
+            {
+                this -> OnRawDataBatch(&m_gro[0], m_gro.size());
+            }
+        }
+        else
+        {
+            this -> OnRawDataBatch(&m_batch[0], n);
+        }
+        // a short batch emptied the receive queue
+        if ((size_t)n < m_batch_size || !q--)
+            break;
+    }
+}
+#endif
+
+
+void UdpSocket::ReadPackets()
+{
+    size_t n = m_batch_size ? m_batch_size : 1;
+    int q = m_retries;
+    while (true)
+    {
+        if (m_packet_blocks.size() < n)
+        {
+            m_packet_pool -> Get(m_packet_blocks, n - m_packet_blocks.size());
+        }
+#ifdef LINUX
+        m_packet_msg.resize(n);
+        m_packet_iov.resize(n);
+        m_packet_control.resize(n * UDP_PACKET_CONTROL);
+        for (size_t i = 0; i < n; i++)
+        {
+            PacketPool::Block *b = m_packet_blocks[i];
+            m_packet_iov[i].iov_base = b -> Data();
+            m_packet_iov[i].iov_len = m_ibufsz;
+            memset(&m_packet_msg[i], 0, sizeof(m_packet_msg[i]));
+            m_packet_msg[i].msg_hdr.msg_name = &b -> sa;
+            m_packet_msg[i].msg_hdr.msg_namelen = sizeof(b -> sa);
+            m_packet_msg[i].msg_hdr.msg_iov = &m_packet_iov[i];
+            m_packet_msg[i].msg_hdr.msg_iovlen = 1;
+            m_packet_msg[i].msg_hdr.msg_control = &m_packet_control[i * UDP_PACKET_CONTROL];
+            m_packet_msg[i].msg_hdr.msg_controllen = UDP_PACKET_CONTROL;
+        }
+        int r = recvmmsg(GetSocket(), &m_packet_msg[0], (unsigned int)n, MSG_DONTWAIT, NULL);
+        if (r == -1)
+        {
+            if (Errno != EWOULDBLOCK)
+                Handler().LogError(this, "recvmmsg", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+            return;
+        }
+        struct timeval now;
+        Utility::GetTime(&now);
+        for (int i = 0; i < r; i++)
+        {
+            PacketPool::Block *b = m_packet_blocks[i];
+            struct msghdr *msg = &m_packet_msg[i].msg_hdr;
+            b -> len = m_packet_msg[i].msg_len;
+            b -> sa_len = msg -> msg_namelen;
+            b -> ts = now;
+            b -> segment = 0;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+            {
+                if (cmsg -> cmsg_level == SOL_SOCKET && cmsg -> cmsg_type == SCM_TIMESTAMP)
+                {
+                    memcpy(&b -> ts, CMSG_DATA(cmsg), sizeof(b -> ts));
+                }
+                else if (cmsg -> cmsg_level == SOL_UDP && cmsg -> cmsg_type == UDP_GRO)
+                {
+                    int gso_size = 0;
+                    memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                    if (gso_size > 0 && (size_t)gso_size < b -> len)
+                        b -> segment = gso_size;
+                }
+            }
+        }
+#else
+        PacketPool::Block *b = m_packet_blocks[0];
+        socklen_t sa_len = sizeof(b -> sa);
+        int r = recvfrom(GetSocket(), b -> Data(), m_ibufsz, 0, (struct sockaddr *)&b -> sa, &sa_len);
+        if (r == -1)
+        {
+#ifdef _WIN32
+            if (Errno != WSAEWOULDBLOCK)
+#else
+            if (Errno != EWOULDBLOCK)
+#endif
+                Handler().LogError(this, "recvfrom", Errno, StrError(Errno), LOG_LEVEL_ERROR);
+            return;
+        }
+        b -> len = r;
+        b -> sa_len = sa_len;
+        Utility::GetTime(&b -> ts);
+        b -> segment = 0;
+        r = 1;
+#endif
+        // the filled buffers now belong to the packets, the rest is kept for the next read
+        m_packet_ready.assign(m_packet_blocks.begin(), m_packet_blocks.begin() + r);
+        m_packet_blocks.erase(m_packet_blocks.begin(), m_packet_blocks.begin() + r);
+        for (size_t i = 0; i < m_packet_ready.size(); i++)
+        {
+            Packet p(m_packet_ready[i]);
+#ifdef LINUX
+            if (m_packet_msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                Handler().LogError(this, "recvmmsg", 0, "datagram larger than input buffer, dropped", LOG_LEVEL_WARNING);
+                continue;
+            }
+#endif
+            this -> OnPacket(p);
+        }
+        // OnPacket may have disabled packet receive
+        if (!m_packet_pool || (size_t)r < n || !q--)
+            break;
+    }
+}
+
+
 void UdpSocket::OnRead()
 {
+    if (m_packet_pool)
+    {
+        ReadPackets();
+        return;
+    }
+#ifdef LINUX
+    if (m_batch_size && !m_b_read_ts)
+    {
+        ReadBatch();
+        return;
+    }
+#endif
 #ifdef ENABLE_IPV6
 #ifdef IPPROTO_IPV6
     if (IsIpv6())
@@ -815,6 +1442,37 @@ void UdpSocket::OnRawData(const char *buf, size_t len, struct sockaddr *sa, sock
 }
 
 
+void UdpSocket::OnRawDataBatch(const Datagram *datagrams, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        this -> OnRawData(datagrams[i].buf, datagrams[i].len, datagrams[i].sa, datagrams[i].sa_len);
+    }
+}
+
+
+void UdpSocket::OnPacket(Packet& p)
+{
+    // a coalesced packet holds datagrams of Segment() bytes, the last may be shorter
+    size_t segment = p.Segment() ? p.Segment() : p.Size();
+    size_t off = 0;
+    do
+    {
+        size_t len = p.Size() - off < segment ? p.Size() - off : segment;
+        if (m_b_read_ts)
+        {
+            struct timeval ts = p.Timestamp();
+            this -> OnRawData(p.Data() + off, len, p.SockAddr(), p.SockAddrLen(), &ts);
+        }
+        else
+        {
+            this -> OnRawData(p.Data() + off, len, p.SockAddr(), p.SockAddrLen());
+        }
+        off += len;
+    } while (off < p.Size());
+}
+
+
 port_t UdpSocket::GetPort()
 {
     return m_port;
@@ -829,6 +1487,11 @@ int UdpSocket::GetLastSizeWritten()
 
 void UdpSocket::SetTimestamp(bool x)
 {
+    if (x && m_b_gro && !m_packet_pool)
+    {
+        Handler().LogError(this, "SetTimestamp", 0, "not available with UDP_GRO, use packet receive", LOG_LEVEL_WARNING);
+        return;
+    }
     m_b_read_ts = x;
 }
 
@@ -13,6 +13,11 @@
 #   include <pthread.h>
 #   include <sys/types.h>
 #   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#ifdef HAVE_OPENSSL
+#   include <openssl/rand.h>
 #endif
 
 // --- stack
@@ -1103,6 +1108,34 @@ unsigned long Utility::Rnd()
 }
 
 
+bool Utility::RandomBytes(void *buf, size_t len)
+{
+#ifdef HAVE_OPENSSL
+    return RAND_bytes(static_cast<unsigned char *>(buf), (int)len) == 1;
+#elif defined(_WIN32)
+    return false;
+#else
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    size_t n = 0;
+    while (n < len)
+    {
+        ssize_t r = read(fd, static_cast<char *>(buf) + n, len - n);
+        if (r <= 0)
+        {
+            break;
+        }
+        n += r;
+    }
+    close(fd);
+    return n == len;
+#endif
+}
+
+
 Utility::Rng::Rng(unsigned long seed) : m_value(0)
 {
     m_tmp[0] = seed & 0xffffffffUL;
@@ -0,0 +1,77 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "Wakeup.h"
+#include "Lock.h"
+
+#include <cstring>
+#ifndef _WIN32
+#   include <fcntl.h>
+#endif
+
+namespace dai {
+
+
+Wakeup::Wakeup(port_t port)
+    : m_socket(socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))
+    , m_b_woken(false)
+{
+    memset(&m_sa, 0, sizeof(m_sa));
+    m_sa.sin_family = AF_INET;
+    m_sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    m_sa.sin_port = htons(port);
+    if (m_socket != INVALID_SOCKET)
+    {
+        // a full release socket must not block the worker
+#ifdef _WIN32
+        unsigned long l = 1;
+        ioctlsocket(m_socket, FIONBIO, &l);
+#else
+        fcntl(m_socket, F_SETFL, O_NONBLOCK);
+#endif
+    }
+}
+
+
+Wakeup::~Wakeup()
+{
+    Close();
+}
+
+
+void Wakeup::Wake()
+{
+    if (m_b_woken.exchange(true))
+    {
+        return;
+    }
+    Lock lock(m_mutex);
+    if (m_socket != INVALID_SOCKET)
+    {
+        sendto(m_socket, "\n", 1, 0, (struct sockaddr *)&m_sa, sizeof(m_sa));
+    }
+}
+
+
+void Wakeup::Reset()
+{
+    m_b_woken = false;
+}
+
+
+void Wakeup::Close()
+{
+    Lock lock(m_mutex);
+    if (m_socket != INVALID_SOCKET)
+    {
+        closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+    }
+}
+
+
+}//namespace dai
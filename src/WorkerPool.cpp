@@ -0,0 +1,103 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+#include "WorkerPool.h"
+#include "Lock.h"
+#include "Utility.h"
+
+namespace dai {
+
+
+WorkerPool::Worker::Worker(WorkerPool& pool)
+    : Thread(false)
+    , m_pool(pool)
+{
+    SetRelease(true);
+}
+
+
+WorkerPool::Worker::~Worker()
+{
+    while (IsRunning())
+    {
+        Utility::Sleep(1);
+    }
+}
+
+
+void WorkerPool::Worker::Run()
+{
+    while (!m_pool.m_quit)
+    {
+        m_pool.m_sem.Wait();
+        if (m_pool.m_quit)
+        {
+            break;
+        }
+        m_pool.Work();
+    }
+}
+
+
+WorkerPool::WorkerPool(size_t threads)
+    : m_threads(threads)
+    , m_quit(false)
+{
+}
+
+
+WorkerPool::~WorkerPool()
+{
+    Stop();
+}
+
+
+void WorkerPool::SetThreads(size_t n)
+{
+    Lock lock(m_mutex);
+    m_threads = n ? n : 1;
+}
+
+
+size_t WorkerPool::Threads() const
+{
+    return m_threads;
+}
+
+
+void WorkerPool::StartWorkers()
+{
+    while (m_workers.size() < m_threads)
+    {
+        m_workers.push_back(new Worker(*this));
+    }
+}
+
+
+void WorkerPool::Signal()
+{
+    m_sem.Post();
+}
+
+
+void WorkerPool::Stop()
+{
+    // Work is virtual, the workers end before the derived pool is destroyed
+    m_quit = true;
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        m_sem.Post();
+    }
+    for (auto p : m_workers)
+    {
+        delete p;
+    }
+    m_workers.clear();
+}
+
+
+}//namespace dai
@@ -0,0 +1,426 @@
+
+#ifdef _WIN32
+#   ifdef _MSC_VER
+#       pragma warning(disable:4786)
+#   endif
+#endif
+
+/**
+ * DnsClient against a stub name server on 127.0.0.1, answering over udp
+ * and tcp from the same port.
+ */
+
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+
+#include "SocketHandler.h"
+#include "TcpSocket.h"
+#include "UdpSocket.h"
+#include "ListenSocket.h"
+#include "DnsClient.h"
+#include "Ipv4Address.h"
+#include "StdLog.h"
+#include "Utility.h"
+
+#ifdef ENABLE_RESOLVER
+
+using namespace dai;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); failures++; } } while (0)
+
+
+void Put16(std::string& s, int x)
+{
+    s += (char)(x >> 8);
+    s += (char)(x & 0xff);
+}
+
+
+void PutName(std::string& s, const std::string& name)
+{
+    size_t i = 0;
+    while (i < name.size())
+    {
+        size_t x = name.find('.', i);
+        if (x == std::string::npos)
+        {
+            x = name.size();
+        }
+        s += (char)(x - i);
+        s += name.substr(i, x - i);
+        i = x + 1;
+    }
+    s += '\0';
+}
+
+
+/** Resource record with a compressed owner name, pointing at offset. */
+void PutRecord(std::string& s, int offset, int type, const std::string& rdata)
+{
+    Put16(s, 0xc000 | offset);
+    Put16(s, type);
+    Put16(s, 1);   // class IN
+    Put16(s, 0);
+    Put16(s, 60);  // ttl
+    Put16(s, (int)rdata.size());
+    s += rdata;
+}
+
+
+/** Queries seen by the stub. */
+struct Stub
+{
+    std::map<std::string, int> udp;  ///< Name -> udp queries
+    std::map<std::string, int> tcp;  ///< Name -> tcp queries
+    std::set<port_t>           ports;
+    std::set<int>              ids;
+    UdpSocket                 *spoofer;
+};
+Stub stub;
+
+
+/**
+ * Answer to query q.
+ * \param drop Set if the query is not answered
+ */
+std::string Answer(const std::string& q, bool tcp, bool& drop)
+{
+    drop = false;
+    const unsigned char *m = reinterpret_cast<const unsigned char *>(q.data());
+    size_t p = 12;
+    std::string qname;
+    while (p < q.size() && m[p])
+    {
+        if (!qname.empty())
+        {
+            qname += '.';
+        }
+        qname.append(q, p + 1, m[p]);
+        p += m[p] + 1;
+    }
+    p++;
+    int qtype = (m[p] << 8) | m[p + 1];
+    p += 4;
+    int n = tcp ? stub.tcp[qname]++ : stub.udp[qname]++;
+    stub.ids.insert((m[0] << 8) | m[1]);
+    int flags = 0x8180; // response, rd, ra
+    int rcode = 0;
+    int count = 0;
+    std::string rr;
+    if (qname == "dead.test" || (qname == "slow.test" && !n))
+    {
+        drop = true;
+        return "";
+    }
+    if (qname == "nx.test")
+    {
+        rcode = 3;
+    }
+    else if (qname == "servfail.test" && !n)
+    {
+        rcode = 2;
+    }
+    else if (qname == "big.test" && !tcp)
+    {
+        flags |= 0x0200;
+    }
+    else if (qtype == 1 && qname == "cname.test")
+    {
+        // cname.test -> alias.test, then the A record of alias.test
+        std::string target;
+        PutName(target, "alias.test");
+        PutRecord(rr, 12, 5, target);
+        size_t alias = p + rr.size() - target.size();
+        std::string a("\x0a\x00\x00\x05", 4);
+        PutRecord(rr, (int)alias, 1, a);
+        count = 2;
+    }
+    else if (qtype == 1)
+    {
+        std::string a = qname == "big.test" ? std::string("\x0a\x00\x00\x02", 4) : std::string("\x0a\x00\x00\x01", 4);
+        PutRecord(rr, 12, 1, a);
+        count = 1;
+    }
+    else if (qtype == 12)
+    {
+        // "host" and a pointer to the question name
+        std::string name("\x04host\xc0\x0c", 7);
+        PutRecord(rr, 12, 12, name);
+        count = 1;
+    }
+    std::string r = q.substr(0, 2);
+    Put16(r, flags | rcode);
+    Put16(r, 1);
+    Put16(r, count);
+    Put16(r, 0);
+    Put16(r, 0);
+    r += q.substr(12, p - 12);
+    return r + rr;
+}
+
+
+class StubUdp : public UdpSocket
+{
+public:
+    StubUdp(ISocketHandler& h) : UdpSocket(h) {}
+
+    void OnRawData(const char *buf, size_t len, struct sockaddr *sa, socklen_t)
+    {
+        bool drop;
+        std::string a = Answer(std::string(buf, len), false, drop);
+        Ipv4Address ad(*reinterpret_cast<struct sockaddr_in *>(sa));
+        stub.ports.insert(ad.GetPort());
+        if (drop)
+        {
+            return;
+        }
+        if (a.find(std::string("\x05spoof", 6)) != std::string::npos)
+        {
+            // same id from another port, and a wrong id from the server port
+            std::string fake = a;
+            fake[fake.size() - 1] = 0x63;
+            stub.spoofer -> SendToBuf(ad, fake.data(), (int)fake.size());
+            fake = a;
+            fake[0] ^= 0x55;
+            fake[fake.size() - 1] = 0x64;
+            SendToBuf(ad, fake.data(), (int)fake.size());
+        }
+        SendToBuf(ad, a.data(), (int)a.size());
+    }
+};
+
+
+class StubTcp : public TcpSocket
+{
+public:
+    StubTcp(ISocketHandler& h) : TcpSocket(h) {}
+
+    void OnRawData(const char *buf, size_t len)
+    {
+        m_in.append(buf, len);
+        if (m_in.size() < 2)
+        {
+            return;
+        }
+        size_t n = ((unsigned char)m_in[0] << 8) | (unsigned char)m_in[1];
+        if (m_in.size() < n + 2)
+        {
+            return;
+        }
+        bool drop;
+        std::string a = Answer(m_in.substr(2, n), true, drop);
+        std::string r;
+        Put16(r, (int)a.size());
+        SendBuf(r.data(), r.size());
+        SendBuf(a.data(), a.size());
+        m_in.erase(0, n + 2);
+    }
+
+private:
+    std::string m_in;
+};
+
+
+/** Lookup results by id. */
+class Query : public TcpSocket
+{
+public:
+    Query(ISocketHandler& h) : TcpSocket(h) {}
+
+    void OnResolved(int id, ipaddr_t a, port_t)
+    {
+        Utility::l2ip(a, m_result[id]);
+    }
+
+    void OnReverseResolved(int id, const std::string& name)
+    {
+        m_result[id] = name;
+    }
+
+    void OnResolveFailed(int id)
+    {
+        m_result[id] = "failed";
+    }
+
+    bool Done(int id) const
+    {
+        return m_result.find(id) != m_result.end();
+    }
+
+    std::string Result(int id)
+    {
+        return m_result[id];
+    }
+
+    size_t Results() const
+    {
+        return m_result.size();
+    }
+
+private:
+    std::map<int, std::string> m_result;
+};
+
+
+class QuietLog : public StdLog
+{
+public:
+    void error(ISocketHandler *, Socket *, const std::string&, int, const std::string&, loglevel_t) {}
+};
+
+
+void Wait(SocketHandler& h, Query& q, size_t results)
+{
+    for (int i = 0; i < 100 && q.Results() < results; i++)
+    {
+        h.Select(0, 50000);
+    }
+}
+
+
+DnsClient& Client(SocketHandler& h, port_t port)
+{
+    DnsClient& dns = h.GetDnsClient();
+    dns.ClearServers();
+    dns.AddServer("127.0.0.1", port);
+    dns.SetTimeout(200000);
+    dns.SetAttempts(2);
+    h.EnableDnsClient();
+    return dns;
+}
+
+
+void TestQueries()
+{
+    QuietLog log;
+    SocketHandler h(&log);
+    ListenSocket<StubTcp> l(h);
+    l.Bind("127.0.0.1", 0);
+    h.Add(&l);
+    port_t port = l.GetPort();
+    StubUdp u(h);
+    u.Bind("127.0.0.1", port);
+    h.Add(&u);
+    UdpSocket spoofer(h);
+    port_t spoof_port = 0;
+    spoofer.Bind("127.0.0.1", spoof_port);
+    h.Add(&spoofer);
+    stub.spoofer = &spoofer;
+    Client(h, port);
+
+    Query q(h);
+    int a = q.Resolve("a.test", 80);
+    int cname = q.Resolve("cname.test", 80);
+    ipaddr_t ip;
+    Utility::u2ip("10.0.0.9", ip);
+    int ptr = q.Resolve(ip);
+    int nx = q.Resolve("nx.test", 80);
+    int servfail = q.Resolve("servfail.test", 80);
+    int slow = q.Resolve("slow.test", 80);
+    int dead = q.Resolve("dead.test", 80);
+    int big = q.Resolve("big.test", 80);
+    int spoof = q.Resolve("spoof.test", 80);
+    Wait(h, q, 9);
+
+    CHECK(q.Result(a) == "10.0.0.1");
+    // compressed names
+    CHECK(q.Result(cname) == "10.0.0.5");
+    CHECK(q.Result(ptr) == "host.9.0.0.10.in-addr.arpa");
+    // no retry after NXDOMAIN
+    CHECK(q.Result(nx) == "failed");
+    CHECK(stub.udp["nx.test"] == 1);
+    // SERVFAIL is retried
+    CHECK(q.Result(servfail) == "10.0.0.1");
+    CHECK(stub.udp["servfail.test"] == 2);
+    // timeout, then retried
+    CHECK(q.Result(slow) == "10.0.0.1");
+    CHECK(q.Result(dead) == "failed");
+    CHECK(stub.udp["dead.test"] == 2);
+    // truncated, asked again over tcp
+    CHECK(q.Result(big) == "10.0.0.2");
+    CHECK(stub.tcp["big.test"] == 1);
+    // answers from another port and with a wrong id are not taken
+    CHECK(q.Result(spoof) == "10.0.0.1");
+    // a source port and an id per query
+    CHECK(stub.ports.size() > 1);
+    CHECK(stub.ids.size() > 1);
+}
+
+
+void TestDeleteClient()
+{
+    QuietLog log;
+    SocketHandler h(&log);
+    StubUdp u(h);
+    port_t port = 0;
+    u.Bind("127.0.0.1", port);
+    h.Add(&u);
+    DnsClient& dns = Client(h, port);
+    h.Select(0, 10000);
+    size_t count = h.GetCount();
+    Query q(h);
+    int dead = q.Resolve("dead.test", 80);
+    h.Select(0, 10000);
+    CHECK(h.GetCount() == count + 1);
+    // pending lookups fail, their sockets are closed
+    delete &dns;
+    h.EnableDnsClient(false);
+    for (int i = 0; i < 5; i++)
+    {
+        h.Select(0, 10000);
+    }
+    CHECK(q.Result(dead) == "failed");
+    CHECK(h.GetCount() == count);
+}
+
+
+void TestDeleteHandler()
+{
+    QuietLog log;
+    SocketHandler h(&log);
+    StubUdp *u = new StubUdp(h);
+    u -> SetDeleteByHandler();
+    port_t port = 0;
+    u -> Bind("127.0.0.1", port);
+    h.Add(u);
+    Client(h, port);
+    Query *q = new Query(h);
+    q -> Resolve("dead.test", 80);
+    q -> Resolve("dead.test", 81);
+    h.Select(0, 10000);
+    // the client and the query sockets are deleted with the handler
+    delete q;
+}
+
+} // namespace
+
+
+int main()
+{
+    TestQueries();
+    TestDeleteClient();
+    TestDeleteHandler();
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("ok\n");
+    return 0;
+}
+
+#else
+
+int main()
+{
+    printf("ENABLE_RESOLVER not defined, skipped\n");
+    return 0;
+}
+
+#endif // ENABLE_RESOLVER